@@ -0,0 +1,710 @@
+/**************************************************************************/
+/*
+** Background I/O: read-ahead and write-behind for the codec loops.
+** Copyright (C) 2024 Jonathan Birge
+**
+***************************************************************************/
+/*
+** Data moves between the codec and a file descriptor in blocks of 1 MB.  A
+** writer fills a block and queues it; a reader takes blocks that were read
+** ahead.  Up to AIO_DEPTH blocks are in flight, so sector processing keeps
+** going while the disks are busy.  Two backends do the transfers:
+**
+**   thread  one helper thread per stream making plain read()/write() calls
+**   uring   io_uring, driven through the kernel interface.  Writes to
+**           regular files go out at explicit offsets, so several can be in
+**           flight at once; pipes are written and read one block at a time
+**           at the current position to keep the data in order.
+**
+** A writer can also queue memory it owns (such as a mapped input) in place
+** of a block, or claim a range of a regular file's offsets and fill it by
+** other means, like copy_file_range().
+**
+** ecm_aio_select() picks the backend at runtime.  "auto" uses io_uring when
+** it was enabled at configure time and the kernel allows it, otherwise the
+** thread; "sync" turns background I/O off and the callers use stdio.
+**
+***************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "ecm.h"
+#include "../config.h"
+
+#if defined(ENABLE_IO_URING) && defined(HAVE_LINUX_IO_URING_H) && \
+    defined(HAVE_SYS_MMAN_H)
+#define AIO_HAVE_URING 1
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+
+#define AIO_BLOCK_SIZE 1048576
+#define AIO_DEPTH 4
+
+/*
+** Block states.  A writer's block is FREE while the codec may fill it and
+** QUEUED once handed over.  A reader's block is FREE while it may be read
+** into, BUSY during a read and READY when it holds data for the codec.
+*/
+#define BLOCK_FREE 0
+#define BLOCK_QUEUED 1
+#define BLOCK_BUSY 2
+#define BLOCK_READY 3
+
+static const char *aio_backend_names[] = {"sync", "thread", "uring"};
+
+static int aio_backend = ECM_IO_AUTO;
+
+struct aio_block
+{
+    ecc_uint8 *data;
+    const ecc_uint8 *source;
+    size_t length;
+    size_t done;
+    unsigned long long offset;
+    int state;
+};
+
+#ifdef AIO_HAVE_URING
+struct aio_uring
+{
+    int fd;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring;
+    void *cq_ring;
+    size_t sq_ring_size;
+    size_t cq_ring_size;
+    size_t sqes_size;
+    unsigned inflight;
+};
+#endif
+
+struct ecm_aio
+{
+    int fd;
+    int writing;
+    int backend;
+    int seekable;
+    int error;
+    int eof;
+    int held;
+    int quit;
+    unsigned head;
+    unsigned tail;
+    unsigned long long offset;
+    struct aio_block blocks[AIO_DEPTH];
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+#ifdef AIO_HAVE_URING
+    struct aio_uring ring;
+#endif
+};
+
+/***************************************************************************/
+/*
+** Thread backend
+*/
+static void *aio_writer_thread(void *arg)
+{
+    ecm_aio *aio = arg;
+    pthread_mutex_lock(&aio->lock);
+    for (;;)
+    {
+        struct aio_block *block = &aio->blocks[aio->tail % AIO_DEPTH];
+        int error = 0;
+        while ((block->state != BLOCK_QUEUED) && !aio->quit)
+            pthread_cond_wait(&aio->changed, &aio->lock);
+        if (block->state != BLOCK_QUEUED)
+            break;
+        pthread_mutex_unlock(&aio->lock);
+        while (block->done < block->length)
+        {
+            ssize_t n;
+            if (aio->seekable)
+                n = pwrite(aio->fd, block->source + block->done,
+                           block->length - block->done, block->offset + block->done);
+            else
+                n = write(aio->fd, block->source + block->done,
+                          block->length - block->done);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+            {
+                error = n ? errno : EIO;
+                break;
+            }
+            block->done += n;
+        }
+        pthread_mutex_lock(&aio->lock);
+        if (error)
+            aio->error = error;
+        block->state = BLOCK_FREE;
+        aio->tail++;
+        pthread_cond_broadcast(&aio->changed);
+    }
+    pthread_mutex_unlock(&aio->lock);
+    return NULL;
+}
+
+/*
+** Cancellation is only enabled around read(), which may block on a pipe
+** that nobody will write to once the decoder has given up
+*/
+static void *aio_reader_thread(void *arg)
+{
+    ecm_aio *aio = arg;
+    int oldstate;
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldstate);
+    pthread_mutex_lock(&aio->lock);
+    for (;;)
+    {
+        struct aio_block *block = &aio->blocks[aio->tail % AIO_DEPTH];
+        ssize_t n;
+        while ((block->state != BLOCK_FREE) && !aio->quit)
+            pthread_cond_wait(&aio->changed, &aio->lock);
+        if (aio->quit)
+            break;
+        pthread_mutex_unlock(&aio->lock);
+        pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, &oldstate);
+        do
+            n = read(aio->fd, block->data, AIO_BLOCK_SIZE);
+        while (n < 0 && errno == EINTR);
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldstate);
+        pthread_mutex_lock(&aio->lock);
+        if (n < 0)
+            aio->error = errno;
+        block->length = (n > 0) ? n : 0;
+        block->state = BLOCK_READY;
+        aio->tail++;
+        pthread_cond_broadcast(&aio->changed);
+        if (n <= 0)
+            break;
+    }
+    pthread_mutex_unlock(&aio->lock);
+    return NULL;
+}
+
+#ifdef AIO_HAVE_URING
+/***************************************************************************/
+/*
+** io_uring backend
+*/
+static int uring_setup(struct aio_uring *r)
+{
+    struct io_uring_params p;
+    memset(r, 0, sizeof(*r));
+    memset(&p, 0, sizeof(p));
+    r->fd = syscall(__NR_io_uring_setup, 2 * AIO_DEPTH, &p);
+    if (r->fd < 0)
+        return -1;
+    /* Pipes are read and written at the current file position */
+    if (!(p.features & IORING_FEAT_RW_CUR_POS))
+    {
+        close(r->fd);
+        return -1;
+    }
+    r->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sq_ring = mmap(NULL, r->sq_ring_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    r->cq_ring = mmap(NULL, r->cq_ring_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+    r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if ((r->sq_ring == MAP_FAILED) || (r->cq_ring == MAP_FAILED) ||
+        (r->sqes == MAP_FAILED))
+    {
+        if (r->sq_ring != MAP_FAILED)
+            munmap(r->sq_ring, r->sq_ring_size);
+        if (r->cq_ring != MAP_FAILED)
+            munmap(r->cq_ring, r->cq_ring_size);
+        if (r->sqes != MAP_FAILED)
+            munmap(r->sqes, r->sqes_size);
+        close(r->fd);
+        return -1;
+    }
+    r->sq_tail = (unsigned *)((char *)r->sq_ring + p.sq_off.tail);
+    r->sq_mask = (unsigned *)((char *)r->sq_ring + p.sq_off.ring_mask);
+    r->sq_array = (unsigned *)((char *)r->sq_ring + p.sq_off.array);
+    r->cq_head = (unsigned *)((char *)r->cq_ring + p.cq_off.head);
+    r->cq_tail = (unsigned *)((char *)r->cq_ring + p.cq_off.tail);
+    r->cq_mask = (unsigned *)((char *)r->cq_ring + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)((char *)r->cq_ring + p.cq_off.cqes);
+    return 0;
+}
+
+static void uring_teardown(struct aio_uring *r)
+{
+    munmap(r->sqes, r->sqes_size);
+    munmap(r->cq_ring, r->cq_ring_size);
+    munmap(r->sq_ring, r->sq_ring_size);
+    close(r->fd);
+}
+
+/*
+** Queue and submit one operation; user_data is the block index
+*/
+static int uring_submit(
+    struct aio_uring *r,
+    int opcode,
+    int fd,
+    void *buf,
+    size_t len,
+    unsigned long long offset,
+    unsigned long long user_data)
+{
+    unsigned tail = *r->sq_tail;
+    unsigned index = tail & *r->sq_mask;
+    struct io_uring_sqe *sqe = &r->sqes[index];
+    int ret;
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long)buf;
+    sqe->len = len;
+    sqe->off = offset;
+    sqe->user_data = user_data;
+    r->sq_array[index] = index;
+    __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    do
+        ret = syscall(__NR_io_uring_enter, r->fd, 1, 0, 0, NULL, 0);
+    while (ret < 0 && errno == EINTR);
+    if (ret != 1)
+    {
+        if (ret >= 0)
+            errno = EIO;
+        return -1;
+    }
+    r->inflight++;
+    return 0;
+}
+
+/*
+** Wait for one completion
+*/
+static int uring_wait(struct aio_uring *r, unsigned long long *user_data, int *res)
+{
+    unsigned head = *r->cq_head;
+    while (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE))
+    {
+        if ((syscall(__NR_io_uring_enter, r->fd, 0, 1, IORING_ENTER_GETEVENTS,
+                     NULL, 0) < 0) &&
+            (errno != EINTR))
+            return -1;
+    }
+    *user_data = r->cqes[head & *r->cq_mask].user_data;
+    *res = r->cqes[head & *r->cq_mask].res;
+    __atomic_store_n(r->cq_head, head + 1, __ATOMIC_RELEASE);
+    r->inflight--;
+    return 0;
+}
+
+static int uring_write_block(ecm_aio *aio, struct aio_block *block)
+{
+    return uring_submit(&aio->ring, IORING_OP_WRITE, aio->fd,
+                        (void *)(block->source + block->done),
+                        block->length - block->done,
+                        aio->seekable ? block->offset + block->done : (unsigned long long)-1,
+                        block - aio->blocks);
+}
+
+/*
+** Start the next read if a block is free.  Reads are issued one at a time
+** since they go to the current position.
+*/
+static void uring_read_ahead(ecm_aio *aio)
+{
+    struct aio_block *block = &aio->blocks[aio->tail % AIO_DEPTH];
+    if (aio->eof || aio->ring.inflight || (block->state != BLOCK_FREE))
+        return;
+    block->state = BLOCK_BUSY;
+    if (uring_submit(&aio->ring, IORING_OP_READ, aio->fd, block->data,
+                     AIO_BLOCK_SIZE, (unsigned long long)-1, block - aio->blocks))
+    {
+        aio->error = errno;
+        aio->eof = 1;
+        block->length = 0;
+        block->state = BLOCK_READY;
+        aio->tail++;
+    }
+}
+
+/*
+** Wait for one transfer to finish and account for it
+*/
+static void uring_complete(ecm_aio *aio)
+{
+    unsigned long long user_data;
+    struct aio_block *block;
+    int res;
+    if (uring_wait(&aio->ring, &user_data, &res))
+    {
+        /* The ring itself failed; nothing more will complete */
+        aio->error = errno;
+        aio->eof = 1;
+        aio->ring.inflight = 0;
+        for (block = aio->blocks; block < aio->blocks + AIO_DEPTH; block++)
+            if (block->state == BLOCK_QUEUED)
+                block->state = BLOCK_FREE;
+            else if (block->state == BLOCK_BUSY)
+            {
+                block->length = 0;
+                block->state = BLOCK_READY;
+                aio->tail++;
+            }
+        return;
+    }
+    block = &aio->blocks[user_data];
+    if (aio->writing)
+    {
+        if ((res == -EINTR) || (res == -EAGAIN))
+            res = 0;
+        else if (res <= 0)
+        {
+            aio->error = res ? -res : EIO;
+            block->state = BLOCK_FREE;
+            return;
+        }
+        block->done += res;
+        if (block->done < block->length)
+        {
+            if (uring_write_block(aio, block))
+            {
+                aio->error = errno;
+                block->state = BLOCK_FREE;
+            }
+            return;
+        }
+        block->state = BLOCK_FREE;
+        return;
+    }
+    if ((res == -EINTR) || (res == -EAGAIN))
+    {
+        block->state = BLOCK_FREE;
+        uring_read_ahead(aio);
+        return;
+    }
+    if (res < 0)
+        aio->error = -res;
+    if (res <= 0)
+        aio->eof = 1;
+    block->length = (res > 0) ? res : 0;
+    block->state = BLOCK_READY;
+    aio->tail++;
+    uring_read_ahead(aio);
+}
+#endif
+
+/***************************************************************************/
+/*
+** Choose the backend by name; returns 0, or -1 if the name is unknown or
+** that backend was not built in
+*/
+int ecm_aio_select(const char *name)
+{
+    if (!strcmp(name, "auto"))
+        aio_backend = ECM_IO_AUTO;
+    else if (!strcmp(name, "sync"))
+        aio_backend = ECM_IO_SYNC;
+    else if (!strcmp(name, "thread"))
+        aio_backend = ECM_IO_THREAD;
+#ifdef AIO_HAVE_URING
+    else if (!strcmp(name, "uring"))
+        aio_backend = ECM_IO_URING;
+#endif
+    else
+        return -1;
+    return 0;
+}
+
+/*
+** Start background I/O on fd.  Returns NULL when background I/O is off or
+** could not be started, in which case the caller should use stdio.  An
+** io_uring that cannot be set up falls back to the thread.
+*/
+ecm_aio *ecm_aio_open(int fd, int writing)
+{
+    ecm_aio *aio;
+    struct stat st;
+    off_t start;
+    int i;
+    if (aio_backend == ECM_IO_SYNC)
+        return NULL;
+    aio = calloc(1, sizeof(*aio));
+    if (!aio)
+        return NULL;
+    aio->fd = fd;
+    aio->writing = writing;
+    for (i = 0; i < AIO_DEPTH; i++)
+    {
+        aio->blocks[i].data = malloc(AIO_BLOCK_SIZE);
+        if (!aio->blocks[i].data)
+        {
+            while (i--)
+                free(aio->blocks[i].data);
+            free(aio);
+            return NULL;
+        }
+    }
+    /* Appending writes land at the end whatever offset they are given */
+    if (!fstat(fd, &st) && S_ISREG(st.st_mode) &&
+        !(fcntl(fd, F_GETFL) & O_APPEND) &&
+        ((start = lseek(fd, 0, SEEK_CUR)) >= 0))
+    {
+        aio->seekable = 1;
+        aio->offset = start;
+    }
+    pthread_mutex_init(&aio->lock, NULL);
+    pthread_cond_init(&aio->changed, NULL);
+#ifdef AIO_HAVE_URING
+    if ((aio_backend != ECM_IO_THREAD) && !uring_setup(&aio->ring))
+    {
+        aio->backend = ECM_IO_URING;
+        if (!writing)
+            uring_read_ahead(aio);
+        return aio;
+    }
+    if (aio_backend == ECM_IO_URING)
+        fprintf(stderr, "io_uring is not available; using a thread\n");
+#endif
+    aio->backend = ECM_IO_THREAD;
+    if (!pthread_create(&aio->thread, NULL,
+                        writing ? aio_writer_thread : aio_reader_thread, aio))
+        return aio;
+    pthread_mutex_destroy(&aio->lock);
+    pthread_cond_destroy(&aio->changed);
+    for (i = 0; i < AIO_DEPTH; i++)
+        free(aio->blocks[i].data);
+    free(aio);
+    return NULL;
+}
+
+/*
+** Writer: get the next free block to fill; its size is AIO_BLOCK_SIZE
+*/
+ecc_uint8 *ecm_aio_buffer(ecm_aio *aio, size_t *size)
+{
+    struct aio_block *block = &aio->blocks[aio->head % AIO_DEPTH];
+    *size = AIO_BLOCK_SIZE;
+#ifdef AIO_HAVE_URING
+    if (aio->backend == ECM_IO_URING)
+    {
+        while (block->state != BLOCK_FREE)
+            uring_complete(aio);
+        return block->data;
+    }
+#endif
+    pthread_mutex_lock(&aio->lock);
+    while (block->state != BLOCK_FREE)
+        pthread_cond_wait(&aio->changed, &aio->lock);
+    pthread_mutex_unlock(&aio->lock);
+    return block->data;
+}
+
+static void aio_queue_write(ecm_aio *aio, const ecc_uint8 *source, size_t length)
+{
+    struct aio_block *block = &aio->blocks[aio->head++ % AIO_DEPTH];
+    block->source = source;
+    block->length = length;
+    block->done = 0;
+    block->offset = aio->offset;
+    aio->offset += length;
+#ifdef AIO_HAVE_URING
+    if (aio->backend == ECM_IO_URING)
+    {
+        /* Pipes only take one write at a time to keep the order */
+        while (!aio->seekable && aio->ring.inflight)
+            uring_complete(aio);
+        block->state = BLOCK_QUEUED;
+        if (uring_write_block(aio, block))
+        {
+            aio->error = errno;
+            block->state = BLOCK_FREE;
+        }
+        return;
+    }
+#endif
+    pthread_mutex_lock(&aio->lock);
+    block->state = BLOCK_QUEUED;
+    pthread_cond_broadcast(&aio->changed);
+    pthread_mutex_unlock(&aio->lock);
+}
+
+/*
+** Writer: queue the first length bytes of the block from ecm_aio_buffer
+*/
+void ecm_aio_write(ecm_aio *aio, size_t length)
+{
+    aio_queue_write(aio, aio->blocks[aio->head % AIO_DEPTH].data, length);
+}
+
+/*
+** Writer: queue length bytes from the caller's memory, which must stay
+** valid until ecm_aio_close
+*/
+void ecm_aio_write_from(ecm_aio *aio, const ecc_uint8 *source, size_t length)
+{
+    size_t size;
+    ecm_aio_buffer(aio, &size);
+    aio_queue_write(aio, source, length);
+}
+
+/*
+** Writer: if the output is a regular file, store the offset the next
+** write will go to and return 1.  The caller may fill the file from there
+** itself and then account for it with ecm_aio_skip.
+*/
+int ecm_aio_offset(ecm_aio *aio, unsigned long long *offset)
+{
+    *offset = aio->offset;
+    return aio->seekable;
+}
+
+void ecm_aio_skip(ecm_aio *aio, size_t length)
+{
+    aio->offset += length;
+}
+
+/*
+** Reader: hand back the previous block and return the next one read ahead.
+** Returns its length, or 0 at end of input or on error.
+*/
+size_t ecm_aio_read(ecm_aio *aio, const ecc_uint8 **data)
+{
+    struct aio_block *block;
+#ifdef AIO_HAVE_URING
+    if (aio->backend == ECM_IO_URING)
+    {
+        if (aio->held)
+        {
+            aio->blocks[aio->head++ % AIO_DEPTH].state = BLOCK_FREE;
+            aio->held = 0;
+            uring_read_ahead(aio);
+        }
+        block = &aio->blocks[aio->head % AIO_DEPTH];
+        while (block->state != BLOCK_READY)
+        {
+            if (!aio->ring.inflight)
+                return 0;
+            uring_complete(aio);
+        }
+        *data = block->data;
+        aio->held = block->length > 0;
+        return block->length;
+    }
+#endif
+    pthread_mutex_lock(&aio->lock);
+    if (aio->held)
+    {
+        aio->blocks[aio->head++ % AIO_DEPTH].state = BLOCK_FREE;
+        aio->held = 0;
+        pthread_cond_broadcast(&aio->changed);
+    }
+    block = &aio->blocks[aio->head % AIO_DEPTH];
+    while (block->state != BLOCK_READY)
+        pthread_cond_wait(&aio->changed, &aio->lock);
+    pthread_mutex_unlock(&aio->lock);
+    *data = block->data;
+    aio->held = block->length > 0;
+    return block->length;
+}
+
+/*
+** Nonzero (an errno value) if a transfer has failed
+*/
+int ecm_aio_error(ecm_aio *aio)
+{
+    int error;
+    pthread_mutex_lock(&aio->lock);
+    error = aio->error;
+    pthread_mutex_unlock(&aio->lock);
+    return error;
+}
+
+/*
+** Finish all writes (or abandon reads) and free everything.  Returns 0, or
+** the errno of the first failed transfer.
+*/
+int ecm_aio_close(ecm_aio *aio)
+{
+    int error;
+    int i;
+#ifdef AIO_HAVE_URING
+    if (aio->backend == ECM_IO_URING)
+    {
+        if (!aio->writing && aio->ring.inflight)
+        {
+            /* A read from a pipe may never finish, so cancel it */
+            struct io_uring_sqe *sqe;
+            unsigned tail = *aio->ring.sq_tail;
+            unsigned index = tail & *aio->ring.sq_mask;
+            sqe = &aio->ring.sqes[index];
+            memset(sqe, 0, sizeof(*sqe));
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->fd = -1;
+            sqe->addr = (aio->tail % AIO_DEPTH);
+            sqe->user_data = AIO_DEPTH;
+            aio->ring.sq_array[index] = index;
+            __atomic_store_n(aio->ring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+            if (syscall(__NR_io_uring_enter, aio->ring.fd, 1, 0, 0, NULL, 0) == 1)
+                aio->ring.inflight++;
+        }
+        while (aio->ring.inflight)
+        {
+            unsigned long long user_data;
+            int res;
+            if (aio->writing)
+            {
+                uring_complete(aio);
+                continue;
+            }
+            if (uring_wait(&aio->ring, &user_data, &res))
+                break;
+        }
+        uring_teardown(&aio->ring);
+    }
+    else
+#endif
+    {
+        pthread_mutex_lock(&aio->lock);
+        aio->quit = 1;
+        pthread_cond_broadcast(&aio->changed);
+        pthread_mutex_unlock(&aio->lock);
+        if (!aio->writing)
+            pthread_cancel(aio->thread);
+        pthread_join(aio->thread, NULL);
+    }
+    if (aio->writing && aio->seekable)
+        lseek(aio->fd, aio->offset, SEEK_SET);
+    error = aio->error;
+    pthread_mutex_destroy(&aio->lock);
+    pthread_cond_destroy(&aio->changed);
+    for (i = 0; i < AIO_DEPTH; i++)
+        free(aio->blocks[i].data);
+    free(aio);
+    return error;
+}
+
+/*
+** Name of the backend in use for a stream (NULL means stdio)
+*/
+const char *ecm_aio_name(const ecm_aio *aio)
+{
+    return aio_backend_names[aio ? aio->backend : ECM_IO_SYNC];
+}
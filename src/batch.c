@@ -0,0 +1,287 @@
+/**************************************************************************/
+/*
+** Batch mode: encode or decode many files in one run.
+** Copyright (C) 2024 Jonathan Birge
+**
+***************************************************************************/
+/*
+** Works like gzip: each file named, or with -r each file under a directory
+** named, is converted to a file beside it, with ".ecm" (and the compressor's
+** suffix) added when encoding and taken off when decoding.  Files that
+** would not convert (already encoded, or not ECM files) are passed over when
+** found by -r and reported when named.  Existing outputs are left alone
+** unless forced.
+**
+** The files are sorted largest first and handed to a pool of -j jobs, so
+** the big ones start early and the small ones fill in around them.  Each
+** job is a whole ecm_encode_file or ecm_decode_file, with its own -T threads.  A
+** file that fails is reported and its partial output removed; the rest of
+** the batch carries on, and the exit status says whether anything failed.
+**
+***************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "ecm.h"
+
+struct batch_file
+{
+    char *input;
+    char *output;
+    unsigned long long size;
+    int failed;
+};
+
+struct batch
+{
+    const struct batch_options *opt;
+    struct batch_file *files;
+    unsigned count;
+    unsigned alloc;
+    int failed;
+};
+
+static const char *ecm_suffixes[] = {".ecm", ".ecm.zst", ".ecm.xz", NULL};
+
+/***************************************************************************/
+
+/*
+** Length of the ECM suffix that name ends with, or 0 if none
+*/
+static size_t suffix_length(const char *name)
+{
+    size_t n = strlen(name);
+    int i;
+    for (i = 0; ecm_suffixes[i]; i++)
+    {
+        size_t s = strlen(ecm_suffixes[i]);
+        if ((n > s) && !strcmp(name + n - s, ecm_suffixes[i]) && (name[n - s - 1] != '/'))
+            return s;
+    }
+    return 0;
+}
+
+/*
+** Queue path for conversion.  Files that do not fit the direction are
+** reported only if named on the command line.
+*/
+static void batch_add(struct batch *b, const char *path, unsigned long long size, int named)
+{
+    const struct batch_options *opt = b->opt;
+    struct batch_file *f;
+    size_t n = strlen(path);
+    size_t s = suffix_length(path);
+    if (!opt->decode && s)
+    {
+        if (named)
+        {
+            fprintf(stderr, "%s: %s already has an ECM suffix -- unchanged\n", opt->prog_name, path);
+            b->failed = 1;
+        }
+        return;
+    }
+    if (opt->decode && !s)
+    {
+        if (named)
+        {
+            fprintf(stderr, "%s: %s: unknown suffix -- ignored\n", opt->prog_name, path);
+            b->failed = 1;
+        }
+        return;
+    }
+    if (b->count == b->alloc)
+    {
+        unsigned alloc = b->alloc ? 2 * b->alloc : 64;
+        struct batch_file *files = realloc(b->files, alloc * sizeof(*files));
+        if (!files)
+        {
+            fprintf(stderr, "%s: out of memory\n", opt->prog_name);
+            b->failed = 1;
+            return;
+        }
+        b->files = files;
+        b->alloc = alloc;
+    }
+    f = &b->files[b->count];
+    f->input = strdup(path);
+    f->output = malloc(n + 16);
+    if (!f->input || !f->output)
+    {
+        free(f->input);
+        free(f->output);
+        fprintf(stderr, "%s: out of memory\n", opt->prog_name);
+        b->failed = 1;
+        return;
+    }
+    if (opt->decode)
+    {
+        memcpy(f->output, path, n - s);
+        f->output[n - s] = 0;
+    }
+    else
+        sprintf(f->output, "%s.ecm%s", path, ecm_codec_suffix());
+    f->size = size;
+    f->failed = 0;
+    b->count++;
+}
+
+/*
+** Queue the regular files under directory path.  Symbolic links are not
+** followed, so a tree cannot lead back into itself.
+*/
+static void batch_walk(struct batch *b, const char *path)
+{
+    DIR *dir = opendir(path);
+    struct dirent *entry;
+    if (!dir)
+    {
+        fprintf(stderr, "%s: %s: %s\n", b->opt->prog_name, path, strerror(errno));
+        b->failed = 1;
+        return;
+    }
+    while ((entry = readdir(dir)) != NULL)
+    {
+        struct stat st;
+        char *child;
+        if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, ".."))
+            continue;
+        child = malloc(strlen(path) + strlen(entry->d_name) + 2);
+        if (!child)
+        {
+            b->failed = 1;
+            break;
+        }
+        sprintf(child, "%s/%s", path, entry->d_name);
+        if (lstat(child, &st))
+        {
+            fprintf(stderr, "%s: %s: %s\n", b->opt->prog_name, child, strerror(errno));
+            b->failed = 1;
+        }
+        else if (S_ISDIR(st.st_mode))
+            batch_walk(b, child);
+        else if (S_ISREG(st.st_mode))
+            batch_add(b, child, st.st_size, 0);
+        free(child);
+    }
+    closedir(dir);
+}
+
+/*
+** Largest first; equal sizes by name, so the order is repeatable
+*/
+static int batch_compare(const void *a, const void *b)
+{
+    const struct batch_file *fa = a;
+    const struct batch_file *fb = b;
+    if (fa->size != fb->size)
+        return (fa->size < fb->size) ? 1 : -1;
+    return strcmp(fa->input, fb->input);
+}
+
+/*
+** Convert one file; a pool job
+*/
+static void batch_convert(void *arg, unsigned job)
+{
+    struct batch *b = arg;
+    const struct batch_options *opt = b->opt;
+    struct batch_file *f = &b->files[job];
+    /* The codecs' own progress and reports only make sense one at a time */
+    int verbose = opt->verbose && (opt->jobs <= 1);
+    FILE *in, *out;
+    int fd;
+    in = fopen(f->input, "rb");
+    if (!in)
+    {
+        fprintf(stderr, "%s: %s: %s\n", opt->prog_name, f->input, strerror(errno));
+        f->failed = 1;
+        return;
+    }
+    fd = open(f->output, O_WRONLY | O_CREAT | (opt->force ? O_TRUNC : O_EXCL), 0666);
+    out = (fd < 0) ? NULL : fdopen(fd, "wb");
+    if (!out)
+    {
+        fprintf(stderr, "%s: %s: %s\n", opt->prog_name, f->output,
+                (errno == EEXIST) ? "already exists; use --force to overwrite" : strerror(errno));
+        if (fd >= 0)
+            close(fd);
+        fclose(in);
+        f->failed = 1;
+        return;
+    }
+    if (opt->decode)
+        f->failed = ecm_decode_file(in, out, verbose, opt->threads);
+    else
+        f->failed = ecm_encode_file(in, out, verbose, opt->threads);
+    f->failed |= fclose(out) != 0;
+    fclose(in);
+    if (f->failed)
+    {
+        fprintf(stderr, "%s: %s: %s failed\n", opt->prog_name, f->input,
+                opt->decode ? "decoding" : "encoding");
+        unlink(f->output);
+    }
+    else if (opt->verbose)
+        fprintf(stderr, "%s -> %s\n", f->input, f->output);
+}
+
+/***************************************************************************/
+
+/*
+** Convert the count files and directories in names; returns nonzero if
+** any of them failed
+*/
+int batch_run(const struct batch_options *opt, char **names, int count)
+{
+    struct batch b;
+    ecm_pool *pool;
+    unsigned i;
+    int j;
+    memset(&b, 0, sizeof(b));
+    b.opt = opt;
+    for (j = 0; j < count; j++)
+    {
+        struct stat st;
+        if (stat(names[j], &st))
+        {
+            fprintf(stderr, "%s: %s: %s\n", opt->prog_name, names[j], strerror(errno));
+            b.failed = 1;
+        }
+        else if (S_ISDIR(st.st_mode) && opt->recursive)
+            batch_walk(&b, names[j]);
+        else if (S_ISDIR(st.st_mode))
+        {
+            fprintf(stderr, "%s: %s is a directory -- ignored\n", opt->prog_name, names[j]);
+            b.failed = 1;
+        }
+        else if (!S_ISREG(st.st_mode))
+        {
+            fprintf(stderr, "%s: %s is not a regular file -- ignored\n", opt->prog_name, names[j]);
+            b.failed = 1;
+        }
+        else
+            batch_add(&b, names[j], st.st_size, 1);
+    }
+    if (b.count)
+    {
+        qsort(b.files, b.count, sizeof(*b.files), batch_compare);
+        pool = (opt->jobs > 1) ? ecm_pool_create(opt->jobs) : NULL;
+        ecm_pool_run(pool, batch_convert, &b, b.count);
+        ecm_pool_destroy(pool);
+    }
+    for (i = 0; i < b.count; i++)
+    {
+        b.failed |= b.files[i].failed;
+        free(b.files[i].input);
+        free(b.files[i].output);
+    }
+    free(b.files);
+    return b.failed;
+}
@@ -0,0 +1,305 @@
+/**************************************************************************/
+/*
+** ecmbench - end-to-end encode/decode benchmark.
+** Copyright (C) 2024 Jonathan Birge
+**
+***************************************************************************/
+/*
+** Runs the ecm program on each image given, encoding it and decoding the
+** result back, and checks that the round trip is exact.  Each direction is
+** run several times; the fastest run counts for speed, the largest for
+** peak memory (the child's maximum resident set size).  Results are shown
+** as a table, and with --json also written as JSON for comparing releases.
+**
+** Usage: ecmbench [--ecm=PATH] [--runs=N] [--json=FILE] image... [-- ecm options]
+**
+** Options after "--" go to every ecm run, so "-- -T 4 --io=sync" measures
+** a particular configuration.
+**
+***************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include "../config.h"
+
+/* One direction of one image */
+struct measure
+{
+    double seconds;
+    long peak_rss_kb;
+};
+
+struct result
+{
+    const char *image;
+    char name[256];
+    unsigned long long bytes;
+    unsigned long long ecm_bytes;
+    struct measure encode;
+    struct measure decode;
+    int ok;
+};
+
+static const char *ecm_path = "./ecm";
+static int runs = 3;
+static char **ecm_options;
+static int ecm_noptions;
+
+/***************************************************************************/
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+** Run ecm [extra] [options] input -o output once; returns nonzero if it
+** could not be run or failed
+*/
+static int run_ecm(const char *extra, const char *input, const char *output, struct measure *m)
+{
+    char **argv = calloc(ecm_noptions + 6, sizeof(char *));
+    struct rusage ru;
+    double start;
+    int argc = 0, status, i;
+    pid_t pid;
+    if (!argv)
+        return 1;
+    argv[argc++] = (char *)ecm_path;
+    if (extra)
+        argv[argc++] = (char *)extra;
+    for (i = 0; i < ecm_noptions; i++)
+        argv[argc++] = ecm_options[i];
+    argv[argc++] = "-o";
+    argv[argc++] = (char *)output;
+    argv[argc++] = (char *)input;
+    start = now();
+    pid = fork();
+    if (pid == 0)
+    {
+        int null = open("/dev/null", O_WRONLY);
+        if (null >= 0)
+            dup2(null, 2);
+        execv(ecm_path, argv);
+        _exit(127);
+    }
+    free(argv);
+    if ((pid < 0) || (wait4(pid, &status, 0, &ru) != pid))
+        return 1;
+    m->seconds = now() - start;
+    m->peak_rss_kb = ru.ru_maxrss;
+    return !WIFEXITED(status) || WEXITSTATUS(status);
+}
+
+/*
+** Best of the configured number of runs
+*/
+static int measure(const char *extra, const char *input, const char *output, struct measure *best)
+{
+    int i;
+    for (i = 0; i < runs; i++)
+    {
+        struct measure m;
+        if (run_ecm(extra, input, output, &m))
+            return 1;
+        if (!i || (m.seconds < best->seconds))
+            best->seconds = m.seconds;
+        if (!i || (m.peak_rss_kb > best->peak_rss_kb))
+            best->peak_rss_kb = m.peak_rss_kb;
+    }
+    return 0;
+}
+
+static int same_contents(const char *a, const char *b)
+{
+    static char bufa[65536], bufb[65536];
+    FILE *fa = fopen(a, "rb");
+    FILE *fb = fopen(b, "rb");
+    int same = fa && fb;
+    while (same)
+    {
+        size_t na = fread(bufa, 1, sizeof(bufa), fa);
+        size_t nb = fread(bufb, 1, sizeof(bufb), fb);
+        if ((na != nb) || memcmp(bufa, bufb, na))
+            same = 0;
+        if (!na)
+            break;
+    }
+    if (fa)
+        fclose(fa);
+    if (fb)
+        fclose(fb);
+    return same;
+}
+
+static unsigned long long file_size(const char *path)
+{
+    struct stat st;
+    return stat(path, &st) ? 0 : st.st_size;
+}
+
+/*
+** Encode and decode one image
+*/
+static void bench_image(struct result *r)
+{
+    const char *base = strrchr(r->image, '/');
+    char *ecm_file = malloc(strlen(r->image) + 16);
+    char *out_file = malloc(strlen(r->image) + 16);
+    size_t n;
+    base = base ? base + 1 : r->image;
+    n = strlen(base);
+    if ((n > 4) && !strcmp(base + n - 4, ".bin"))
+        n -= 4;
+    if (n >= sizeof(r->name))
+        n = sizeof(r->name) - 1;
+    memcpy(r->name, base, n);
+    r->name[n] = 0;
+    r->bytes = file_size(r->image);
+    r->ok = 0;
+    if (!ecm_file || !out_file)
+        goto done;
+    sprintf(ecm_file, "%s.bench.ecm", r->image);
+    sprintf(out_file, "%s.bench.out", r->image);
+    if (measure(NULL, r->image, ecm_file, &r->encode) ||
+        measure("-d", ecm_file, out_file, &r->decode))
+        goto done;
+    r->ecm_bytes = file_size(ecm_file);
+    r->ok = same_contents(r->image, out_file);
+done:
+    if (ecm_file)
+        unlink(ecm_file);
+    if (out_file)
+        unlink(out_file);
+    free(ecm_file);
+    free(out_file);
+}
+
+/***************************************************************************/
+
+static double mb_per_s(unsigned long long bytes, const struct measure *m)
+{
+    return (m->seconds > 0) ? bytes / 1048576.0 / m->seconds : 0;
+}
+
+static double sectors_per_s(unsigned long long bytes, const struct measure *m)
+{
+    return (m->seconds > 0) ? bytes / 2352.0 / m->seconds : 0;
+}
+
+static void print_table(const struct result *r, int n)
+{
+    int i;
+    printf("%-12s %10s %7s %10s %11s %9s %10s %11s %9s %s\n",
+           "image", "MB", "ratio", "enc MB/s", "enc sect/s", "enc RSS", "dec MB/s",
+           "dec sect/s", "dec RSS", "check");
+    for (i = 0; i < n; i++)
+        printf("%-12s %10.1f %7.3f %10.1f %11.0f %8ldK %10.1f %11.0f %8ldK %s\n",
+               r[i].name,
+               r[i].bytes / 1048576.0,
+               r[i].bytes ? (double)r[i].ecm_bytes / r[i].bytes : 0,
+               mb_per_s(r[i].bytes, &r[i].encode),
+               sectors_per_s(r[i].bytes, &r[i].encode),
+               r[i].encode.peak_rss_kb,
+               mb_per_s(r[i].bytes, &r[i].decode),
+               sectors_per_s(r[i].bytes, &r[i].decode),
+               r[i].decode.peak_rss_kb,
+               r[i].ok ? "ok" : "FAILED");
+}
+
+static void json_measure(FILE *f, const char *key, unsigned long long bytes, const struct measure *m)
+{
+    fprintf(f, "\"%s\": {\"seconds\": %.6f, \"mb_per_s\": %.2f, \"sectors_per_s\": %.0f, \"peak_rss_kb\": %ld}",
+            key, m->seconds, mb_per_s(bytes, m), sectors_per_s(bytes, m), m->peak_rss_kb);
+}
+
+static int write_json(const char *path, const struct result *r, int n)
+{
+    FILE *f = fopen(path, "w");
+    int i;
+    if (!f)
+        return 1;
+    fprintf(f, "{\n  \"version\": \"%s\",\n  \"runs\": %d,\n  \"options\": [", VERSION, runs);
+    for (i = 0; i < ecm_noptions; i++)
+        fprintf(f, "%s\"%s\"", i ? ", " : "", ecm_options[i]);
+    fprintf(f, "],\n  \"results\": [\n");
+    for (i = 0; i < n; i++)
+    {
+        fprintf(f, "    {\"image\": \"%s\", \"bytes\": %llu, \"ecm_bytes\": %llu, ",
+                r[i].name, r[i].bytes, r[i].ecm_bytes);
+        json_measure(f, "encode", r[i].bytes, &r[i].encode);
+        fprintf(f, ", ");
+        json_measure(f, "decode", r[i].bytes, &r[i].decode);
+        fprintf(f, ", \"ok\": %s}%s\n", r[i].ok ? "true" : "false", (i + 1 < n) ? "," : "");
+    }
+    fprintf(f, "  ]\n}\n");
+    return fclose(f) != 0;
+}
+
+static void usage(const char *prog_name)
+{
+    fprintf(stderr, "Usage: %s [--ecm=PATH] [--runs=N] [--json=FILE] image... [-- ecm options]\n", prog_name);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *json = NULL;
+    struct result *results;
+    int nimages = 0;
+    int failed = 0;
+    int i;
+    results = calloc(argc, sizeof(*results));
+    if (!results)
+        return 1;
+    for (i = 1; i < argc; i++)
+    {
+        if (!strcmp(argv[i], "--"))
+        {
+            ecm_options = argv + i + 1;
+            ecm_noptions = argc - i - 1;
+            break;
+        }
+        if (!strncmp(argv[i], "--ecm=", 6))
+            ecm_path = argv[i] + 6;
+        else if (!strncmp(argv[i], "--runs=", 7))
+            runs = atoi(argv[i] + 7);
+        else if (!strncmp(argv[i], "--json=", 7))
+            json = argv[i] + 7;
+        else if (argv[i][0] == '-')
+        {
+            usage(argv[0]);
+            return 1;
+        }
+        else
+            results[nimages++].image = argv[i];
+    }
+    if (!nimages || (runs < 1))
+    {
+        usage(argv[0]);
+        return 1;
+    }
+    for (i = 0; i < nimages; i++)
+    {
+        bench_image(&results[i]);
+        failed |= !results[i].ok;
+    }
+    print_table(results, nimages);
+    if (json && write_json(json, results, nimages))
+    {
+        perror(json);
+        failed = 1;
+    }
+    free(results);
+    return failed;
+}
@@ -0,0 +1,486 @@
+/**************************************************************************/
+/*
+** Built-in compression of ECM output with zstd or xz.
+** Copyright (C) 2024 Jonathan Birge
+**
+***************************************************************************/
+/*
+** ECM output is meant to be compressed, and compressing it in the same
+** process saves a pipe and lets the compressor use every core.  An output
+** sink with a codec hands each full block to the compressor instead of
+** writing it; the compressed stream goes to an inner sink with the usual
+** background I/O.  On the way back an input source with a codec reads
+** compressed bytes from an inner source and serves decompressed blocks.
+**
+** zstd compresses with its own worker threads (when the library was built
+** with them) and xz with its multi-threaded block encoder.  The output is
+** an ordinary .zst or .xz stream, so the zstd and xz tools can read it too.
+** A decoder tells the formats apart by their magic numbers.
+**
+** Either library is optional; without them only uncompressed ECM can be
+** written, and compressed input is reported as unsupported.
+**
+***************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "ecm.h"
+#include "../config.h"
+
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef HAVE_LZMA
+#include <lzma.h>
+#endif
+
+#define CODEC_BUFFER_SIZE 1048576
+
+static const char *codec_names[] = {"none", "zstd", "xz"};
+
+/* What ecm_encode_file compresses its output with (--compress) */
+static int codec_method = ECM_CODEC_NONE;
+static int codec_level;
+
+struct ecm_codec
+{
+    int method;
+    int error;
+    int finished;
+    struct ecm_output sink;
+    struct ecm_input source;
+    ecc_uint8 *buffer;
+    ecc_uint8 *inbuf;
+    const ecc_uint8 *next_in;
+    size_t avail_in;
+#ifdef HAVE_ZSTD
+    ZSTD_CCtx *zc;
+    ZSTD_DCtx *zd;
+    size_t zstd_pending;
+#endif
+#ifdef HAVE_LZMA
+    lzma_stream xz;
+#endif
+};
+
+/***************************************************************************/
+/*
+** Parse a --compress argument, "method[:level]".  Returns nonzero if the
+** method is unknown, not built in, or the level is out of range.
+*/
+int ecm_codec_select(const char *spec)
+{
+    size_t n = strcspn(spec, ":");
+    int method, level, lo, hi;
+    char *end;
+    if ((n == 4) && !strncmp(spec, "none", 4))
+    {
+        codec_method = ECM_CODEC_NONE;
+        return spec[n] != 0;
+    }
+#ifdef HAVE_ZSTD
+    if ((n == 4) && !strncmp(spec, "zstd", 4))
+    {
+        method = ECM_CODEC_ZSTD;
+        level = ZSTD_CLEVEL_DEFAULT;
+        lo = 1;
+        hi = ZSTD_maxCLevel();
+    }
+    else
+#endif
+#ifdef HAVE_LZMA
+    if ((n == 2) && !strncmp(spec, "xz", 2))
+    {
+        method = ECM_CODEC_XZ;
+        level = 6;
+        lo = 0;
+        hi = 9;
+    }
+    else
+#endif
+        return -1;
+    if (spec[n])
+    {
+        level = strtol(spec + n + 1, &end, 10);
+        if ((end == spec + n + 1) || *end || (level < lo) || (level > hi))
+            return -1;
+    }
+    codec_method = method;
+    codec_level = level;
+    return 0;
+}
+
+const char *ecm_codec_name(int method)
+{
+    return codec_names[method];
+}
+
+/*
+** File name suffix for output of the selected compressor ("" if none)
+*/
+const char *ecm_codec_suffix(void)
+{
+    static const char *suffixes[] = {"", ".zst", ".xz"};
+    return suffixes[codec_method];
+}
+
+/*
+** Which compressed format starts with the n bytes at head, if any
+*/
+int ecm_codec_detect(const ecc_uint8 *head, size_t n)
+{
+    static const ecc_uint8 zstd_magic[4] = {0x28, 0xB5, 0x2F, 0xFD};
+    static const ecc_uint8 xz_magic[4] = {0xFD, 0x37, 0x7A, 0x58};
+    if ((n >= 4) && !memcmp(head, zstd_magic, 4))
+        return ECM_CODEC_ZSTD;
+    if ((n >= 4) && !memcmp(head, xz_magic, 4))
+        return ECM_CODEC_XZ;
+    return ECM_CODEC_NONE;
+}
+
+static void codec_free(ecm_codec *c)
+{
+#ifdef HAVE_ZSTD
+    ZSTD_freeCCtx(c->zc);
+    ZSTD_freeDCtx(c->zd);
+#endif
+#ifdef HAVE_LZMA
+    if (c->method == ECM_CODEC_XZ)
+        lzma_end(&c->xz);
+#endif
+    free(c->buffer);
+    free(c->inbuf);
+    free(c);
+}
+
+/***************************************************************************/
+/*
+** Compression
+*/
+
+/*
+** Compress n bytes, or with end set, finish the stream
+*/
+static void codec_compress(ecm_codec *c, const ecc_uint8 *src, size_t n, int end)
+{
+#ifdef HAVE_ZSTD
+    if (c->method == ECM_CODEC_ZSTD)
+    {
+        ZSTD_inBuffer in = {src, n, 0};
+        size_t left;
+        do
+        {
+            ZSTD_outBuffer out = {c->buffer, CODEC_BUFFER_SIZE, 0};
+            left = ZSTD_compressStream2(c->zc, &out, &in, end ? ZSTD_e_end : ZSTD_e_continue);
+            if (ZSTD_isError(left))
+            {
+                c->error = 1;
+                return;
+            }
+            ecm_output_write(&c->sink, c->buffer, out.pos);
+        } while (end ? (left != 0) : (in.pos < in.size));
+        return;
+    }
+#endif
+#ifdef HAVE_LZMA
+    if (c->method == ECM_CODEC_XZ)
+    {
+        lzma_ret ret;
+        c->xz.next_in = src;
+        c->xz.avail_in = n;
+        do
+        {
+            c->xz.next_out = c->buffer;
+            c->xz.avail_out = CODEC_BUFFER_SIZE;
+            ret = lzma_code(&c->xz, end ? LZMA_FINISH : LZMA_RUN);
+            if ((ret != LZMA_OK) && (ret != LZMA_STREAM_END))
+            {
+                c->error = 1;
+                return;
+            }
+            ecm_output_write(&c->sink, c->buffer, CODEC_BUFFER_SIZE - c->xz.avail_out);
+        } while (end ? (ret != LZMA_STREAM_END) : (c->xz.avail_in != 0));
+        return;
+    }
+#endif
+    (void)src;
+    (void)n;
+    (void)end;
+    c->error = 1;
+}
+
+/*
+** Start compressing out with the method chosen by ecm_codec_select, on
+** threads workers (all online CPUs when threads is 1).  Must come right
+** after ecm_output_open, before anything is written.  Returns nonzero if
+** the compressor cannot be set up.
+*/
+int ecm_output_compress(struct ecm_output *out, int threads)
+{
+    ecm_codec *c;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (codec_method == ECM_CODEC_NONE)
+        return 0;
+    if ((threads <= 1) && (cpus > 1))
+        threads = cpus;
+    c = calloc(1, sizeof(*c));
+    if (!c)
+        return -1;
+    c->method = codec_method;
+    c->buffer = malloc(CODEC_BUFFER_SIZE);
+    if (!c->buffer)
+    {
+        codec_free(c);
+        return -1;
+    }
+#ifdef HAVE_ZSTD
+    if (c->method == ECM_CODEC_ZSTD)
+    {
+        c->zc = ZSTD_createCCtx();
+        if (!c->zc ||
+            ZSTD_isError(ZSTD_CCtx_setParameter(c->zc, ZSTD_c_compressionLevel, codec_level)))
+        {
+            codec_free(c);
+            return -1;
+        }
+        /* Fails harmlessly when libzstd was built without threads */
+        ZSTD_CCtx_setParameter(c->zc, ZSTD_c_nbWorkers, threads);
+    }
+#endif
+#ifdef HAVE_LZMA
+    if (c->method == ECM_CODEC_XZ)
+    {
+        lzma_mt mt;
+        lzma_stream init = LZMA_STREAM_INIT;
+        memset(&mt, 0, sizeof(mt));
+        mt.threads = threads;
+        mt.preset = codec_level;
+        mt.check = LZMA_CHECK_CRC64;
+        c->xz = init;
+        if (lzma_stream_encoder_mt(&c->xz, &mt) != LZMA_OK)
+        {
+            codec_free(c);
+            return -1;
+        }
+    }
+#endif
+    /* The sink as opened becomes the codec's; blocks now collect in memory */
+    c->sink = *out;
+    memset(out, 0, sizeof(*out));
+    out->file = c->sink.file;
+    out->codec = c;
+    out->block = malloc(CODEC_BUFFER_SIZE);
+    out->block_size = CODEC_BUFFER_SIZE;
+    if (!out->block)
+    {
+        *out = c->sink;
+        codec_free(c);
+        return -1;
+    }
+    return 0;
+}
+
+void ecm_codec_write(ecm_codec *c, const ecc_uint8 *src, size_t n)
+{
+    if (!c->error && n)
+        codec_compress(c, src, n, 0);
+}
+
+/*
+** Finish the compressed stream and close the inner sink; returns nonzero if
+** anything failed
+*/
+int ecm_codec_close_output(ecm_codec *c)
+{
+    int error;
+    if (!c->error)
+        codec_compress(c, NULL, 0, 1);
+    error = ecm_output_close(&c->sink) | c->error;
+    codec_free(c);
+    return error;
+}
+
+/***************************************************************************/
+/*
+** Decompression
+*/
+
+/*
+** Make compressed input available in next_in/avail_in; returns 0 at the
+** end of the inner source
+*/
+static int codec_refill(ecm_codec *c)
+{
+    struct ecm_input *src = &c->source;
+    if (c->avail_in)
+        return 1;
+    if (src->data)
+    {
+        c->avail_in = src->size - src->pos;
+        c->next_in = ecm_input_view(src, c->avail_in);
+    }
+    else
+    {
+        c->avail_in = ecm_input_read(src, c->inbuf, CODEC_BUFFER_SIZE);
+        c->next_in = c->inbuf;
+    }
+    return c->avail_in != 0;
+}
+
+/*
+** Decompress the next stretch of input; returns its length, with *data
+** pointing at it, or 0 at the end (or on error).  Only the end of the
+** compressed stream counts as the end: for xz that is LZMA_STREAM_END, for
+** zstd the input running out between frames.
+*/
+size_t ecm_codec_read(ecm_codec *c, const ecc_uint8 **data)
+{
+    *data = c->buffer;
+    while (!c->error && !c->finished)
+    {
+        int more = codec_refill(c);
+#ifdef HAVE_ZSTD
+        if (c->method == ECM_CODEC_ZSTD)
+        {
+            ZSTD_inBuffer in = {c->next_in, c->avail_in, 0};
+            ZSTD_outBuffer out = {c->buffer, CODEC_BUFFER_SIZE, 0};
+            if (!more)
+            {
+                /* A frame cut short is an error; the end of one is not */
+                c->error = c->zstd_pending != 0;
+                c->finished = 1;
+                break;
+            }
+            c->zstd_pending = ZSTD_decompressStream(c->zd, &out, &in);
+            if (ZSTD_isError(c->zstd_pending))
+            {
+                c->error = 1;
+                break;
+            }
+            c->next_in += in.pos;
+            c->avail_in -= in.pos;
+            if (out.pos)
+                return out.pos;
+            continue;
+        }
+#endif
+#ifdef HAVE_LZMA
+        if (c->method == ECM_CODEC_XZ)
+        {
+            lzma_ret ret;
+            c->xz.next_in = c->next_in;
+            c->xz.avail_in = c->avail_in;
+            c->xz.next_out = c->buffer;
+            c->xz.avail_out = CODEC_BUFFER_SIZE;
+            ret = lzma_code(&c->xz, more ? LZMA_RUN : LZMA_FINISH);
+            c->next_in = c->xz.next_in;
+            c->avail_in = c->xz.avail_in;
+            if (ret == LZMA_STREAM_END)
+                c->finished = 1;
+            else if (ret != LZMA_OK)
+            {
+                c->error = 1;
+                break;
+            }
+            if (c->xz.avail_out != CODEC_BUFFER_SIZE)
+                return CODEC_BUFFER_SIZE - c->xz.avail_out;
+            continue;
+        }
+#endif
+        (void)more;
+        c->error = 1;
+    }
+    return 0;
+}
+
+/*
+** Continue reading in through a decompressor for method.  head holds the
+** n bytes already read, which are fed to it first.  Returns nonzero if the
+** method is not built in or cannot be set up.
+*/
+int ecm_input_decompress(struct ecm_input *in, int method, const ecc_uint8 *head, size_t n)
+{
+    ecm_codec *c = calloc(1, sizeof(*c));
+    if (!c)
+        return -1;
+    c->method = method;
+    c->buffer = malloc(CODEC_BUFFER_SIZE);
+    c->inbuf = malloc(CODEC_BUFFER_SIZE);
+    if (!c->buffer || !c->inbuf || (n > CODEC_BUFFER_SIZE))
+    {
+        codec_free(c);
+        return -1;
+    }
+    switch (method)
+    {
+#ifdef HAVE_ZSTD
+    case ECM_CODEC_ZSTD:
+        c->zd = ZSTD_createDCtx();
+        if (!c->zd)
+        {
+            codec_free(c);
+            return -1;
+        }
+        break;
+#endif
+#ifdef HAVE_LZMA
+    case ECM_CODEC_XZ:
+    {
+        lzma_stream init = LZMA_STREAM_INIT;
+        c->xz = init;
+        if (lzma_stream_decoder(&c->xz, UINT64_MAX, LZMA_CONCATENATED) != LZMA_OK)
+        {
+            codec_free(c);
+            return -1;
+        }
+        break;
+    }
+#endif
+    default:
+        c->method = ECM_CODEC_NONE;
+        codec_free(c);
+        return -1;
+    }
+    memcpy(c->inbuf, head, n);
+    c->next_in = c->inbuf;
+    c->avail_in = n;
+    /* The source as opened becomes the codec's */
+    c->source = *in;
+    memset(in, 0, sizeof(*in));
+    in->file = c->source.file;
+    in->codec = c;
+    return 0;
+}
+
+/*
+** Read the compressed stream through to its end once the ECM data in it
+** is done with.  Returns nonzero if it is cut short, corrupt, or holds
+** anything more.
+*/
+int ecm_codec_finish(ecm_codec *c)
+{
+    const ecc_uint8 *data;
+    if (ecm_codec_read(c, &data))
+        return 1;
+    return !c->finished || ecm_codec_error(c);
+}
+
+/*
+** Compressed bytes consumed so far
+*/
+unsigned long ecm_codec_tell(ecm_codec *c)
+{
+    return ecm_input_tell(&c->source) - c->avail_in;
+}
+
+int ecm_codec_error(ecm_codec *c)
+{
+    return c->error || ecm_input_error(&c->source);
+}
+
+void ecm_codec_close_input(ecm_codec *c)
+{
+    ecm_input_close(&c->source);
+    codec_free(c);
+}
@@ -0,0 +1,266 @@
+/**************************************************************************/
+/*
+** Cue sheet layout for encoding.
+** Copyright (C) 2024 Jonathan Birge
+**
+***************************************************************************/
+/*
+** A cue sheet says where each track of a BIN image starts and what it
+** holds.  The encoder uses that to leave audio tracks alone, since they can
+** never contain a sector, and to check data tracks only where sectors
+** should start.  Nothing in the ECM file depends on the cue sheet: a track
+** mislabelled there only costs some compression, and the output decodes
+** the same either way.
+**
+** Only FILE, TRACK and INDEX 01 are used.  Track start times are counted in
+** frames from the start of their file, and each frame is the size of the
+** track it lies in (2352 bytes for AUDIO, MODE1/2352 and MODE2/2352; the
+** number after the slash for the others; 2448 for CDG), so the tracks of a
+** file are placed one after another.  A cue sheet naming several files
+** (one per track, as many rippers do) describes the one being encoded.
+**
+***************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include "ecm.h"
+
+#define CUE_LINE 1024
+
+struct cue_entry
+{
+    unsigned file;
+    unsigned long long frame;
+    unsigned size;
+    int mode;
+    int indexed;
+};
+
+static struct ecm_track *cue_tracks;
+static unsigned cue_ntracks;
+
+/***************************************************************************/
+
+/*
+** Next word of the line at *p, quoted or not; NULL at the end of the line
+*/
+static char *cue_word(char **p)
+{
+    char *s = *p;
+    char *word;
+    while (isspace((unsigned char)*s))
+        s++;
+    if (!*s)
+        return NULL;
+    if (*s == '"')
+    {
+        word = ++s;
+        while (*s && (*s != '"'))
+            s++;
+    }
+    else
+    {
+        word = s;
+        while (*s && !isspace((unsigned char)*s))
+            s++;
+    }
+    if (*s)
+        *s++ = 0;
+    *p = s;
+    return word;
+}
+
+/*
+** Track mode and frame size from a TRACK type such as MODE2/2352
+*/
+static int cue_mode(const char *type, unsigned *size)
+{
+    const char *slash = strchr(type, '/');
+    *size = slash ? strtoul(slash + 1, NULL, 10) : 2352;
+    if (!strcasecmp(type, "AUDIO"))
+        return TRACK_AUDIO;
+    if (!strcasecmp(type, "CDG"))
+        *size = 2448;
+    else if (!strcasecmp(type, "MODE1/2352"))
+        return TRACK_MODE1;
+    else if (!strcasecmp(type, "MODE2/2352") || !strcasecmp(type, "CDI/2352"))
+        return TRACK_MODE2;
+    return TRACK_OTHER;
+}
+
+/*
+** Frames from an mm:ss:ff time
+*/
+static int cue_time(const char *time, unsigned long long *frame)
+{
+    unsigned m, s, f;
+    char extra;
+    if ((sscanf(time, "%u:%u:%u%c", &m, &s, &f, &extra) != 3) || (s >= 60) || (f >= 75))
+        return -1;
+    *frame = ((unsigned long long)m * 60 + s) * 75 + f;
+    return 0;
+}
+
+static const char *cue_basename(const char *path)
+{
+    const char *slash = strrchr(path, '/');
+    return slash ? slash + 1 : path;
+}
+
+/*
+** Path of file name given in the cue sheet at cue: relative names are
+** relative to the directory the cue sheet is in
+*/
+static char *cue_path(const char *cue, const char *name)
+{
+    size_t dir = (name[0] == '/') ? 0 : (size_t)(cue_basename(cue) - cue);
+    char *path = malloc(dir + strlen(name) + 1);
+    if (!path)
+        return NULL;
+    memcpy(path, cue, dir);
+    strcpy(path + dir, name);
+    return path;
+}
+
+/***************************************************************************/
+
+/*
+** Read the layout of the image from cue sheet cue.  *image names the image
+** being encoded; if it is NULL, the cue sheet must name exactly one file,
+** and *image is set to its path.  Returns NULL, or a message saying why
+** the cue sheet cannot be used.
+*/
+const char *ecm_cue_select(const char *cue, char **image)
+{
+    static char message[CUE_LINE + 64];
+    char line[CUE_LINE];
+    char **files = NULL;
+    struct cue_entry *entries = NULL;
+    unsigned nfiles = 0, nentries = 0, lineno = 0, errline, i, n;
+    unsigned long long start = 0;
+    const char *error = NULL;
+    unsigned file;
+    FILE *f = fopen(cue, "r");
+    if (!f)
+        return "cannot open the cue sheet";
+    while (!error && fgets(line, sizeof(line), f))
+    {
+        char *p = line;
+        char *keyword = cue_word(&p);
+        char *arg = keyword ? cue_word(&p) : NULL;
+        lineno++;
+        if (!keyword)
+            continue;
+        if (!strcasecmp(keyword, "FILE"))
+        {
+            char **more = realloc(files, (nfiles + 1) * sizeof(*files));
+            if (!arg)
+                error = "FILE without a name";
+            else if (!more || !(more[nfiles] = strdup(arg)))
+                error = "out of memory";
+            if (more)
+                files = more;
+            if (!error)
+                nfiles++;
+        }
+        else if (!strcasecmp(keyword, "TRACK"))
+        {
+            struct cue_entry *more = realloc(entries, (nentries + 1) * sizeof(*entries));
+            char *type = arg ? cue_word(&p) : NULL;
+            if (!more)
+                error = "out of memory";
+            else if (!type || !nfiles)
+                error = "TRACK without a type or FILE";
+            else
+            {
+                entries = more;
+                entries[nentries].file = nfiles - 1;
+                entries[nentries].mode = cue_mode(type, &entries[nentries].size);
+                entries[nentries].indexed = 0;
+                if (!entries[nentries].size)
+                    error = "unknown track type";
+                nentries++;
+            }
+        }
+        else if (!strcasecmp(keyword, "INDEX") && arg && (atoi(arg) == 1))
+        {
+            char *time = cue_word(&p);
+            if (!nentries || !time || cue_time(time, &entries[nentries - 1].frame))
+                error = "bad INDEX 01";
+            else if (entries[nentries - 1].file != nfiles - 1)
+                error = "INDEX 01 of a track in an earlier FILE";
+            else
+                entries[nentries - 1].indexed = 1;
+        }
+    }
+    fclose(f);
+    errline = error ? lineno : 0;
+    if (!error && !nentries)
+        error = "no tracks";
+    for (i = 0; !error && (i < nentries); i++)
+        if (!entries[i].indexed)
+            error = "TRACK without INDEX 01";
+    /* The file being encoded, by name; failing that, the only one there is */
+    file = nfiles;
+    for (i = 0; !error && *image && (i < nfiles); i++)
+        if (!strcmp(cue_basename(files[i]), cue_basename(*image)))
+            file = i;
+    if (!error && (file == nfiles))
+    {
+        if (nfiles != 1)
+            error = *image ? "the image is not one of the cue sheet's files"
+                           : "the cue sheet names several files; give the one to encode";
+        file = 0;
+    }
+    if (!error && !*image && !(*image = cue_path(cue, files[file])))
+        error = "out of memory";
+    /* Place the file's tracks */
+    free(cue_tracks);
+    cue_tracks = error ? NULL : malloc(nentries * sizeof(*cue_tracks));
+    cue_ntracks = 0;
+    if (!error && !cue_tracks)
+        error = "out of memory";
+    for (i = 0, n = 0; !error && (i < nentries); i++)
+    {
+        if (entries[i].file != file)
+            continue;
+        if (n && (entries[i].frame < entries[n - 1].frame))
+            error = "tracks out of order";
+        start = n ? start + (entries[i].frame - entries[n - 1].frame) * entries[n - 1].size
+                  : entries[i].frame * entries[i].size;
+        cue_tracks[n].start = start;
+        cue_tracks[n].mode = entries[i].mode;
+        /* Keep the file's entries together, for the next one to look back at */
+        entries[n++] = entries[i];
+    }
+    cue_ntracks = n;
+    if (!error && !n)
+        error = "no tracks for the image";
+    if (error)
+    {
+        if (errline)
+            snprintf(message, sizeof(message), "%s at line %u", error, errline);
+        else
+            snprintf(message, sizeof(message), "%s", error);
+        free(cue_tracks);
+        cue_tracks = NULL;
+        cue_ntracks = 0;
+    }
+    for (i = 0; i < nfiles; i++)
+        free(files[i]);
+    free(files);
+    free(entries);
+    return error ? message : NULL;
+}
+
+/*
+** The tracks of the image to encode, in order, or NULL without a cue sheet
+*/
+const struct ecm_track *ecm_cue_tracks(unsigned *count)
+{
+    *count = cue_ntracks;
+    return cue_tracks;
+}
@@ -18,14 +18,15 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
 #include "ecm.h"
 
-void edc_computeblock_decode(
+void ecm_edc_computeblock_decode(
     const ecc_uint8 *src,
     ecc_uint16 size,
     ecc_uint8 *dest)
 {
-    ecc_uint32 edc = edc_partial_computeblock(0, src, size);
+    ecc_uint32 edc = ecm_edc_partial_computeblock(0, src, size);
     dest[0] = (edc >> 0) & 0xFF;
     dest[1] = (edc >> 8) & 0xFF;
     dest[2] = (edc >> 16) & 0xFF;
@@ -36,7 +37,7 @@ void edc_computeblock_decode(
 /*
 ** Compute ECC for a block (can do either P or Q)
 */
-void ecc_computeblock_decode(
+void ecm_ecc_computeblock_decode(
     ecc_uint8 *src,
     ecc_uint32 major_count,
     ecc_uint32 minor_count,
@@ -44,34 +45,13 @@ void ecc_computeblock_decode(
     ecc_uint32 minor_inc,
     ecc_uint8 *dest)
 {
-    ecc_uint32 size = major_count * minor_count;
-    ecc_uint32 major, minor;
-    for (major = 0; major < major_count; major++)
-    {
-        ecc_uint32 index = (major >> 1) * major_mult + (major & 1);
-        ecc_uint8 ecc_a = 0;
-        ecc_uint8 ecc_b = 0;
-        for (minor = 0; minor < minor_count; minor++)
-        {
-            ecc_uint8 temp = src[index];
-            index += minor_inc;
-            if (index >= size)
-                index -= size;
-            ecc_a ^= temp;
-            ecc_b ^= temp;
-            ecc_a = ecc_f_lut[ecc_a];
-        }
-        ecc_a = ecc_b_lut[ecc_f_lut[ecc_a] ^ ecc_b];
-
-        dest[major] = ecc_a;
-        dest[major + major_count] = ecc_a ^ ecc_b;
-    }
+    ecm_ecc_computeblock(src, major_count, minor_count, major_mult, minor_inc, dest);
 }
 
 /*
 ** Generate ECC P and Q codes for a block
 */
-void ecc_generate_decode(
+void ecm_ecc_generate_decode(
     ecc_uint8 *sector,
     int zeroaddress)
 {
@@ -84,9 +64,9 @@ void ecc_generate_decode(
             sector[12 + i] = 0;
         }
     /* Compute ECC P code */
-    ecc_computeblock_decode(sector + 0xC, 86, 24, 2, 86, sector + 0x81C);
+    ecm_ecc_computeblock_decode(sector + 0xC, 86, 24, 2, 86, sector + 0x81C);
     /* Compute ECC Q code */
-    ecc_computeblock_decode(sector + 0xC, 52, 43, 86, 88, sector + 0x8C8);
+    ecm_ecc_computeblock_decode(sector + 0xC, 52, 43, 86, 88, sector + 0x8C8);
     /* Restore the address */
     if (zeroaddress)
         for (i = 0; i < 4; i++)
@@ -95,171 +75,1081 @@ void ecc_generate_decode(
 
 /***************************************************************************/
 /*
-** Generate ECC/EDC information for a sector (must be 2352 = 0x930 bytes)
-** Returns 0 on success
+** Generate the EDC (and the zero bytes of Mode 1) for a sector
 */
-void eccedc_generate_decode(ecc_uint8 *sector, int type)
+static void edc_generate_decode(ecc_uint8 *sector, int type)
 {
     ecc_uint32 i;
     switch (type)
     {
     case 1: /* Mode 1 */
-        /* Compute EDC */
-        edc_computeblock_decode(sector + 0x00, 0x810, sector + 0x810);
+        ecm_edc_computeblock_decode(sector + 0x00, 0x810, sector + 0x810);
         /* Write out zero bytes */
         for (i = 0; i < 8; i++)
             sector[0x814 + i] = 0;
-        /* Generate ECC P/Q codes */
-        ecc_generate_decode(sector, 0);
         break;
     case 2: /* Mode 2 form 1 */
-        /* Compute EDC */
-        edc_computeblock_decode(sector + 0x10, 0x808, sector + 0x818);
-        /* Generate ECC P/Q codes */
-        ecc_generate_decode(sector, 1);
+        ecm_edc_computeblock_decode(sector + 0x10, 0x808, sector + 0x818);
         break;
     case 3: /* Mode 2 form 2 */
-        /* Compute EDC */
-        edc_computeblock_decode(sector + 0x10, 0x91C, sector + 0x92C);
+        ecm_edc_computeblock_decode(sector + 0x10, 0x91C, sector + 0x92C);
         break;
     }
 }
 
-unsigned long mycounter_decode;
-unsigned long mycounter_total_decode;
+/*
+** Generate ECC/EDC information for a sector (must be 2352 = 0x930 bytes)
+*/
+void ecm_eccedc_generate_decode(ecc_uint8 *sector, int type)
+{
+    edc_generate_decode(sector, type);
+    /* Mode 2 form 2 has no ECC */
+    if ((type == 1) || (type == 2))
+        ecm_ecc_generate_decode(sector, type == 2);
+}
+
+/* Progress of one decode */
+struct decode_counter
+{
+    unsigned long done;
+    unsigned long total;
+    int verbose;
+    struct ecm_stats *stats;
+};
 
-void resetcounter_decode(unsigned long total)
+static void resetcounter_decode(struct decode_counter *c, unsigned long total, int verbose)
 {
-    mycounter_decode = 0;
-    mycounter_total_decode = total;
+    c->done = 0;
+    c->total = total;
+    c->verbose = verbose;
+    c->stats = NULL;
 }
 
-void setcounter_decode(unsigned long n, int verbose)
+static void setcounter_decode(struct decode_counter *c, unsigned long n)
 {
-    if ((n >> 20) != (mycounter_decode >> 20))
+    if ((n >> 20) != (c->done >> 20))
     {
         unsigned long a = (n + 64) / 128;
-        unsigned long d = (mycounter_total_decode + 64) / 128;
+        unsigned long d = (c->total + 64) / 128;
         if (!d)
             d = 1;
-        if (verbose)
-        fprintf(stderr, "Decoding (%02lu%%)\r", (100 * a) / d);
+        if (c->verbose)
+            fprintf(stderr, "Decoding (%02lu%%)\r", (100 * a) / d);
+        ecm_stats_progress(c->stats, n);
     }
-    mycounter_decode = n;
+    c->done = n;
 }
 
-int decode_file(FILE *in, FILE *out, int verbose)
+/***************************************************************************/
+/*
+** Read a type/count combo.  Returns DECODE_OK with the count in num,
+** DECODE_END at the end-of-records marker, DECODE_UNEOF or DECODE_CORRUPT.
+*/
+static int read_header(struct ecm_input *in, unsigned *type, unsigned *num)
 {
-    unsigned checkedc = 0;
-    unsigned char sector[2352];
+    int c = ecm_input_getc(in);
+    int bits = 5;
+    if (c == EOF)
+        return DECODE_UNEOF;
+    *type = c & 3;
+    *num = (c >> 2) & 0x1F;
+    while (c & 0x80)
+    {
+        c = ecm_input_getc(in);
+        if (c == EOF)
+            return DECODE_UNEOF;
+        *num |= ((unsigned)(c & 0x7F)) << bits;
+        bits += 7;
+    }
+    return DECODE_OK;
+}
+
+int ecm_read_type_count(struct ecm_input *in, unsigned *type, unsigned *num)
+{
+    int status = read_header(in, type, num);
+    if (status != DECODE_OK)
+        return status;
+    if (*num == 0xFFFFFFFF)
+        return DECODE_END;
+    (*num)++;
+    if (*num >= 0x80000000)
+        return DECODE_CORRUPT;
+    return DECODE_OK;
+}
+
+/*
+** Read a record header, which in a v2 block may give one of the extended
+** record kinds
+*/
+int ecm_read_record_header(struct ecm_input *in, unsigned *kind, unsigned *num)
+{
+    int status = read_header(in, kind, num);
+    if (status != DECODE_OK)
+        return status;
+    if (*num == 0xFFFFFFFF)
+        return DECODE_END;
+    if (*num >= RECORD_EXTENDED)
+    {
+        unsigned flags = (*num - RECORD_EXTENDED) / RECORD_EXTENDED_MAX;
+        if (!flags || (flags >= RECORD_KINDS / 4))
+            return DECODE_CORRUPT;
+        *kind |= flags << 2;
+        *num &= RECORD_EXTENDED_MAX - 1;
+        /* Formless sectors are always sequential; only form 2 lacks an EDC */
+        if ((!(*kind & 3) && !(*kind & RECORD_SEQUENTIAL) && (*kind != RECORD_COPY)) ||
+            ((*kind & RECORD_NOEDC) && ((*kind & 3) != 3)) ||
+            ((*kind & RECORD_COPY) && (*kind != RECORD_COPY)))
+            return DECODE_CORRUPT;
+    }
+    (*num)++;
+    return DECODE_OK;
+}
+
+/*
+** Bytes per sector of a record of kind in the ECM file (not counting the
+** prefix), and in the output
+*/
+unsigned ecm_record_payload(unsigned kind)
+{
+    if (kind == 0)
+        return 1;
+    if (kind == RECORD_COPY)
+        return 0;
+    switch (kind & 3)
+    {
+    case 1:
+        return ((kind & RECORD_SEQUENTIAL) ? 0 : 0x003) + ((kind & RECORD_ZERO) ? 0 : 0x800);
+    case 2:
+        return 0x004 + ((kind & RECORD_ZERO) ? 0 : 0x800);
+    case 3:
+        return 0x004 + ((kind & RECORD_ZERO) ? 0 : 0x914);
+    }
+    return (kind & RECORD_ZERO) ? 0 : 0x920;
+}
+
+/*
+** Bytes before the first sector of a record of kind: the first address of
+** a sequential record or copy, and the mode byte of a formless one or the
+** distance back of a copy
+*/
+unsigned ecm_record_prefix(unsigned kind)
+{
+    if (kind == RECORD_COPY)
+        return 7;
+    if (!(kind & RECORD_SEQUENTIAL))
+        return 0;
+    return (kind & 3) ? 3 : 4;
+}
+
+unsigned ecm_record_output(unsigned kind)
+{
+    if (!kind)
+        return 1;
+    return (((kind & 3) == 1) || (kind & (RECORD_SEQUENTIAL | RECORD_COPY))) ? 2352 : 2336;
+}
+
+/***************************************************************************/
+/*
+** Threaded decoding
+**
+** A parser thread walks the type/count records and reads each sector
+** payload (or literal chunk of up to 2352 bytes) into a slot of a batch; a
+** long literal record in a mapped input just gets a pointer to its bytes.
+** Builder threads take whole batches and regenerate sync, EDC and ECC in
+** place, then checksum what the batch will write.  The calling thread writes
+** batches back out in the order they were parsed and folds each batch's
+** checksum into the whole-file EDC with ecm_edc_combine, so the result and the
+** final check are the same as for the serial loop.
+*/
+
+#define BATCH_SECTORS 256
+
+/*
+** Literal records at least this long are passed through from a mapped input
+** without copying (see ecm_output_passthrough)
+*/
+#define LITERAL_DIRECT_MIN 65536
+#define BATCH_FREE 0
+#define BATCH_PARSED 1
+#define BATCH_BUILDING 2
+#define BATCH_BUILT 3
+
+struct decode_batch
+{
+    ecc_uint8 slots[BATCH_SECTORS][2352];
+    const ecc_uint8 *direct[BATCH_SECTORS];
+    ecc_uint8 types[BATCH_SECTORS];
+    unsigned lengths[BATCH_SECTORS];
+    unsigned count;
+    ecc_uint32 edc;
+    unsigned long long length;
+    int state;
+    int last;
+};
+
+struct decoder
+{
+    struct ecm_input *in;
+    struct decode_counter *counter;
+    struct ecm_stats *stats;
+    struct decode_batch *batches;
+    unsigned nbatches;
+    unsigned parse_seq;
+    unsigned build_seq;
+    unsigned write_seq;
+    int parse_done;
+    int status;
+    ecc_uint8 trailer[4];
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+};
+
+/*
+** Rebuild the sync and header around a payload read into a slot
+*/
+static void rebuild_header(ecc_uint8 *sector, int type)
+{
+    sector[0x00] = 0x00;
+    memset(sector + 1, 0xFF, 10);
+    sector[0x0B] = 0x00;
+    if (type == 1)
+    {
+        sector[0x0F] = 0x01;
+    }
+    else
+    {
+        memset(sector + 0x0C, 0, 3);
+        sector[0x0F] = 0x02;
+        sector[0x10] = sector[0x14];
+        sector[0x11] = sector[0x15];
+        sector[0x12] = sector[0x16];
+        sector[0x13] = sector[0x17];
+    }
+}
+
+/*
+** Rebuild the sync, header and EDC/ECC around a payload read into a slot
+*/
+void ecm_rebuild_sector(ecc_uint8 *sector, int type)
+{
+    rebuild_header(sector, type);
+    ecm_eccedc_generate_decode(sector, type);
+}
+
+/*
+** Rebuild a sector of a record of kind, charging the time since since to
+** the EDC and ECC stages in cycles; returns the time now.  header holds the
+** address and mode byte of a sequential record's sector.
+*/
+static unsigned long long rebuild_sector_timed(
+    ecc_uint8 *sector,
+    unsigned kind,
+    const ecc_uint8 *header,
+    const struct ecm_stats *st,
+    unsigned long long *cycles,
+    unsigned long long since)
+{
+    unsigned type = kind & 3;
+    if (!type)
+    {
+        /* Formless: a sync and header, and nothing to check the data */
+        rebuild_header(sector, 1);
+        memcpy(sector + 0x00C, header, 4);
+        return since;
+    }
+    /* Mode 1 EDC and ECC cover the address; Mode 2 ones take it as zero */
+    if ((kind & RECORD_SEQUENTIAL) && (type == 1))
+        memcpy(sector + 0x00C, header, 3);
+    rebuild_header(sector, type);
+    if (kind & RECORD_NOEDC)
+        memset(sector + 0x92C, 0, 4);
+    else
+    {
+        edc_generate_decode(sector, type);
+        since = ecm_stats_tally(st, cycles, STAT_EDC, since);
+        if (type != 3)
+        {
+            ecm_ecc_generate_decode(sector, type == 2);
+            since = ecm_stats_tally(st, cycles, STAT_ECC, since);
+        }
+    }
+    if (kind & RECORD_SEQUENTIAL)
+        memcpy(sector + 0x00C, header, 3);
+    return since;
+}
+
+/*
+** Rebuild a sector of a record of kind whose payload has been read into
+** it; header as for rebuild_sector_timed
+*/
+void ecm_rebuild_record_sector(ecc_uint8 *sector, unsigned kind, const ecc_uint8 *header)
+{
+    rebuild_sector_timed(sector, kind, header, NULL, NULL, 0);
+}
+
+/*
+** Rebuild the sectors of a batch and compute the EDC of its output, starting
+** from zero so that it can be combined in later
+*/
+static void build_batch(struct decode_batch *batch, struct ecm_stats *st)
+{
+    unsigned long long cycles[STAT_COUNT] = {0};
+    unsigned long long t = ecm_stats_now(st);
+    ecc_uint32 edc = 0;
+    unsigned long long length = 0;
+    unsigned i;
+    for (i = 0; i < batch->count; i++)
+    {
+        if (batch->types[i])
+            t = rebuild_sector_timed(batch->slots[i], batch->types[i], NULL, st, cycles, t);
+        switch (batch->types[i])
+        {
+        case 0:
+            if (batch->direct[i])
+                edc = ecm_edc_partial_computeblock_long(edc, batch->direct[i], batch->lengths[i]);
+            else
+                edc = ecm_edc_partial_computeblock(edc, batch->slots[i], batch->lengths[i]);
+            length += batch->lengths[i];
+            break;
+        case 1:
+            edc = ecm_edc_partial_computeblock(edc, batch->slots[i], 2352);
+            length += 2352;
+            break;
+        case 2:
+        case 3:
+            edc = ecm_edc_partial_computeblock(edc, batch->slots[i] + 0x10, 2336);
+            length += 2336;
+            break;
+        }
+        t = ecm_stats_tally(st, cycles, STAT_EDC, t);
+    }
+    ecm_stats_add(st, cycles);
+    batch->edc = edc;
+    batch->length = length;
+}
+
+static void batch_set_state(
+    struct decoder *dec,
+    struct decode_batch *batch,
+    int state)
+{
+    pthread_mutex_lock(&dec->lock);
+    batch->state = state;
+    pthread_cond_broadcast(&dec->changed);
+    pthread_mutex_unlock(&dec->lock);
+}
+
+static struct decode_batch *parser_next_batch(struct decoder *dec)
+{
+    struct decode_batch *batch;
+    pthread_mutex_lock(&dec->lock);
+    batch = &dec->batches[dec->parse_seq % dec->nbatches];
+    while (batch->state != BATCH_FREE)
+        pthread_cond_wait(&dec->changed, &dec->lock);
+    dec->parse_seq++;
+    pthread_mutex_unlock(&dec->lock);
+    batch->count = 0;
+    batch->last = 0;
+    return batch;
+}
+
+static void *decode_parser(void *arg)
+{
+    struct decoder *dec = arg;
+    struct ecm_input *in = dec->in;
+    struct decode_batch *batch = parser_next_batch(dec);
+    unsigned long long cycles[STAT_COUNT] = {0};
+    unsigned long long t = ecm_stats_now(dec->stats);
+    int status = DECODE_OK;
     unsigned type;
     unsigned num;
-    fseek(in, 0, SEEK_END);
-    resetcounter_decode(ftell(in));
-    fseek(in, 0, SEEK_SET);
-    if (
-        (fgetc(in) != 'E') ||
-        (fgetc(in) != 'C') ||
-        (fgetc(in) != 'M') ||
-        (fgetc(in) != 0x00))
+    for (;;)
     {
-        fprintf(stderr, "Header not found!\n");
-        goto corrupt;
+        status = ecm_read_type_count(in, &type, &num);
+        if (status == DECODE_END)
+        {
+            status = DECODE_OK;
+            if (ecm_input_read(in, dec->trailer, 4) != 4)
+                status = DECODE_UNEOF;
+            break;
+        }
+        if (status != DECODE_OK)
+            break;
+        ecm_stats_record(dec->stats, type, num);
+        while (num)
+        {
+            ecc_uint8 *slot;
+            if (batch->count == BATCH_SECTORS)
+            {
+                ecm_stats_add(dec->stats, cycles);
+                batch_set_state(dec, batch, BATCH_PARSED);
+                batch = parser_next_batch(dec);
+                t = ecm_stats_now(dec->stats);
+            }
+            slot = batch->slots[batch->count];
+            switch (type)
+            {
+            case 0:
+                batch->direct[batch->count] = NULL;
+                if ((num >= LITERAL_DIRECT_MIN) &&
+                    (batch->direct[batch->count] = ecm_input_view(in, num)))
+                {
+                    batch->lengths[batch->count] = num;
+                    num = 0;
+                    break;
+                }
+                batch->lengths[batch->count] = (num > 2352) ? 2352 : num;
+                if (ecm_input_read(in, slot, batch->lengths[batch->count]) !=
+                    batch->lengths[batch->count])
+                    status = DECODE_UNEOF;
+                num -= batch->lengths[batch->count];
+                break;
+            case 1:
+                if ((ecm_input_read(in, slot + 0x00C, 0x003) != 0x003) ||
+                    (ecm_input_read(in, slot + 0x010, 0x800) != 0x800))
+                    status = DECODE_UNEOF;
+                num--;
+                break;
+            case 2:
+                if (ecm_input_read(in, slot + 0x014, 0x804) != 0x804)
+                    status = DECODE_UNEOF;
+                num--;
+                break;
+            case 3:
+                if (ecm_input_read(in, slot + 0x014, 0x918) != 0x918)
+                    status = DECODE_UNEOF;
+                num--;
+                break;
+            }
+            t = ecm_stats_tally(dec->stats, cycles, STAT_READ, t);
+            if (status != DECODE_OK)
+                goto done;
+            batch->types[batch->count++] = type;
+            setcounter_decode(dec->counter, ecm_input_tell(in));
+        }
     }
+done:
+    ecm_stats_add(dec->stats, cycles);
+    pthread_mutex_lock(&dec->lock);
+    dec->status = status;
+    dec->parse_done = 1;
+    batch->last = 1;
+    batch->state = BATCH_PARSED;
+    pthread_cond_broadcast(&dec->changed);
+    pthread_mutex_unlock(&dec->lock);
+    return NULL;
+}
+
+static void *decode_builder(void *arg)
+{
+    struct decoder *dec = arg;
+    struct decode_batch *batch;
     for (;;)
     {
-        int c = fgetc(in);
-        int bits = 5;
-        if (c == EOF)
-            goto uneof;
-        type = c & 3;
-        num = (c >> 2) & 0x1F;
-        while (c & 0x80)
+        pthread_mutex_lock(&dec->lock);
+        for (;;)
         {
-            c = fgetc(in);
-            if (c == EOF)
-                goto uneof;
-            num |= ((unsigned)(c & 0x7F)) << bits;
-            bits += 7;
+            batch = &dec->batches[dec->build_seq % dec->nbatches];
+            if (dec->build_seq != dec->parse_seq && batch->state == BATCH_PARSED)
+                break;
+            if (dec->parse_done && dec->build_seq == dec->parse_seq)
+            {
+                pthread_mutex_unlock(&dec->lock);
+                return NULL;
+            }
+            pthread_cond_wait(&dec->changed, &dec->lock);
         }
-        if (num == 0xFFFFFFFF)
-            break;
-        num++;
-        if (num >= 0x80000000)
-            goto corrupt;
-        if (!type)
+        dec->build_seq++;
+        batch->state = BATCH_BUILDING;
+        pthread_mutex_unlock(&dec->lock);
+        build_batch(batch, dec->stats);
+        batch_set_state(dec, batch, BATCH_BUILT);
+    }
+}
+
+static int decode_records_threaded(
+    struct ecm_input *in,
+    struct ecm_output *out,
+    struct decode_counter *counter,
+    struct ecm_stats *st,
+    unsigned threads,
+    unsigned *checkedc,
+    ecc_uint8 *trailer)
+{
+    struct decoder dec;
+    struct decode_batch *batch;
+    pthread_t parser;
+    pthread_t *builders;
+    unsigned nbuilders = 0;
+    int last = 0;
+    unsigned i;
+    memset(&dec, 0, sizeof(dec));
+    dec.in = in;
+    dec.counter = counter;
+    dec.stats = st;
+    dec.nbatches = 2 * threads + 2;
+    dec.batches = calloc(dec.nbatches, sizeof(*dec.batches));
+    builders = calloc(threads, sizeof(*builders));
+    if (!dec.batches || !builders)
+    {
+        free(dec.batches);
+        free(builders);
+        return DECODE_NOTHREADS;
+    }
+    pthread_mutex_init(&dec.lock, NULL);
+    pthread_cond_init(&dec.changed, NULL);
+    if (pthread_create(&parser, NULL, decode_parser, &dec))
+    {
+        pthread_mutex_destroy(&dec.lock);
+        pthread_cond_destroy(&dec.changed);
+        free(dec.batches);
+        free(builders);
+        return DECODE_NOTHREADS;
+    }
+    for (i = 0; i < threads; i++)
+        if (!pthread_create(&builders[nbuilders], NULL, decode_builder, &dec))
+            nbuilders++;
+    while (!last)
+    {
+        unsigned long long t;
+        pthread_mutex_lock(&dec.lock);
+        batch = &dec.batches[dec.write_seq % dec.nbatches];
+        while (batch->state != BATCH_BUILT &&
+               (nbuilders || batch->state != BATCH_PARSED))
+            pthread_cond_wait(&dec.changed, &dec.lock);
+        dec.write_seq++;
+        if (!nbuilders)
+            dec.build_seq++;
+        pthread_mutex_unlock(&dec.lock);
+        if (!nbuilders)
+            build_batch(batch, st);
+        t = ecm_stats_now(st);
+        for (i = 0; i < batch->count; i++)
         {
+            switch (batch->types[i])
+            {
+            case 0:
+                if (batch->direct[i])
+                    ecm_output_passthrough(out, in, batch->direct[i], batch->lengths[i]);
+                else
+                    ecm_output_write(out, batch->slots[i], batch->lengths[i]);
+                break;
+            case 1:
+                ecm_output_write(out, batch->slots[i], 2352);
+                break;
+            case 2:
+            case 3:
+                ecm_output_write(out, batch->slots[i] + 0x10, 2336);
+                break;
+            }
+        }
+        ecm_stats_lap(st, STAT_WRITE, t);
+        *checkedc = ecm_edc_combine(*checkedc, batch->edc, batch->length);
+        last = batch->last;
+        batch_set_state(&dec, batch, BATCH_FREE);
+    }
+    pthread_join(parser, NULL);
+    for (i = 0; i < nbuilders; i++)
+        pthread_join(builders[i], NULL);
+    memcpy(trailer, dec.trailer, 4);
+    pthread_mutex_destroy(&dec.lock);
+    pthread_cond_destroy(&dec.changed);
+    free(dec.batches);
+    free(builders);
+    return dec.status;
+}
+
+/***************************************************************************/
+
+/***************************************************************************/
+/*
+** Read the payload of one sector of a record of kind into sector, laid out
+** as ecm_rebuild_sector expects
+*/
+static int read_sector(struct ecm_input *in, ecc_uint8 *sector, unsigned kind)
+{
+    ecc_uint8 *user;
+    size_t data;
+    switch (kind & 3)
+    {
+    case 1:
+        if (!(kind & RECORD_SEQUENTIAL) && (ecm_input_read(in, sector + 0x00C, 0x003) != 0x003))
+            return DECODE_UNEOF;
+        data = 0x800;
+        break;
+    case 2:
+        if (ecm_input_read(in, sector + 0x014, 0x004) != 0x004)
+            return DECODE_UNEOF;
+        data = 0x800;
+        break;
+    case 3:
+        if (ecm_input_read(in, sector + 0x014, 0x004) != 0x004)
+            return DECODE_UNEOF;
+        data = 0x914;
+        break;
+    default:
+        data = 0x920;
+        break;
+    }
+    /* User data starts at 0x18 in Mode 2 and 0x10 otherwise */
+    user = sector + (((kind & 3) >= 2) ? 0x018 : 0x010);
+    if (kind & RECORD_ZERO)
+        memset(user, 0, data);
+    else if (ecm_input_read(in, user, data) != data)
+        return DECODE_UNEOF;
+    return DECODE_OK;
+}
+
+/*
+** Decode records up to the end-of-records marker, folding the output into
+** checkedc.  The extended record kinds are only allowed in a v2 block, and
+** a record that would take the output past limit bytes is corrupt.
+** Returns DECODE_OK at the marker, DECODE_UNEOF or DECODE_CORRUPT.
+*/
+static int decode_records(
+    struct ecm_input *in,
+    struct ecm_output *out,
+    struct decode_counter *counter,
+    struct ecm_stats *st,
+    int extended,
+    unsigned long long limit,
+    unsigned *checkedc)
+{
+    unsigned long long cycles[STAT_COUNT] = {0};
+    unsigned long long start = ecm_output_tell(out);
+    unsigned long long t;
+    unsigned char sector[2352];
+    ecc_uint8 header[7];
+    unsigned kind;
+    unsigned num;
+    t = ecm_stats_now(st);
+    for (;;)
+    {
+        int status = extended ? ecm_read_record_header(in, &kind, &num)
+                              : ecm_read_type_count(in, &kind, &num);
+        if (status == DECODE_END)
+            return DECODE_OK;
+        if (status != DECODE_OK)
+            return status;
+        if ((unsigned long long)num * ecm_record_output(kind) >
+            limit - (ecm_output_tell(out) - start))
+            return DECODE_CORRUPT;
+        ecm_stats_record(st, kind, num);
+        if (!kind)
+        {
+            const ecc_uint8 *direct;
+            /* Long literal runs go straight from a mapped input */
+            if ((num >= LITERAL_DIRECT_MIN) && (direct = ecm_input_view(in, num)))
+            {
+                t = ecm_stats_tally(st, cycles, STAT_READ, t);
+                *checkedc = ecm_edc_partial_computeblock_long(*checkedc, direct, num);
+                t = ecm_stats_tally(st, cycles, STAT_EDC, t);
+                ecm_output_passthrough(out, in, direct, num);
+                t = ecm_stats_tally(st, cycles, STAT_WRITE, t);
+                ecm_stats_add(st, cycles);
+                setcounter_decode(counter, ecm_input_tell(in));
+                continue;
+            }
             while (num)
             {
                 int b = num;
                 if (b > 2352)
                     b = 2352;
-                if (fread(sector, 1, b, in) != b)
-                    goto uneof;
-                checkedc = edc_partial_computeblock(checkedc, sector, b);
-                fwrite(sector, 1, b, out);
+                if (ecm_input_read(in, sector, b) != b)
+                    return DECODE_UNEOF;
+                t = ecm_stats_tally(st, cycles, STAT_READ, t);
+                *checkedc = ecm_edc_partial_computeblock(*checkedc, sector, b);
+                t = ecm_stats_tally(st, cycles, STAT_EDC, t);
+                ecm_output_write(out, sector, b);
+                t = ecm_stats_tally(st, cycles, STAT_WRITE, t);
+                ecm_stats_add(st, cycles);
                 num -= b;
-                setcounter_decode(ftell(in), verbose);
+                setcounter_decode(counter, ecm_input_tell(in));
             }
         }
-        else
+        else if (kind == RECORD_COPY)
         {
+            unsigned long back;
+            if (ecm_input_read(in, header, 7) != 7)
+                return DECODE_UNEOF;
+            back = ecm_get_le(header + 3, 4);
             while (num--)
             {
-                memset(sector, 0, sizeof(sector));
-                memset(sector + 1, 0xFF, 10);
-                switch (type)
+                const ecc_uint8 *src = ecm_output_recall(out, back, 2352);
+                if (!src)
+                    return DECODE_CORRUPT;
+                memcpy(sector, src, 2352);
+                memcpy(sector + 0x00C, header, 3);
+                ecm_msf_next(header);
+                t = ecm_stats_tally(st, cycles, STAT_READ, t);
+                /* Only Mode 1 EDC and ECC depend on the address */
+                if (sector[0x00F] == 0x01)
                 {
-                case 1:
-                    sector[0x0F] = 0x01;
-                    if (fread(sector + 0x00C, 1, 0x003, in) != 0x003)
-                        goto uneof;
-                    if (fread(sector + 0x010, 1, 0x800, in) != 0x800)
-                        goto uneof;
-                    eccedc_generate_decode(sector, 1);
-                    checkedc = edc_partial_computeblock(checkedc, sector, 2352);
-                    fwrite(sector, 2352, 1, out);
-                    setcounter_decode(ftell(in), verbose);
-                    break;
-                case 2:
-                    sector[0x0F] = 0x02;
-                    if (fread(sector + 0x014, 1, 0x804, in) != 0x804)
-                        goto uneof;
-                    sector[0x10] = sector[0x14];
-                    sector[0x11] = sector[0x15];
-                    sector[0x12] = sector[0x16];
-                    sector[0x13] = sector[0x17];
-                    eccedc_generate_decode(sector, 2);
-                    checkedc = edc_partial_computeblock(checkedc, sector + 0x10, 2336);
-                    fwrite(sector + 0x10, 2336, 1, out);
-                    setcounter_decode(ftell(in), verbose);
-                    break;
-                case 3:
-                    sector[0x0F] = 0x02;
-                    if (fread(sector + 0x014, 1, 0x918, in) != 0x918)
-                        goto uneof;
-                    sector[0x10] = sector[0x14];
-                    sector[0x11] = sector[0x15];
-                    sector[0x12] = sector[0x16];
-                    sector[0x13] = sector[0x17];
-                    eccedc_generate_decode(sector, 3);
-                    checkedc = edc_partial_computeblock(checkedc, sector + 0x10, 2336);
-                    fwrite(sector + 0x10, 2336, 1, out);
-                    setcounter_decode(ftell(in), verbose);
-                    break;
+                    ecm_eccedc_generate_decode(sector, 1);
+                    t = ecm_stats_tally(st, cycles, STAT_ECC, t);
                 }
+                *checkedc = ecm_edc_partial_computeblock(*checkedc, sector, 2352);
+                t = ecm_stats_tally(st, cycles, STAT_EDC, t);
+                ecm_output_write(out, sector, 2352);
+                t = ecm_stats_tally(st, cycles, STAT_WRITE, t);
+                ecm_stats_add(st, cycles);
+                setcounter_decode(counter, ecm_input_tell(in));
+            }
+        }
+        else
+        {
+            size_t n = ecm_record_output(kind);
+            const ecc_uint8 *p = sector + 2352 - n;
+            if (ecm_input_read(in, header, ecm_record_prefix(kind)) != ecm_record_prefix(kind))
+                return DECODE_UNEOF;
+            while (num--)
+            {
+                if (read_sector(in, sector, kind) != DECODE_OK)
+                    return DECODE_UNEOF;
+                t = ecm_stats_tally(st, cycles, STAT_READ, t);
+                t = rebuild_sector_timed(sector, kind, header, st, cycles, t);
+                if (kind & RECORD_SEQUENTIAL)
+                    ecm_msf_next(header);
+                *checkedc = ecm_edc_partial_computeblock(*checkedc, p, n);
+                t = ecm_stats_tally(st, cycles, STAT_EDC, t);
+                ecm_output_write(out, p, n);
+                t = ecm_stats_tally(st, cycles, STAT_WRITE, t);
+                ecm_stats_add(st, cycles);
+                setcounter_decode(counter, ecm_input_tell(in));
+            }
+        }
+    }
+}
+
+/***************************************************************************/
+/*
+** v2 container
+**
+** Each block's records are taken whole -- straight from a mapped input, or
+** read into a buffer -- and decoded from memory, so a block can be checked
+** against its length and EDC as soon as it is done.  Blocks are decoded
+** into memory, where copy records find the sectors they repeat, and written
+** out in order; with threads, groups of blocks are decoded side by side.
+** The block table in the footer has to agree with the blocks that came
+** before it.
+*/
+
+struct decode_block
+{
+    const ecc_uint8 *records;
+    ecc_uint8 *buffer;
+    size_t length;
+    unsigned long decoded;
+    ecc_uint32 records_edc;
+    ecc_uint32 edc;
+    struct ecm_output out;
+    int status;
+};
+
+struct decode_group
+{
+    struct ecm_input *in;
+    struct decode_block *blocks;
+    struct ecm_stats *stats;
+};
+
+/*
+** Check one block's records and decode them to out; returns DECODE_CORRUPT
+** if either does not match its header
+*/
+static int decode_block(
+    struct ecm_input *in,
+    struct decode_block *b,
+    struct ecm_output *out,
+    struct ecm_stats *st)
+{
+    struct ecm_input block;
+    struct decode_counter quiet;
+    unsigned long start = ecm_output_tell(out);
+    unsigned edc = 0;
+    int status;
+    if (ecm_edc_partial_computeblock_long(0, b->records, b->length) != b->records_edc)
+        return DECODE_CORRUPT;
+    memset(&block, 0, sizeof(block));
+    block.data = b->records;
+    block.size = b->length;
+    /* Records still in the mapping can be passed through from it */
+    if (!b->buffer)
+    {
+        block.file = in->file;
+        block.map = in->map;
+    }
+    resetcounter_decode(&quiet, 0, 0);
+    status = decode_records(&block, out, &quiet, st, 1, b->decoded, &edc);
+    if ((status == DECODE_OK) &&
+        ((ecm_input_tell(&block) != b->length) ||
+         (ecm_output_tell(out) - start != b->decoded) ||
+         (edc != b->edc)))
+        status = DECODE_CORRUPT;
+    return status;
+}
+
+static void decode_group_job(void *arg, unsigned job)
+{
+    struct decode_group *g = arg;
+    struct decode_block *b = &g->blocks[job];
+    if (ecm_output_open_memory(&b->out, b->decoded + 1))
+        b->status = DECODE_CORRUPT;
+    else
+        b->status = decode_block(g->in, b, &b->out, g->stats);
+    if (b->out.failed)
+        b->status = DECODE_CORRUPT;
+}
+
+/*
+** Read the next block header and take its records.  Returns DECODE_END
+** at the end of the blocks, with their number in count.
+*/
+static int read_block(
+    struct ecm_input *in,
+    struct decode_block *b,
+    unsigned long most,
+    unsigned *count)
+{
+    ecc_uint8 header[ECM_V2_HEADER_SIZE];
+    if (ecm_input_read(in, header, ECM_V2_HEADER_SIZE) != ECM_V2_HEADER_SIZE)
+        return DECODE_UNEOF;
+    b->length = ecm_get_le(header, 4);
+    b->decoded = ecm_get_le(header + 4, 4);
+    b->records_edc = ecm_get_le(header + 8, 4);
+    b->edc = ecm_get_le(header + 12, 4);
+    b->buffer = NULL;
+    if (!b->length)
+    {
+        *count = b->decoded;
+        return DECODE_END;
+    }
+    if (!b->decoded || (b->decoded > most) || (b->length > ECM_V2_RECORDS_MAX(most)))
+        return DECODE_CORRUPT;
+    b->records = ecm_input_view(in, b->length);
+    if (b->records)
+        return DECODE_OK;
+    b->buffer = malloc(b->length);
+    if (!b->buffer)
+        return DECODE_CORRUPT;
+    b->records = b->buffer;
+    if (ecm_input_read(in, b->buffer, b->length) != b->length)
+        return DECODE_UNEOF;
+    return DECODE_OK;
+}
+
+/*
+** Check the footer against the table of the count blocks decoded
+*/
+static int read_footer(struct ecm_input *in, const ecc_uint8 *table, unsigned count)
+{
+    ecc_uint8 entry[ECM_V2_ENTRY_SIZE];
+    ecc_uint8 trailer[ECM_V2_TRAILER_SIZE];
+    ecc_uint32 edc = 0;
+    unsigned i;
+    for (i = 0; i < count; i++)
+    {
+        if (ecm_input_read(in, entry, ECM_V2_ENTRY_SIZE) != ECM_V2_ENTRY_SIZE)
+            return DECODE_UNEOF;
+        if (memcmp(entry, table + (size_t)i * ECM_V2_ENTRY_SIZE, ECM_V2_ENTRY_SIZE))
+            return DECODE_CORRUPT;
+        edc = ecm_edc_partial_computeblock(edc, entry, ECM_V2_ENTRY_SIZE);
+    }
+    if (ecm_input_read(in, trailer, ECM_V2_TRAILER_SIZE) != ECM_V2_TRAILER_SIZE)
+        return DECODE_UNEOF;
+    if ((ecm_get_le(trailer, 4) != count) ||
+        (ecm_get_le(trailer + 4, 4) != edc) ||
+        memcmp(trailer + 8, "ECMF", 4))
+        return DECODE_CORRUPT;
+    return DECODE_OK;
+}
+
+/*
+** Decode the blocks of a v2 container, after the magic
+*/
+static int decode_blocks(
+    struct ecm_input *in,
+    struct ecm_output *out,
+    struct decode_counter *counter,
+    struct ecm_stats *st,
+    int threads)
+{
+    struct decode_group group;
+    ecc_uint8 field[4];
+    ecc_uint8 *table = NULL;
+    ecm_pool *pool = NULL;
+    unsigned long long offset = 8;
+    unsigned long most;
+    unsigned nblocks = 0;
+    unsigned count = 0;
+    unsigned size = 1;
+    unsigned n = 0;
+    int failed = 0;
+    unsigned i;
+    int status = DECODE_OK;
+    if (ecm_input_read(in, field, 4) != 4)
+        return DECODE_UNEOF;
+    most = ecm_get_le(field, 4);
+    if (!most || (most > ECM_V2_MAX_SECTORS))
+        return DECODE_CORRUPT;
+    most *= 2352;
+    if (threads > 1)
+    {
+        pool = ecm_pool_create(threads);
+        size = 2 * threads;
+    }
+    group.in = in;
+    group.stats = st;
+    group.blocks = calloc(size, sizeof(*group.blocks));
+    if (!group.blocks)
+        status = DECODE_CORRUPT;
+    while (status == DECODE_OK)
+    {
+        /* Take up to a group of blocks */
+        for (n = 0; n < size; n++)
+        {
+            struct decode_block *b = &group.blocks[n];
+            ecc_uint8 *grown;
+            status = read_block(in, b, most, &count);
+            if (status != DECODE_OK)
+                break;
+            grown = realloc(table, (size_t)(nblocks + 1) * ECM_V2_ENTRY_SIZE);
+            if (!grown)
+            {
+                status = DECODE_CORRUPT;
+                break;
+            }
+            table = grown;
+            grown += (size_t)nblocks++ * ECM_V2_ENTRY_SIZE;
+            ecm_put_le(grown, offset, 8);
+            ecm_put_le(grown + 8, b->length, 4);
+            ecm_put_le(grown + 12, b->decoded, 4);
+            ecm_put_le(grown + 16, b->records_edc, 4);
+            ecm_put_le(grown + 20, b->edc, 4);
+            offset += ECM_V2_HEADER_SIZE + b->length;
+        }
+        /* Blocks read before a read error still go out, as they would one at
+           a time; the first block that fails to decode ends the output */
+        ecm_pool_run(pool, decode_group_job, &group, n);
+        for (i = 0; i < n; i++)
+        {
+            struct decode_block *b = &group.blocks[i];
+            if (!failed && (b->status != DECODE_OK))
+            {
+                status = b->status;
+                failed = 1;
+            }
+            if (!failed)
+            {
+                unsigned long long t = ecm_stats_now(st);
+                ecm_output_write(out, b->out.block, b->out.fill);
+                ecm_stats_lap(st, STAT_WRITE, t);
             }
+            ecm_output_close(&b->out);
+        }
+        for (i = 0; i < size; i++)
+        {
+            free(group.blocks[i].buffer);
+            group.blocks[i].buffer = NULL;
+        }
+        if (failed || ((status != DECODE_OK) && (status != DECODE_END)))
+            break;
+        setcounter_decode(counter, ecm_input_tell(in));
+        if (status == DECODE_END)
+        {
+            status = (count == nblocks) ? read_footer(in, table, count) : DECODE_CORRUPT;
+            break;
+        }
+    }
+    ecm_pool_destroy(pool);
+    free(group.blocks);
+    free(table);
+    return status;
+}
+
+int ecm_decode_file(FILE *file, FILE *outfile, int verbose, int threads)
+{
+    struct ecm_input input;
+    struct ecm_input *in = &input;
+    struct ecm_output output;
+    struct ecm_output *out = &output;
+    struct decode_counter counter;
+    struct ecm_stats *st;
+    unsigned checkedc = 0;
+    unsigned char sector[4];
+    int v2 = 0;
+    int status;
+    fseek(file, 0, SEEK_END);
+    resetcounter_decode(&counter, ftell(file), verbose);
+    fseek(file, 0, SEEK_SET);
+    /* Threaded, the parser and the writer run besides the builders */
+    st = ecm_stats_open("decode", counter.total, (threads > 1) ? threads + 2 : 1);
+    counter.stats = st;
+    ecm_input_open(in, file);
+    ecm_output_open(out, outfile);
+    ecm_output_sparse(out);
+    if (ecm_input_read(in, sector, 4) == 4)
+    {
+        /* A compressed ECM file is decompressed on the way in */
+        int method = ecm_codec_detect(sector, 4);
+        if (method != ECM_CODEC_NONE)
+        {
+            if (ecm_input_decompress(in, method, sector, 4))
+            {
+                fprintf(stderr, "Input is compressed with %s, which this build does not support\n",
+                        ecm_codec_name(method));
+                goto corrupt;
+            }
+            if (ecm_input_read(in, sector, 4) != 4)
+                memset(sector, 0, 4);
+        }
+    }
+    else
+        memset(sector, 0, 4);
+    if (!memcmp(sector, "ECM", 3) && (sector[3] == ECM_V2_VERSION))
+    {
+        v2 = 1;
+        ecm_stats_classes(st, STAT_RECORDS);
+        status = decode_blocks(in, out, &counter, st, threads);
+        if (status == DECODE_UNEOF)
+            goto uneof;
+        if (status != DECODE_OK)
+            goto corrupt;
+        goto verify;
+    }
+    if (memcmp(sector, "ECM", 4))
+    {
+        fprintf(stderr, "Header not found!\n");
+        goto corrupt;
+    }
+    if (threads > 1)
+    {
+        status = decode_records_threaded(in, out, &counter, st, threads, &checkedc, sector);
+        switch (status)
+        {
+        case DECODE_UNEOF:
+            goto uneof;
+        case DECODE_CORRUPT:
+            goto corrupt;
         }
+        if (status != DECODE_NOTHREADS)
+            goto verify;
     }
-    if (fread(sector, 1, 4, in) != 4)
+    status = decode_records(in, out, &counter, st, 0, ~0ULL, &checkedc);
+    if (status == DECODE_UNEOF)
+        goto uneof;
+    if (status != DECODE_OK)
+        goto corrupt;
+    if (ecm_input_read(in, sector, 4) != 4)
         goto uneof;
+verify:
     if (verbose)
-        fprintf(stderr, "Decoded %ld bytes -> %ld bytes\n", ftell(in), ftell(out));
-    if (
+        fprintf(stderr, "Decoded %lu bytes -> %lu bytes\n", ecm_input_tell(in), ecm_output_tell(out));
+    if (!v2 && (
         (sector[0] != ((checkedc >> 0) & 0xFF)) ||
         (sector[1] != ((checkedc >> 8) & 0xFF)) ||
         (sector[2] != ((checkedc >> 16) & 0xFF)) ||
-        (sector[3] != ((checkedc >> 24) & 0xFF)))
+        (sector[3] != ((checkedc >> 24) & 0xFF))))
     {
         if (verbose)
             fprintf(stderr,
@@ -271,6 +1161,23 @@ int decode_file(FILE *in, FILE *out, int verbose)
                     sector[0]);
         goto corrupt;
     }
+    /* A compressed stream cut short after the ECM data is still cut short */
+    if (ecm_input_finish(in))
+    {
+        if (verbose)
+            fprintf(stderr, "Compressed stream is truncated or has trailing data\n");
+        goto corrupt;
+    }
+    /* Output may still be going out from the input mapping */
+    if (ecm_output_close(out))
+    {
+        ecm_stats_close(st, ecm_input_tell(in), ecm_output_tell(out));
+        ecm_input_close(in);
+        fprintf(stderr, "Write error\n");
+        return 1;
+    }
+    ecm_stats_close(st, ecm_input_tell(in), ecm_output_tell(out));
+    ecm_input_close(in);
     if (verbose)
         fprintf(stderr, "Done; file is OK\n");
     return 0;
@@ -280,5 +1187,349 @@ uneof:
 corrupt:
     if (verbose)
         fprintf(stderr, "Corrupt ECM file!\n");
+    ecm_output_close(out);
+    ecm_stats_close(st, ecm_input_tell(in), ecm_output_tell(out));
+    ecm_input_close(in);
     return 1;
 }
+
+/***************************************************************************/
+/*
+** Streaming decoder (libecm.h)
+**
+** The serial loop turned inside out: magic, record headers, sector payloads
+** and the trailer are gathered a piece at a time as input arrives, literals
+** go straight from next_in to next_out, and each rebuilt sector is held
+** until the caller has taken all of it.
+**
+** A v2 container is taken a block at a time: its records are gathered,
+** checked and decoded as in decode_blocks, and the decoded block is held
+** until the caller has taken all of it.  The footer is checked against the
+** EDC of the table the blocks make, rather than the table itself.  The two
+** block buffers are allocated once the block size is known.
+*/
+#define STREAM_MAGIC 0
+#define STREAM_HEADER 1
+#define STREAM_LITERAL 2
+#define STREAM_PAYLOAD 3
+#define STREAM_SECTOR 4
+#define STREAM_TRAILER 5
+#define STREAM_DONE 6
+#define STREAM_FAILED 7
+#define STREAM_V2_SIZE 8
+#define STREAM_BLOCK 9
+#define STREAM_RECORDS 10
+#define STREAM_DECODED 11
+#define STREAM_FOOTER 12
+
+struct stream_decoder
+{
+    int state;
+    unsigned type;
+    unsigned num;
+    int bits;
+    size_t have;
+    ecc_uint32 edc;
+    ecc_uint8 sector[2352];
+    /* v2 container only */
+    unsigned long most;
+    unsigned long long offset;
+    unsigned nblocks;
+    ecc_uint32 table_edc;
+    struct decode_block block;
+    ecc_uint8 *records;
+    struct ecm_output decoded;
+    int decoded_open;
+};
+
+/* Payload bytes per sector by type */
+static const unsigned stream_payload[4] = {0, 0x803, 0x804, 0x918};
+
+static int stream_fail(ecm_stream *strm, struct stream_decoder *d, const char *msg)
+{
+    d->state = STREAM_FAILED;
+    strm->msg = msg;
+    return ECM_STREAM_ERROR;
+}
+
+/*
+** Take what the v2 block header in d->sector says; the records follow
+*/
+static int stream_block(ecm_stream *strm, struct stream_decoder *d)
+{
+    struct decode_block *b = &d->block;
+    ecc_uint8 entry[ECM_V2_ENTRY_SIZE];
+    b->length = ecm_get_le(d->sector, 4);
+    b->decoded = ecm_get_le(d->sector + 4, 4);
+    b->records_edc = ecm_get_le(d->sector + 8, 4);
+    b->edc = ecm_get_le(d->sector + 12, 4);
+    if (!b->length)
+    {
+        if (b->decoded != d->nblocks)
+            return stream_fail(strm, d, "block count does not match");
+        d->num = d->nblocks * ECM_V2_ENTRY_SIZE;
+        d->edc = 0;
+        d->have = 0;
+        d->state = STREAM_FOOTER;
+        return ECM_STREAM_OK;
+    }
+    if (!b->decoded || (b->decoded > d->most) || (b->length > ECM_V2_RECORDS_MAX(d->most)))
+        return stream_fail(strm, d, "corrupt block header");
+    /* The footer's entry for this block, as far as its EDC goes */
+    ecm_put_le(entry, d->offset, 8);
+    memcpy(entry + 8, d->sector, ECM_V2_HEADER_SIZE);
+    d->table_edc = ecm_edc_partial_computeblock(d->table_edc, entry, ECM_V2_ENTRY_SIZE);
+    d->offset += ECM_V2_HEADER_SIZE + b->length;
+    d->nblocks++;
+    b->records = d->records;
+    b->buffer = d->records;
+    d->have = 0;
+    d->state = STREAM_RECORDS;
+    return ECM_STREAM_OK;
+}
+
+int ecm_decode_init(ecm_stream *strm)
+{
+    ecm_eccedc_init();
+    strm->total_in = 0;
+    strm->total_out = 0;
+    strm->msg = NULL;
+    strm->state = calloc(1, sizeof(struct stream_decoder));
+    return strm->state ? ECM_STREAM_OK : ECM_STREAM_MEMORY;
+}
+
+int ecm_decode(ecm_stream *strm, int flush)
+{
+    struct stream_decoder *d = strm->state;
+    size_t n;
+    int c;
+    if (!d)
+        return ECM_STREAM_ERROR;
+    for (;;)
+    {
+        if (d->state == STREAM_DONE)
+            return ECM_STREAM_END;
+        if (d->state == STREAM_FAILED)
+            return ECM_STREAM_ERROR;
+        if (d->state == STREAM_SECTOR)
+        {
+            /* Mode 2 output starts at the subheader */
+            size_t size = (d->type == 1) ? 2352 : 2336;
+            const ecc_uint8 *from = d->sector + 2352 - size;
+            n = size - d->have;
+            if (n > strm->avail_out)
+                n = strm->avail_out;
+            memcpy(strm->next_out, from + d->have, n);
+            strm->next_out += n;
+            strm->avail_out -= n;
+            strm->total_out += n;
+            d->have += n;
+            if (d->have < size)
+                return ECM_STREAM_OK;
+            d->have = 0;
+            d->state = --d->num ? STREAM_PAYLOAD : STREAM_HEADER;
+            continue;
+        }
+        if (d->state == STREAM_DECODED)
+        {
+            n = ecm_output_drain(&d->decoded, strm->next_out, strm->avail_out);
+            strm->next_out += n;
+            strm->avail_out -= n;
+            strm->total_out += n;
+            if (ecm_output_pending(&d->decoded))
+                return ECM_STREAM_OK;
+            d->decoded.fill = d->decoded.drained = 0;
+            d->have = 0;
+            d->state = STREAM_BLOCK;
+            continue;
+        }
+        if (!strm->avail_in)
+        {
+            if (flush == ECM_FINISH)
+                return stream_fail(strm, d, "unexpected end of input");
+            return ECM_STREAM_OK;
+        }
+        if (d->state == STREAM_RECORDS)
+        {
+            n = d->block.length - d->have;
+            if (n > strm->avail_in)
+                n = strm->avail_in;
+            memcpy(d->records + d->have, strm->next_in, n);
+            strm->next_in += n;
+            strm->avail_in -= n;
+            strm->total_in += n;
+            d->have += n;
+            if (d->have < d->block.length)
+                continue;
+            if (decode_block(NULL, &d->block, &d->decoded, NULL) || d->decoded.failed)
+                return stream_fail(strm, d, "corrupt block");
+            d->state = STREAM_DECODED;
+            continue;
+        }
+        if (d->state == STREAM_LITERAL)
+        {
+            n = d->num;
+            if (n > strm->avail_in)
+                n = strm->avail_in;
+            if (n > strm->avail_out)
+                n = strm->avail_out;
+            if (!n)
+                return ECM_STREAM_OK;
+            memcpy(strm->next_out, strm->next_in, n);
+            d->edc = ecm_edc_partial_computeblock_long(d->edc, strm->next_out, n);
+            strm->next_in += n;
+            strm->avail_in -= n;
+            strm->total_in += n;
+            strm->next_out += n;
+            strm->avail_out -= n;
+            strm->total_out += n;
+            d->num -= n;
+            if (!d->num)
+                d->state = STREAM_HEADER;
+            continue;
+        }
+        if (d->state == STREAM_PAYLOAD)
+        {
+            size_t size = stream_payload[d->type];
+            ecc_uint8 *dest;
+            /* Mode 1 keeps the address at 0x0C and the data from 0x10 */
+            if (d->type == 1)
+            {
+                dest = d->sector + ((d->have < 3) ? 0x0C : 0x0D) + d->have;
+                size = (d->have < 3) ? 3 : size;
+            }
+            else
+                dest = d->sector + 0x14 + d->have;
+            n = size - d->have;
+            if (n > strm->avail_in)
+                n = strm->avail_in;
+            memcpy(dest, strm->next_in, n);
+            strm->next_in += n;
+            strm->avail_in -= n;
+            strm->total_in += n;
+            d->have += n;
+            if (d->have < stream_payload[d->type])
+                continue;
+            ecm_rebuild_sector(d->sector, d->type);
+            d->edc = (d->type == 1) ?
+                ecm_edc_partial_computeblock(d->edc, d->sector, 2352) :
+                ecm_edc_partial_computeblock(d->edc, d->sector + 0x10, 2336);
+            d->have = 0;
+            d->state = STREAM_SECTOR;
+            continue;
+        }
+        c = *strm->next_in++;
+        strm->avail_in--;
+        strm->total_in++;
+        switch (d->state)
+        {
+        case STREAM_MAGIC:
+            if ((d->have == 3) && (c == ECM_V2_VERSION))
+            {
+                d->have = 0;
+                d->state = STREAM_V2_SIZE;
+                break;
+            }
+            if (c != "ECM"[d->have])
+                return stream_fail(strm, d, "header not found");
+            if (++d->have == 4)
+            {
+                d->have = 0;
+                d->state = STREAM_HEADER;
+            }
+            break;
+        case STREAM_V2_SIZE:
+            d->sector[d->have++] = c;
+            if (d->have < 4)
+                break;
+            d->most = ecm_get_le(d->sector, 4);
+            if (!d->most || (d->most > ECM_V2_MAX_SECTORS))
+                return stream_fail(strm, d, "corrupt block size");
+            d->most *= 2352;
+            if (ecm_output_open_memory(&d->decoded, d->most + 1))
+                return stream_fail(strm, d, "out of memory");
+            d->decoded_open = 1;
+            d->records = malloc(ECM_V2_RECORDS_MAX(d->most));
+            if (!d->records)
+                return stream_fail(strm, d, "out of memory");
+            d->offset = 8;
+            d->have = 0;
+            d->state = STREAM_BLOCK;
+            break;
+        case STREAM_BLOCK:
+            d->sector[d->have++] = c;
+            if ((d->have == ECM_V2_HEADER_SIZE) && stream_block(strm, d))
+                return ECM_STREAM_ERROR;
+            break;
+        case STREAM_FOOTER:
+            /* The table, then its length, EDC and "ECMF" */
+            if (d->num)
+            {
+                d->sector[0] = c;
+                d->edc = ecm_edc_partial_computeblock(d->edc, d->sector, 1);
+                d->num--;
+                break;
+            }
+            d->sector[d->have++] = c;
+            if (d->have < ECM_V2_TRAILER_SIZE)
+                break;
+            if ((d->edc != d->table_edc) ||
+                (ecm_get_le(d->sector, 4) != d->nblocks) ||
+                (ecm_get_le(d->sector + 4, 4) != d->table_edc) ||
+                memcmp(d->sector + 8, "ECMF", 4))
+                return stream_fail(strm, d, "corrupt footer");
+            d->state = STREAM_DONE;
+            break;
+        case STREAM_HEADER:
+            if (!d->bits)
+            {
+                d->type = c & 3;
+                d->num = (c >> 2) & 0x1F;
+                d->bits = 5;
+            }
+            else
+            {
+                if (d->bits > 31)
+                    return stream_fail(strm, d, "corrupt record header");
+                d->num |= ((unsigned)(c & 0x7F)) << d->bits;
+                d->bits += 7;
+            }
+            if (c & 0x80)
+                break;
+            d->bits = 0;
+            if (d->num == 0xFFFFFFFF)
+            {
+                d->state = STREAM_TRAILER;
+                break;
+            }
+            if (++d->num >= 0x80000000)
+                return stream_fail(strm, d, "corrupt record header");
+            d->state = d->type ? STREAM_PAYLOAD : STREAM_LITERAL;
+            break;
+        case STREAM_TRAILER:
+            d->sector[d->have++] = c;
+            if (d->have < 4)
+                break;
+            if ((d->sector[0] != ((d->edc >> 0) & 0xFF)) ||
+                (d->sector[1] != ((d->edc >> 8) & 0xFF)) ||
+                (d->sector[2] != ((d->edc >> 16) & 0xFF)) ||
+                (d->sector[3] != ((d->edc >> 24) & 0xFF)))
+                return stream_fail(strm, d, "EDC error");
+            d->state = STREAM_DONE;
+            break;
+        }
+    }
+}
+
+void ecm_decode_end(ecm_stream *strm)
+{
+    struct stream_decoder *d = strm->state;
+    if (d)
+    {
+        if (d->decoded_open)
+            ecm_output_close(&d->decoded);
+        free(d->records);
+    }
+    free(strm->state);
+    strm->state = NULL;
+}
@@ -0,0 +1,396 @@
+/**************************************************************************/
+/*
+** ECC P/Q kernels shared by the encoder and decoder.
+** Copyright (C) 2002 Neill Corlett
+** Copyright (C) 2024 Jonathan Birge
+**
+***************************************************************************/
+/*
+** The P code is 86 majors of 24 minors and the Q code is 52 majors of 43
+** minors, both over the 2236 bytes starting at sector offset 0xC.  For each
+** major the code is a = sum(t[i] * x^(n-i)), b = sum(t[i]), which is a plain
+** Horner loop over the minors.  The vector kernels run that loop for 16 or 32
+** majors at once (one major per byte lane) and finish with a split-nibble
+** shuffle multiply in place of the ecm_ecc_b_lut lookup.
+**
+** P minors are contiguous 86-byte rows, so they are loaded straight from the
+** sector.  Q majors run diagonally with wraparound; their minors are gathered
+** into rows first using a precomputed offset table.
+**
+***************************************************************************/
+
+#include <string.h>
+#include "ecm.h"
+#include "../config.h"
+
+#if defined(HAVE_IMMINTRIN_H) && defined(__GNUC__) && \
+    (defined(__x86_64__) || defined(__i386__))
+#define ECC_HAVE_SIMD 1
+#include <immintrin.h>
+#endif
+
+#define ECC_P_MAJORS 86
+#define ECC_P_MINORS 24
+#define ECC_Q_MAJORS 52
+#define ECC_Q_MINORS 43
+#define ECC_Q_SIZE (ECC_Q_MAJORS * ECC_Q_MINORS)
+
+/* Q gather layout: byte offset of each even/odd major pair, per minor */
+static ecc_uint16 ecc_q_gather[ECC_Q_MINORS][ECC_Q_MAJORS / 2];
+
+/* ecm_ecc_b_lut split into low and high nibble halves */
+static ecc_uint8 ecc_b_lut_lo[16];
+static ecc_uint8 ecc_b_lut_hi[16];
+
+static void (*ecc_p_impl)(const ecc_uint8 *, ecc_uint8 *);
+static void (*ecc_q_impl)(const ecc_uint8 *, ecc_uint8 *);
+static int ecc_impl_tier;
+static int ecc_best_tier;
+
+static const char *ecc_tier_names[ECC_TIER_COUNT] = {
+    "scalar", "ssse3", "avx2"};
+
+/***************************************************************************/
+/*
+** Reference implementation, for any geometry
+*/
+void ecm_ecc_computeblock_scalar(
+    const ecc_uint8 *src,
+    ecc_uint32 major_count,
+    ecc_uint32 minor_count,
+    ecc_uint32 major_mult,
+    ecc_uint32 minor_inc,
+    ecc_uint8 *dest)
+{
+    ecc_uint32 size = major_count * minor_count;
+    ecc_uint32 major, minor;
+    for (major = 0; major < major_count; major++)
+    {
+        ecc_uint32 index = (major >> 1) * major_mult + (major & 1);
+        ecc_uint8 ecc_a = 0;
+        ecc_uint8 ecc_b = 0;
+        for (minor = 0; minor < minor_count; minor++)
+        {
+            ecc_uint8 temp = src[index];
+            index += minor_inc;
+            if (index >= size)
+                index -= size;
+            ecc_a ^= temp;
+            ecc_b ^= temp;
+            ecc_a = ecm_ecc_f_lut[ecc_a];
+        }
+        ecc_a = ecm_ecc_b_lut[ecm_ecc_f_lut[ecc_a] ^ ecc_b];
+        dest[major] = ecc_a;
+        dest[major + major_count] = ecc_a ^ ecc_b;
+    }
+}
+
+static void ecc_p_scalar(const ecc_uint8 *src, ecc_uint8 *dest)
+{
+    ecm_ecc_computeblock_scalar(src, ECC_P_MAJORS, ECC_P_MINORS, 2, 86, dest);
+}
+
+static void ecc_q_scalar(const ecc_uint8 *src, ecc_uint8 *dest)
+{
+    ecm_ecc_computeblock_scalar(src, ECC_Q_MAJORS, ECC_Q_MINORS, 86, 88, dest);
+}
+
+/*
+** Gather the Q minors into rows of ECC_Q_MAJORS bytes
+*/
+static void ecc_q_transpose(const ecc_uint8 *src, ecc_uint8 *rows)
+{
+    ecc_uint32 minor, pair;
+    for (minor = 0; minor < ECC_Q_MINORS; minor++)
+        for (pair = 0; pair < ECC_Q_MAJORS / 2; pair++)
+        {
+            const ecc_uint8 *p = src + ecc_q_gather[minor][pair];
+            *rows++ = p[0];
+            *rows++ = p[1];
+        }
+}
+
+#ifdef ECC_HAVE_SIMD
+/***************************************************************************/
+/*
+** SSSE3: 16 majors per vector
+*/
+__attribute__((target("ssse3"))) static void ecc_rows_ssse3(
+    const ecc_uint8 *src,
+    ecc_uint32 stride,
+    ecc_uint32 minor_count,
+    ecc_uint32 major_count,
+    const ecc_uint32 *lanes,
+    ecc_uint32 nlanes,
+    ecc_uint8 *dest)
+{
+    const __m128i poly = _mm_set1_epi8(0x1D);
+    const __m128i nibble = _mm_set1_epi8(0x0F);
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i blo = _mm_loadu_si128((const __m128i *)ecc_b_lut_lo);
+    const __m128i bhi = _mm_loadu_si128((const __m128i *)ecc_b_lut_hi);
+    ecc_uint32 lane, minor;
+    for (lane = 0; lane < nlanes; lane++)
+    {
+        const ecc_uint8 *p = src + lanes[lane];
+        __m128i a = zero;
+        __m128i b = zero;
+        __m128i y;
+        for (minor = 0; minor < minor_count; minor++)
+        {
+            __m128i t = _mm_loadu_si128((const __m128i *)p);
+            p += stride;
+            a = _mm_xor_si128(a, t);
+            b = _mm_xor_si128(b, t);
+            a = _mm_xor_si128(_mm_add_epi8(a, a),
+                              _mm_and_si128(_mm_cmplt_epi8(a, zero), poly));
+        }
+        y = _mm_xor_si128(_mm_xor_si128(_mm_add_epi8(a, a),
+                                        _mm_and_si128(_mm_cmplt_epi8(a, zero), poly)),
+                          b);
+        a = _mm_xor_si128(
+            _mm_shuffle_epi8(blo, _mm_and_si128(y, nibble)),
+            _mm_shuffle_epi8(bhi, _mm_and_si128(_mm_srli_epi16(y, 4), nibble)));
+        _mm_storeu_si128((__m128i *)(dest + lanes[lane]), a);
+        _mm_storeu_si128((__m128i *)(dest + lanes[lane] + major_count),
+                         _mm_xor_si128(a, b));
+    }
+}
+
+static const ecc_uint32 ecc_p_lanes_ssse3[] = {0, 16, 32, 48, 64, 70};
+static const ecc_uint32 ecc_q_lanes_ssse3[] = {0, 16, 32, 36};
+
+static void ecc_p_ssse3(const ecc_uint8 *src, ecc_uint8 *dest)
+{
+    ecc_rows_ssse3(src, ECC_P_MAJORS, ECC_P_MINORS, ECC_P_MAJORS,
+                   ecc_p_lanes_ssse3, 6, dest);
+}
+
+static void ecc_q_ssse3(const ecc_uint8 *src, ecc_uint8 *dest)
+{
+    ecc_uint8 rows[ECC_Q_SIZE];
+    ecc_q_transpose(src, rows);
+    ecc_rows_ssse3(rows, ECC_Q_MAJORS, ECC_Q_MINORS, ECC_Q_MAJORS,
+                   ecc_q_lanes_ssse3, 4, dest);
+}
+
+/***************************************************************************/
+/*
+** AVX2: 32 majors per vector
+*/
+__attribute__((target("avx2"))) static void ecc_rows_avx2(
+    const ecc_uint8 *src,
+    ecc_uint32 stride,
+    ecc_uint32 minor_count,
+    ecc_uint32 major_count,
+    const ecc_uint32 *lanes,
+    ecc_uint32 nlanes,
+    ecc_uint8 *dest)
+{
+    const __m256i poly = _mm256_set1_epi8(0x1D);
+    const __m256i nibble = _mm256_set1_epi8(0x0F);
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i blo = _mm256_broadcastsi128_si256(
+        _mm_loadu_si128((const __m128i *)ecc_b_lut_lo));
+    const __m256i bhi = _mm256_broadcastsi128_si256(
+        _mm_loadu_si128((const __m128i *)ecc_b_lut_hi));
+    ecc_uint32 lane, minor;
+    for (lane = 0; lane < nlanes; lane++)
+    {
+        const ecc_uint8 *p = src + lanes[lane];
+        __m256i a = zero;
+        __m256i b = zero;
+        __m256i y;
+        for (minor = 0; minor < minor_count; minor++)
+        {
+            __m256i t = _mm256_loadu_si256((const __m256i *)p);
+            p += stride;
+            a = _mm256_xor_si256(a, t);
+            b = _mm256_xor_si256(b, t);
+            a = _mm256_xor_si256(_mm256_add_epi8(a, a),
+                                 _mm256_and_si256(_mm256_cmpgt_epi8(zero, a), poly));
+        }
+        y = _mm256_xor_si256(_mm256_xor_si256(_mm256_add_epi8(a, a),
+                                              _mm256_and_si256(_mm256_cmpgt_epi8(zero, a), poly)),
+                             b);
+        a = _mm256_xor_si256(
+            _mm256_shuffle_epi8(blo, _mm256_and_si256(y, nibble)),
+            _mm256_shuffle_epi8(bhi, _mm256_and_si256(_mm256_srli_epi16(y, 4), nibble)));
+        _mm256_storeu_si256((__m256i *)(dest + lanes[lane]), a);
+        _mm256_storeu_si256((__m256i *)(dest + lanes[lane] + major_count),
+                            _mm256_xor_si256(a, b));
+    }
+}
+
+static const ecc_uint32 ecc_p_lanes_avx2[] = {0, 32, 54};
+static const ecc_uint32 ecc_q_lanes_avx2[] = {0, 20};
+
+static void ecc_p_avx2(const ecc_uint8 *src, ecc_uint8 *dest)
+{
+    ecc_rows_avx2(src, ECC_P_MAJORS, ECC_P_MINORS, ECC_P_MAJORS,
+                  ecc_p_lanes_avx2, 3, dest);
+}
+
+static void ecc_q_avx2(const ecc_uint8 *src, ecc_uint8 *dest)
+{
+    ecc_uint8 rows[ECC_Q_SIZE];
+    ecc_q_transpose(src, rows);
+    ecc_rows_avx2(rows, ECC_Q_MAJORS, ECC_Q_MINORS, ECC_Q_MAJORS,
+                  ecc_q_lanes_avx2, 2, dest);
+}
+#endif
+
+/***************************************************************************/
+/*
+** Build the gather layout and nibble tables, and pick the kernels.  Called
+** from ecm_eccedc_init once ecm_ecc_b_lut is filled.
+*/
+void ecm_ecc_init(void)
+{
+    ecc_uint32 minor, pair, i;
+    for (minor = 0; minor < ECC_Q_MINORS; minor++)
+        for (pair = 0; pair < ECC_Q_MAJORS / 2; pair++)
+            ecc_q_gather[minor][pair] = (pair * 86 + minor * 88) % ECC_Q_SIZE;
+    for (i = 0; i < 16; i++)
+    {
+        ecc_b_lut_lo[i] = ecm_ecc_b_lut[i];
+        ecc_b_lut_hi[i] = ecm_ecc_b_lut[i << 4];
+    }
+    ecc_p_impl = ecc_p_scalar;
+    ecc_q_impl = ecc_q_scalar;
+    ecc_impl_tier = ECC_TIER_SCALAR;
+#ifdef ECC_HAVE_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+    {
+        ecc_p_impl = ecc_p_avx2;
+        ecc_q_impl = ecc_q_avx2;
+        ecc_impl_tier = ECC_TIER_AVX2;
+    }
+    else if (__builtin_cpu_supports("ssse3"))
+    {
+        ecc_p_impl = ecc_p_ssse3;
+        ecc_q_impl = ecc_q_ssse3;
+        ecc_impl_tier = ECC_TIER_SSSE3;
+    }
+#endif
+    ecc_best_tier = ecc_impl_tier;
+}
+
+/*
+** Switch to another ECC kernel, for benchmarks and differential checks;
+** returns nonzero if this CPU cannot run it.  Must not be called while
+** other threads are computing ECC.
+*/
+int ecm_ecc_set_tier(int tier)
+{
+    if ((tier < ECC_TIER_SCALAR) || (tier > ecc_best_tier))
+        return -1;
+    switch (tier)
+    {
+    case ECC_TIER_SCALAR:
+        ecc_p_impl = ecc_p_scalar;
+        ecc_q_impl = ecc_q_scalar;
+        break;
+#ifdef ECC_HAVE_SIMD
+    case ECC_TIER_SSSE3:
+        ecc_p_impl = ecc_p_ssse3;
+        ecc_q_impl = ecc_q_ssse3;
+        break;
+    case ECC_TIER_AVX2:
+        ecc_p_impl = ecc_p_avx2;
+        ecc_q_impl = ecc_q_avx2;
+        break;
+#endif
+    }
+    ecc_impl_tier = tier;
+    return 0;
+}
+
+/***************************************************************************/
+/*
+** Compute ECC P (86 x 24) or Q (52 x 43) for the block at sector + 0xC.
+** dest receives 2 * major_count bytes.
+*/
+void ecm_ecc_computeblock(
+    const ecc_uint8 *src,
+    ecc_uint32 major_count,
+    ecc_uint32 minor_count,
+    ecc_uint32 major_mult,
+    ecc_uint32 minor_inc,
+    ecc_uint8 *dest)
+{
+    if (major_count == ECC_P_MAJORS && minor_count == ECC_P_MINORS &&
+        major_mult == 2 && minor_inc == 86)
+        ecc_p_impl(src, dest);
+    else if (major_count == ECC_Q_MAJORS && minor_count == ECC_Q_MINORS &&
+             major_mult == 86 && minor_inc == 88)
+        ecc_q_impl(src, dest);
+    else
+        ecm_ecc_computeblock_scalar(src, major_count, minor_count,
+                                    major_mult, minor_inc, dest);
+}
+
+/*
+** Name of the ECC implementation in use
+*/
+const char *ecm_ecc_tier_name(void)
+{
+    return ecc_tier_names[ecc_impl_tier];
+}
+
+/***************************************************************************/
+/*
+** Check every ECC kernel available on this CPU against the scalar loop on
+** random, all-zero and all-0xFF blocks.  Returns 0 if they all agree.
+*/
+int ecm_ecc_selftest(int verbose)
+{
+    static ecc_uint8 block[ECC_Q_SIZE];
+    void (*p_impl[ECC_TIER_COUNT])(const ecc_uint8 *, ecc_uint8 *);
+    void (*q_impl[ECC_TIER_COUNT])(const ecc_uint8 *, ecc_uint8 *);
+    const char *names[ECC_TIER_COUNT];
+    ecc_uint8 ref[2 * ECC_P_MAJORS], got[2 * ECC_P_MAJORS];
+    ecc_uint32 seed = 0x9E3779B9;
+    ecc_uint32 tier, ntiers = 0, round, i;
+    int errors = 0, tier_errors;
+#ifdef ECC_HAVE_SIMD
+    if (ecc_best_tier >= ECC_TIER_SSSE3)
+    {
+        p_impl[ntiers] = ecc_p_ssse3;
+        q_impl[ntiers] = ecc_q_ssse3;
+        names[ntiers++] = ecc_tier_names[ECC_TIER_SSSE3];
+    }
+    if (ecc_best_tier >= ECC_TIER_AVX2)
+    {
+        p_impl[ntiers] = ecc_p_avx2;
+        q_impl[ntiers] = ecc_q_avx2;
+        names[ntiers++] = ecc_tier_names[ECC_TIER_AVX2];
+    }
+#endif
+    for (tier = 0; tier < ntiers; tier++)
+    {
+        tier_errors = 0;
+        for (round = 0; round < 256; round++)
+        {
+            for (i = 0; i < ECC_Q_SIZE; i++)
+            {
+                seed = seed * 1103515245 + 12345;
+                block[i] = (round == 0) ? 0 : (round == 1) ? 0xFF : (seed >> 16);
+            }
+            ecc_p_scalar(block, ref);
+            p_impl[tier](block, got);
+            if (memcmp(ref, got, 2 * ECC_P_MAJORS))
+                tier_errors++;
+            ecc_q_scalar(block, ref);
+            q_impl[tier](block, got);
+            if (memcmp(ref, got, 2 * ECC_Q_MAJORS))
+                tier_errors++;
+        }
+        if (verbose)
+            fprintf(stderr, "ECC %-8s %s\n", names[tier],
+                    tier_errors ? "FAILED" : "ok");
+        errors += tier_errors;
+    }
+    return errors != 0;
+}
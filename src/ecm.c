@@ -1,36 +1,483 @@
+#include <stddef.h>
+#include <pthread.h>
 #include "ecm.h"
+#include "../config.h"
+
+#if defined(HAVE_IMMINTRIN_H) && defined(__GNUC__) && \
+    (defined(__x86_64__) || defined(__i386__))
+#define EDC_HAVE_PCLMUL 1
+#include <immintrin.h>
+#endif
 
 /* Globals */
-ecc_uint8 ecc_f_lut[256];
-ecc_uint8 ecc_b_lut[256];
-ecc_uint32 edc_lut[256];
+ecc_uint8 ecm_ecc_f_lut[256];
+ecc_uint8 ecm_ecc_b_lut[256];
+ecc_uint32 ecm_edc_lut[256];
+
+/* Slice-by-16 tables; ecm_edc_slice_lut[0] is the same as ecm_edc_lut */
+ecc_uint32 ecm_edc_slice_lut[16][256];
+
+/* x^(2^k) mod P, for shifting an EDC past 2^(k-3) bytes */
+static ecc_uint32 edc_x2n_lut[64 + 3];
+
+/* Active EDC implementation, chosen by ecm_eccedc_init */
+static ecc_uint32 (*edc_impl)(ecc_uint32, const ecc_uint8 *, ecc_uint32);
+static int edc_impl_tier;
+static int edc_best_tier;
+
+static const char *edc_tier_names[EDC_TIER_COUNT] = {
+    "scalar", "slice16", "pclmul"};
+
+/***************************************************************************/
+/*
+** x^n mod P in the reflected EDC domain (bit 0 is the x^31 coefficient)
+*/
+static ecc_uint32 edc_xpow(ecc_uint32 n)
+{
+    ecc_uint32 v = 0x80000000;
+    while (n--)
+        v = (v >> 1) ^ (v & 1 ? 0xD8018001 : 0);
+    return v;
+}
+
+/*
+** a * b mod P in the reflected EDC domain
+*/
+static ecc_uint32 edc_multmod(ecc_uint32 a, ecc_uint32 b)
+{
+    ecc_uint32 m = 0x80000000;
+    ecc_uint32 p = 0;
+    for (;;)
+    {
+        if (a & m)
+        {
+            p ^= b;
+            if (!(a & (m - 1)))
+                break;
+        }
+        m >>= 1;
+        b = (b >> 1) ^ (b & 1 ? 0xD8018001 : 0);
+    }
+    return p;
+}
+
+/***************************************************************************/
+/*
+** Reference byte-at-a-time EDC
+*/
+ecc_uint32 ecm_edc_computeblock_scalar(
+    ecc_uint32 edc,
+    const ecc_uint8 *src,
+    ecc_uint32 size)
+{
+    while (size--)
+        edc = (edc >> 8) ^ ecm_edc_lut[(edc ^ (*src++)) & 0xFF];
+    return edc;
+}
+
+/*
+** Portable slice-by-16 EDC (byte loads only, so no alignment or byte order
+** assumptions)
+*/
+ecc_uint32 ecm_edc_computeblock_slice16(
+    ecc_uint32 edc,
+    const ecc_uint8 *src,
+    ecc_uint32 size)
+{
+    while (size >= 16)
+    {
+        edc ^= (ecc_uint32)src[0] |
+               ((ecc_uint32)src[1] << 8) |
+               ((ecc_uint32)src[2] << 16) |
+               ((ecc_uint32)src[3] << 24);
+        edc = ecm_edc_slice_lut[15][edc & 0xFF] ^
+              ecm_edc_slice_lut[14][(edc >> 8) & 0xFF] ^
+              ecm_edc_slice_lut[13][(edc >> 16) & 0xFF] ^
+              ecm_edc_slice_lut[12][edc >> 24] ^
+              ecm_edc_slice_lut[11][src[4]] ^
+              ecm_edc_slice_lut[10][src[5]] ^
+              ecm_edc_slice_lut[9][src[6]] ^
+              ecm_edc_slice_lut[8][src[7]] ^
+              ecm_edc_slice_lut[7][src[8]] ^
+              ecm_edc_slice_lut[6][src[9]] ^
+              ecm_edc_slice_lut[5][src[10]] ^
+              ecm_edc_slice_lut[4][src[11]] ^
+              ecm_edc_slice_lut[3][src[12]] ^
+              ecm_edc_slice_lut[2][src[13]] ^
+              ecm_edc_slice_lut[1][src[14]] ^
+              ecm_edc_slice_lut[0][src[15]];
+        src += 16;
+        size -= 16;
+    }
+    if (size >= 8)
+    {
+        edc ^= (ecc_uint32)src[0] |
+               ((ecc_uint32)src[1] << 8) |
+               ((ecc_uint32)src[2] << 16) |
+               ((ecc_uint32)src[3] << 24);
+        edc = ecm_edc_slice_lut[7][edc & 0xFF] ^
+              ecm_edc_slice_lut[6][(edc >> 8) & 0xFF] ^
+              ecm_edc_slice_lut[5][(edc >> 16) & 0xFF] ^
+              ecm_edc_slice_lut[4][edc >> 24] ^
+              ecm_edc_slice_lut[3][src[4]] ^
+              ecm_edc_slice_lut[2][src[5]] ^
+              ecm_edc_slice_lut[1][src[6]] ^
+              ecm_edc_slice_lut[0][src[7]];
+        src += 8;
+        size -= 8;
+    }
+    while (size--)
+        edc = (edc >> 8) ^ ecm_edc_lut[(edc ^ (*src++)) & 0xFF];
+    return edc;
+}
+
+#ifdef EDC_HAVE_PCLMUL
+/*
+** Carry-less multiply folding.  Each 128-bit lane holds 16 message bytes; the
+** low qword is the earlier (higher degree) half.  Folding a lane forward by D
+** bits multiplies the low half by x^(64+D-1) and the high half by x^(D-1)
+** (the -1 absorbs the one bit shift of a reflected PCLMULQDQ product).  The
+** final lane is reduced by running it through the slice tables, which avoids
+** a separate Barrett step.
+*/
+static __m128i edc_fold_k512;
+static __m128i edc_fold_k128;
+
+__attribute__((target("sse2"))) static __m128i edc_fold_constants(
+    ecc_uint32 bits)
+{
+    return _mm_set_epi64x(
+        (long long)((unsigned long long)edc_xpow(bits - 1) << 32),
+        (long long)((unsigned long long)edc_xpow(64 + bits - 1) << 32));
+}
+
+__attribute__((target("pclmul,sse2"))) static __m128i edc_fold(
+    __m128i x,
+    __m128i k,
+    __m128i next)
+{
+    __m128i lo = _mm_clmulepi64_si128(x, k, 0x00);
+    __m128i hi = _mm_clmulepi64_si128(x, k, 0x11);
+    return _mm_xor_si128(_mm_xor_si128(lo, hi), next);
+}
+
+__attribute__((target("pclmul,sse2"))) ecc_uint32 ecm_edc_computeblock_pclmul(
+    ecc_uint32 edc,
+    const ecc_uint8 *src,
+    ecc_uint32 size)
+{
+    __m128i x0, x1, x2, x3;
+    ecc_uint8 lane[16];
+    if (size < 64)
+        return ecm_edc_computeblock_slice16(edc, src, size);
+    x0 = _mm_loadu_si128((const __m128i *)(src + 0x00));
+    x1 = _mm_loadu_si128((const __m128i *)(src + 0x10));
+    x2 = _mm_loadu_si128((const __m128i *)(src + 0x20));
+    x3 = _mm_loadu_si128((const __m128i *)(src + 0x30));
+    x0 = _mm_xor_si128(x0, _mm_cvtsi32_si128((int)edc));
+    src += 64;
+    size -= 64;
+    while (size >= 64)
+    {
+        x0 = edc_fold(x0, edc_fold_k512, _mm_loadu_si128((const __m128i *)(src + 0x00)));
+        x1 = edc_fold(x1, edc_fold_k512, _mm_loadu_si128((const __m128i *)(src + 0x10)));
+        x2 = edc_fold(x2, edc_fold_k512, _mm_loadu_si128((const __m128i *)(src + 0x20)));
+        x3 = edc_fold(x3, edc_fold_k512, _mm_loadu_si128((const __m128i *)(src + 0x30)));
+        src += 64;
+        size -= 64;
+    }
+    x1 = edc_fold(x0, edc_fold_k128, x1);
+    x2 = edc_fold(x1, edc_fold_k128, x2);
+    x3 = edc_fold(x2, edc_fold_k128, x3);
+    while (size >= 16)
+    {
+        x3 = edc_fold(x3, edc_fold_k128, _mm_loadu_si128((const __m128i *)src));
+        src += 16;
+        size -= 16;
+    }
+    _mm_storeu_si128((__m128i *)lane, x3);
+    edc = ecm_edc_computeblock_slice16(0, lane, 16);
+    return ecm_edc_computeblock_slice16(edc, src, size);
+}
+#endif
 
 /* Init routine */
-void eccedc_init(void)
+static void eccedc_init_once(void)
 {
     ecc_uint32 i, j, edc;
     for (i = 0; i < 256; i++)
     {
         j = (i << 1) ^ (i & 0x80 ? 0x11D : 0);
-        ecc_f_lut[i] = j;
-        ecc_b_lut[i ^ j] = i;
+        ecm_ecc_f_lut[i] = j;
+        ecm_ecc_b_lut[i ^ j] = i;
         edc = i;
         for (j = 0; j < 8; j++)
             edc = (edc >> 1) ^ (edc & 1 ? 0xD8018001 : 0);
-        edc_lut[i] = edc;
+        ecm_edc_lut[i] = edc;
+        ecm_edc_slice_lut[0][i] = edc;
+    }
+    for (i = 0; i < 256; i++)
+        for (j = 1; j < 16; j++)
+        {
+            edc = ecm_edc_slice_lut[j - 1][i];
+            ecm_edc_slice_lut[j][i] = (edc >> 8) ^ ecm_edc_lut[edc & 0xFF];
+        }
+    edc_x2n_lut[0] = edc_xpow(1);
+    for (i = 1; i < 64 + 3; i++)
+        edc_x2n_lut[i] = edc_multmod(edc_x2n_lut[i - 1], edc_x2n_lut[i - 1]);
+    ecm_ecc_init();
+    ecm_scan_init();
+    edc_impl = ecm_edc_computeblock_slice16;
+    edc_impl_tier = EDC_TIER_SLICE16;
+#ifdef EDC_HAVE_PCLMUL
+    edc_fold_k512 = edc_fold_constants(512);
+    edc_fold_k128 = edc_fold_constants(128);
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse2"))
+    {
+        edc_impl = ecm_edc_computeblock_pclmul;
+        edc_impl_tier = EDC_TIER_PCLMUL;
     }
+#endif
+    edc_best_tier = edc_impl_tier;
+}
+
+/*
+** The tables are only written here, so once this has run they can be
+** shared by any number of threads and streams.  Safe to call repeatedly.
+*/
+void ecm_eccedc_init(void)
+{
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+    pthread_once(&once, eccedc_init_once);
 }
 
 /***************************************************************************/
 /*
 ** Compute EDC for a block
 */
-ecc_uint32 edc_partial_computeblock(
+ecc_uint32 ecm_edc_partial_computeblock(
     ecc_uint32 edc,
     const ecc_uint8 *src,
     ecc_uint16 size)
 {
-    while (size--)
-        edc = (edc >> 8) ^ edc_lut[(edc ^ (*src++)) & 0xFF];
-    return edc;
+    return edc_impl(edc, src, size);
+}
+
+/*
+** Compute EDC for a block of any length
+*/
+ecc_uint32 ecm_edc_partial_computeblock_long(
+    ecc_uint32 edc,
+    const ecc_uint8 *src,
+    size_t size)
+{
+    while (size > 0x8000)
+    {
+        edc = edc_impl(edc, src, 0x8000);
+        src += 0x8000;
+        size -= 0x8000;
+    }
+    return edc_impl(edc, src, size);
+}
+
+/*
+** Combine the EDCs of two adjacent blocks into the EDC of both, given the
+** length of the second.  The EDC has no initial value or final XOR, so the
+** first block's EDC only has to be carried past size2 bytes of zeros, which
+** takes one multiply per set bit of size2.
+*/
+ecc_uint32 ecm_edc_combine(
+    ecc_uint32 edc1,
+    ecc_uint32 edc2,
+    unsigned long long size2)
+{
+    ecc_uint32 k = 3;
+    while (size2 && edc1)
+    {
+        if (size2 & 1)
+            edc1 = edc_multmod(edc_x2n_lut[k], edc1);
+        size2 >>= 1;
+        k++;
+    }
+    return edc1 ^ edc2;
+}
+
+/***************************************************************************/
+/*
+** Little-endian fields, as used by the container and index formats
+*/
+void ecm_put_le(ecc_uint8 *p, unsigned long long v, int n)
+{
+    int i;
+    for (i = 0; i < n; i++)
+        p[i] = (v >> (8 * i)) & 0xFF;
+}
+
+unsigned long long ecm_get_le(const ecc_uint8 *p, int n)
+{
+    unsigned long long v = 0;
+    int i;
+    for (i = n - 1; i >= 0; i--)
+        v = (v << 8) | p[i];
+    return v;
+}
+
+/*
+** Step a BCD minute:second:frame sector address on by one frame.  Bytes
+** that are not BCD give a wrong address, but the same one every time, and
+** that is all the sequential records need.
+*/
+void ecm_msf_next(ecc_uint8 *msf)
+{
+    unsigned m = (msf[0] >> 4) * 10 + (msf[0] & 15);
+    unsigned s = (msf[1] >> 4) * 10 + (msf[1] & 15);
+    unsigned f = (msf[2] >> 4) * 10 + (msf[2] & 15) + 1;
+    if (f >= 75)
+    {
+        f = 0;
+        if (++s >= 60)
+        {
+            s = 0;
+            if (++m >= 100)
+                m = 0;
+        }
+    }
+    msf[0] = ((m / 10) << 4) | (m % 10);
+    msf[1] = ((s / 10) << 4) | (s % 10);
+    msf[2] = ((f / 10) << 4) | (f % 10);
+}
+
+/***************************************************************************/
+
+/*
+** Switch to another EDC implementation, for benchmarks and differential
+** checks; returns nonzero if this CPU cannot run it.  Must not be called
+** while other threads are computing EDCs.
+*/
+int ecm_edc_set_tier(int tier)
+{
+    switch (tier)
+    {
+    case EDC_TIER_SCALAR:
+        edc_impl = ecm_edc_computeblock_scalar;
+        break;
+    case EDC_TIER_SLICE16:
+        edc_impl = ecm_edc_computeblock_slice16;
+        break;
+#ifdef EDC_HAVE_PCLMUL
+    case EDC_TIER_PCLMUL:
+        if (edc_best_tier < EDC_TIER_PCLMUL)
+            return -1;
+        edc_impl = ecm_edc_computeblock_pclmul;
+        break;
+#endif
+    default:
+        return -1;
+    }
+    edc_impl_tier = tier;
+    return 0;
+}
+
+/*
+** Name of the EDC implementation in use
+*/
+const char *ecm_edc_tier_name(void)
+{
+    return edc_tier_names[edc_impl_tier];
+}
+
+/***************************************************************************/
+/*
+** Check every EDC implementation available on this CPU against the scalar
+** loop, over random data at all alignments and a spread of lengths.
+** Returns 0 if they all agree.
+*/
+int ecm_edc_selftest(int verbose)
+{
+    static ecc_uint8 buf[2352 + 64];
+    ecc_uint32 (*impl[EDC_TIER_COUNT])(ecc_uint32, const ecc_uint8 *, ecc_uint32);
+    ecc_uint32 seed = 0x12345678;
+    ecc_uint32 tier, ntiers = 0, off, len, ref, got, init;
+    int errors = 0, tier_errors;
+    impl[ntiers++] = ecm_edc_computeblock_scalar;
+    impl[ntiers++] = ecm_edc_computeblock_slice16;
+#ifdef EDC_HAVE_PCLMUL
+    if (edc_best_tier == EDC_TIER_PCLMUL)
+        impl[ntiers++] = ecm_edc_computeblock_pclmul;
+#endif
+    for (off = 0; off < sizeof(buf); off++)
+    {
+        seed = seed * 1103515245 + 12345;
+        buf[off] = seed >> 16;
+    }
+    for (tier = 1; tier < ntiers; tier++)
+    {
+        tier_errors = 0;
+        for (off = 0; off < 16; off++)
+            for (len = 0; len + off <= 2352; len += (len < 160) ? 1 : 37)
+            {
+                seed = seed * 1103515245 + 12345;
+                init = (off & 1) ? seed : 0;
+                ref = ecm_edc_computeblock_scalar(init, buf + off, len);
+                got = impl[tier](init, buf + off, len);
+                if (got != ref)
+                {
+                    if (verbose && tier_errors < 8)
+                        fprintf(stderr,
+                                "EDC %s mismatch: offset %u length %u (%08X, should be %08X)\n",
+                                edc_tier_names[tier], off, len, got, ref);
+                    tier_errors++;
+                }
+            }
+        if (verbose)
+            fprintf(stderr, "EDC %-8s %s\n", edc_tier_names[tier],
+                    tier_errors ? "FAILED" : "ok");
+        errors += tier_errors;
+    }
+    /* Combining at every split point gives the EDC of the whole */
+    tier_errors = 0;
+    for (len = 0; len <= 2352; len += (len < 160) ? 1 : 37)
+    {
+        ref = ecm_edc_computeblock_scalar(0, buf, len);
+        for (off = 0; off <= len; off += (off < 64) ? 1 : 61)
+        {
+            got = ecm_edc_combine(ecm_edc_computeblock_scalar(0, buf, off),
+                                  ecm_edc_computeblock_scalar(0, buf + off, len - off),
+                                  len - off);
+            if (got != ref)
+            {
+                if (verbose && tier_errors < 8)
+                    fprintf(stderr,
+                            "EDC combine mismatch: split %u of %u (%08X, should be %08X)\n",
+                            off, len, got, ref);
+                tier_errors++;
+            }
+        }
+    }
+    /* Long shifts, against running the EDC over that many zero bytes */
+    for (len = 4093; len < (1 << 24); len = len * 7 + 1)
+    {
+        static const ecc_uint8 zeros[4096];
+        ecc_uint32 left = len;
+        init = ref = 0x1234567 * len;
+        while (left)
+        {
+            ecc_uint32 n = (left < sizeof(zeros)) ? left : sizeof(zeros);
+            ref = ecm_edc_computeblock_slice16(ref, zeros, n);
+            left -= n;
+        }
+        got = ecm_edc_combine(init, 0, len);
+        if (got != ref)
+        {
+            if (verbose && tier_errors < 8)
+                fprintf(stderr, "EDC combine mismatch: shift by %u (%08X, should be %08X)\n",
+                        len, got, ref);
+            tier_errors++;
+        }
+    }
+    if (verbose)
+        fprintf(stderr, "EDC combine  %s\n", tier_errors ? "FAILED" : "ok");
+    errors += tier_errors;
+    return errors != 0;
 }
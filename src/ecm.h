@@ -2,25 +2,393 @@
 #define ECM_H
 
 #include <stdio.h>
+#include "libecm.h"
 
 /* Data types */
 typedef unsigned char ecc_uint8;
 typedef unsigned short ecc_uint16;
 typedef unsigned int ecc_uint32;
 
+/* Worker pool (pool.c) */
+typedef struct ecm_pool ecm_pool;
+
+/* Background I/O (aio.c) */
+typedef struct ecm_aio ecm_aio;
+
+#define ECM_IO_AUTO (-1)
+#define ECM_IO_SYNC 0
+#define ECM_IO_THREAD 1
+#define ECM_IO_URING 2
+
+/* Built-in compression (compress.c) */
+typedef struct ecm_codec ecm_codec;
+
+#define ECM_CODEC_NONE 0
+#define ECM_CODEC_ZSTD 1
+#define ECM_CODEC_XZ 2
+
+/*
+** Input source (input.c); data is non-NULL when the input is mapped,
+** otherwise it comes through decompressed or aio blocks or, failing that,
+** stdio
+*/
+struct ecm_input
+{
+    FILE *file;
+    void *map;
+    size_t map_length;
+    const ecc_uint8 *data;
+    size_t size;
+    size_t pos;
+    ecm_aio *aio;
+    ecm_codec *codec;
+    const ecc_uint8 *block;
+    size_t block_length;
+    size_t block_pos;
+};
+
+/*
+** Output sink (output.c); writes go through aio blocks, blocks for the
+** compressor, or stdio, or with no file into a memory buffer that is
+** drained from drained to fill
+*/
+struct ecm_output
+{
+    FILE *file;
+    ecm_aio *aio;
+    ecm_codec *codec;
+    ecc_uint8 *block;
+    size_t block_size;
+    size_t fill;
+    size_t drained;
+    int failed;
+    unsigned long total;
+    int sparse;
+    unsigned long long zeros;
+};
+
+/* Stages timed for --stats (stats.c) */
+#define STAT_READ 0
+#define STAT_CLASSIFY 1
+#define STAT_EDC 2
+#define STAT_ECC 3
+#define STAT_WRITE 4
+#define STAT_IDLE 5
+#define STAT_COUNT 6
+
+/* Record classes counted for --stats: the basic types, the v2 classes,
+   then copies */
+#define STAT_RECORD_FORMLESS 4
+#define STAT_RECORD_ZERO 5
+#define STAT_RECORD_NOEDC 6
+#define STAT_RECORD_COPY 7
+#define STAT_RECORDS 8
+
+#define ECM_STATS_OFF 0
+#define ECM_STATS_TEXT 1
+#define ECM_STATS_JSON 2
+
+struct ecm_stats
+{
+    int format;
+    const char *operation;
+    int threads;
+    unsigned long long cycles[STAT_COUNT];
+    unsigned long long start;
+    double start_time;
+    double last_report;
+    unsigned long long total;
+    unsigned long long done;
+    unsigned long long written;
+    unsigned long long records[STAT_RECORDS];
+    unsigned long long units[STAT_RECORDS];
+    unsigned classes;
+};
+
+/* Many files in one run (batch.c) */
+struct batch_options
+{
+    const char *prog_name;
+    int decode;
+    int recursive;
+    int force;
+    int verbose;
+    int jobs;
+    int threads;
+};
+
+/*
+** Track layout from a cue sheet (cue.c): where each track of the image
+** starts, in bytes, and what it holds
+*/
+#define TRACK_OTHER 0
+#define TRACK_AUDIO 1
+#define TRACK_MODE1 2
+#define TRACK_MODE2 3
+
+struct ecm_track
+{
+    unsigned long long start;
+    int mode;
+};
+
+/* Record parsing results (decode.c) */
+#define DECODE_OK 0
+#define DECODE_UNEOF 1
+#define DECODE_CORRUPT 2
+#define DECODE_NOTHREADS 3
+#define DECODE_END 4
+
+/*
+** ECM v2 block container (--v2)
+**
+** "ECM" 0x02, the sectors per block (4), then the blocks.  A block is a
+** header -- length of its records (4), length of the input it covers (4),
+** EDC of the records (4), EDC of that input (4) -- followed by a record
+** stream of its own, ended by the end-of-records marker.  Each block covers
+** sectors * 2352 bytes of input (the last may cover less) and decodes
+** without the others.  A block header with a zero length ends the blocks
+** and carries their number in place of the input length.
+**
+** The EDC of the records catches damage to the file itself; the EDC of
+** the input alone would not, since a sector's own EDC cancels out of it.
+**
+** Besides the v1 records, a block may hold records of the kinds below.
+** Their header is a v1 header for the basic type whose count field, which
+** a v1 count never reaches, is 0x80000000 + (flags << 27) + count - 1:
+**
+**   RECORD_SEQUENTIAL  whole 2352-byte sectors, Mode 2 ones included, whose
+**                      addresses count up by one frame: the record starts
+**                      with the first address (3), and the sectors carry
+**                      none of their own
+**   RECORD_ZERO        sectors whose user data is all zeros, which is left
+**                      out (a Mode 2 sector keeps its subheader)
+**   RECORD_NOEDC       Mode 2 form 2 sectors whose EDC field is zero, as
+**                      streaming (VCD, XA) discs often leave it
+**
+** With the basic type 0, RECORD_SEQUENTIAL means formless sectors: a sync
+** and header with any mode byte (Mode 0, or Mode 2 that is neither form)
+** and 2336 bytes with nothing to check them by.  The record starts with the
+** first address and the mode byte (4); Mode 0 sectors, all zeros, are also
+** RECORD_ZERO.
+**
+** RECORD_COPY (with the basic type 0 and no other flags) repeats sectors
+** decoded earlier in the same block (--dedup): the record holds the first
+** address (3) and how far back the copied sectors start in the decoded
+** block (4), and nothing per sector.  Each sector is the one that far back
+** with its own address, and the EDC and ECC redone for Mode 1.
+**
+** The footer is the block table, one entry per block: file offset of its
+** header (8) and the rest of its header (16); then the block count (4),
+** the EDC of the table entries (4) and "ECMF".
+**
+** All fields are little endian.
+*/
+#define ECM_V2_VERSION 2
+#define ECM_V2_DEFAULT_SECTORS 1024
+#define ECM_V2_MAX_SECTORS 65536
+#define ECM_V2_HEADER_SIZE 16
+#define ECM_V2_ENTRY_SIZE 24
+#define ECM_V2_TRAILER_SIZE 12
+/* Records of a block decoding to at most n bytes: a header per sector, one
+   more for the end marker, and no more payload than output */
+#define ECM_V2_RECORDS_MAX(n) ((n) + ((n) / 2352 + 1) * 5)
+
+/* Record kinds: the basic type, 0 to 3, and flags */
+#define RECORD_SEQUENTIAL 4
+#define RECORD_ZERO 8
+#define RECORD_NOEDC 16
+#define RECORD_COPY 32
+#define RECORD_KINDS 64
+#define RECORD_EXTENDED 0x80000000
+#define RECORD_EXTENDED_MAX 0x08000000
+
 /* LUTs used for computing ECC/EDC */
-extern ecc_uint8 ecc_f_lut[];
-extern ecc_uint8 ecc_b_lut[];
-extern ecc_uint32 edc_lut[];
+extern ecc_uint8 ecm_ecc_f_lut[];
+extern ecc_uint8 ecm_ecc_b_lut[];
+extern ecc_uint32 ecm_edc_lut[];
+extern ecc_uint32 ecm_edc_slice_lut[16][256];
+
+/* EDC implementation tiers, fastest last */
+#define EDC_TIER_SCALAR 0
+#define EDC_TIER_SLICE16 1
+#define EDC_TIER_PCLMUL 2
+#define EDC_TIER_COUNT 3
+
+/* ECC kernel tiers, fastest last */
+#define ECC_TIER_SCALAR 0
+#define ECC_TIER_SSSE3 1
+#define ECC_TIER_AVX2 2
+#define ECC_TIER_COUNT 3
+
+/* Sector scanner tiers, fastest last */
+#define SCAN_TIER_SCALAR 0
+#define SCAN_TIER_SSE2 1
+#define SCAN_TIER_AVX2 2
+#define SCAN_TIER_COUNT 3
 
 /* Functions */
 void print_usage(const char *prog_name);
-void eccedc_init(void);
-ecc_uint32 edc_partial_computeblock(
+void ecm_eccedc_init(void);
+ecc_uint32 ecm_edc_partial_computeblock(
     ecc_uint32 edc,
     const ecc_uint8 *src,
     ecc_uint16 size);
-int encode_file(FILE *in, FILE *out, int verbose);
-int decode_file(FILE *in, FILE *out, int verbose);
+ecc_uint32 ecm_edc_partial_computeblock_long(
+    ecc_uint32 edc,
+    const ecc_uint8 *src,
+    size_t size);
+ecc_uint32 ecm_edc_computeblock_scalar(
+    ecc_uint32 edc,
+    const ecc_uint8 *src,
+    ecc_uint32 size);
+ecc_uint32 ecm_edc_computeblock_slice16(
+    ecc_uint32 edc,
+    const ecc_uint8 *src,
+    ecc_uint32 size);
+ecc_uint32 ecm_edc_combine(
+    ecc_uint32 edc1,
+    ecc_uint32 edc2,
+    unsigned long long size2);
+void ecm_put_le(ecc_uint8 *p, unsigned long long v, int n);
+unsigned long long ecm_get_le(const ecc_uint8 *p, int n);
+void ecm_msf_next(ecc_uint8 *msf);
+int ecm_edc_set_tier(int tier);
+const char *ecm_edc_tier_name(void);
+int ecm_edc_selftest(int verbose);
+void ecm_ecc_init(void);
+void ecm_ecc_computeblock(
+    const ecc_uint8 *src,
+    ecc_uint32 major_count,
+    ecc_uint32 minor_count,
+    ecc_uint32 major_mult,
+    ecc_uint32 minor_inc,
+    ecc_uint8 *dest);
+void ecm_ecc_computeblock_scalar(
+    const ecc_uint8 *src,
+    ecc_uint32 major_count,
+    ecc_uint32 minor_count,
+    ecc_uint32 major_mult,
+    ecc_uint32 minor_inc,
+    ecc_uint8 *dest);
+int ecm_ecc_set_tier(int tier);
+const char *ecm_ecc_tier_name(void);
+int ecm_ecc_selftest(int verbose);
+void ecm_scan_init(void);
+size_t ecm_sector_scan(const ecc_uint8 *buf, size_t n);
+size_t ecm_sector_scan_scalar(const ecc_uint8 *buf, size_t n);
+size_t ecm_repeat_scan(const ecc_uint8 *buf, size_t n);
+size_t ecm_repeat_scan_scalar(const ecc_uint8 *buf, size_t n);
+int ecm_scan_set_tier(int tier);
+const char *ecm_scan_tier_name(void);
+int ecm_scan_selftest(int verbose);
+ecm_pool *ecm_pool_create(int nthreads);
+int ecm_pool_size(const ecm_pool *pool);
+void ecm_pool_run(
+    ecm_pool *pool,
+    void (*fn)(void *arg, unsigned job),
+    void *arg,
+    unsigned njobs);
+void ecm_pool_destroy(ecm_pool *pool);
+void ecm_input_open(struct ecm_input *in, FILE *file);
+void ecm_input_close(struct ecm_input *in);
+int ecm_input_getc(struct ecm_input *in);
+size_t ecm_input_read(struct ecm_input *in, void *dest, size_t n);
+size_t ecm_input_skip(struct ecm_input *in, size_t n);
+const ecc_uint8 *ecm_input_view(struct ecm_input *in, size_t n);
+unsigned long ecm_input_tell(struct ecm_input *in);
+int ecm_input_error(struct ecm_input *in);
+int ecm_input_finish(struct ecm_input *in);
+int ecm_input_hole(
+    struct ecm_input *in,
+    unsigned long long pos,
+    unsigned long long *start,
+    unsigned long long *end);
+void ecm_output_open(struct ecm_output *out, FILE *file);
+int ecm_output_open_memory(struct ecm_output *out, size_t size);
+int ecm_output_close(struct ecm_output *out);
+void ecm_output_sparse(struct ecm_output *out);
+size_t ecm_output_drain(struct ecm_output *out, void *dest, size_t n);
+size_t ecm_output_pending(const struct ecm_output *out);
+void ecm_output_putc(struct ecm_output *out, int c);
+void ecm_output_write(struct ecm_output *out, const void *src, size_t n);
+void ecm_output_passthrough(
+    struct ecm_output *out,
+    struct ecm_input *in,
+    const ecc_uint8 *src,
+    size_t n);
+const ecc_uint8 *ecm_output_recall(const struct ecm_output *out, size_t back, size_t n);
+unsigned long ecm_output_tell(struct ecm_output *out);
+int ecm_aio_select(const char *name);
+ecm_aio *ecm_aio_open(int fd, int writing);
+ecc_uint8 *ecm_aio_buffer(ecm_aio *aio, size_t *size);
+void ecm_aio_write(ecm_aio *aio, size_t length);
+void ecm_aio_write_from(ecm_aio *aio, const ecc_uint8 *source, size_t length);
+int ecm_aio_offset(ecm_aio *aio, unsigned long long *offset);
+void ecm_aio_skip(ecm_aio *aio, size_t length);
+size_t ecm_aio_read(ecm_aio *aio, const ecc_uint8 **data);
+int ecm_aio_error(ecm_aio *aio);
+int ecm_aio_close(ecm_aio *aio);
+const char *ecm_aio_name(const ecm_aio *aio);
+int ecm_codec_select(const char *spec);
+const char *ecm_codec_name(int method);
+const char *ecm_codec_suffix(void);
+int ecm_codec_detect(const ecc_uint8 *head, size_t n);
+int ecm_output_compress(struct ecm_output *out, int threads);
+void ecm_codec_write(ecm_codec *c, const ecc_uint8 *src, size_t n);
+int ecm_codec_close_output(ecm_codec *c);
+int ecm_input_decompress(struct ecm_input *in, int method, const ecc_uint8 *head, size_t n);
+size_t ecm_codec_read(ecm_codec *c, const ecc_uint8 **data);
+int ecm_codec_finish(ecm_codec *c);
+unsigned long ecm_codec_tell(ecm_codec *c);
+int ecm_codec_error(ecm_codec *c);
+void ecm_codec_close_input(ecm_codec *c);
+int ecm_ecc_computeblock_encode(
+    ecc_uint8 *src,
+    ecc_uint32 major_count,
+    ecc_uint32 minor_count,
+    ecc_uint32 major_mult,
+    ecc_uint32 minor_inc,
+    ecc_uint8 *dest);
+void ecm_ecc_computeblock_decode(
+    ecc_uint8 *src,
+    ecc_uint32 major_count,
+    ecc_uint32 minor_count,
+    ecc_uint32 major_mult,
+    ecc_uint32 minor_inc,
+    ecc_uint8 *dest);
+int ecm_stats_select(const char *format);
+struct ecm_stats *ecm_stats_open(const char *operation, unsigned long long total, int threads);
+unsigned long long ecm_stats_now(const struct ecm_stats *st);
+unsigned long long ecm_stats_tally(
+    const struct ecm_stats *st,
+    unsigned long long *cycles,
+    int stage,
+    unsigned long long since);
+unsigned long long ecm_stats_lap(struct ecm_stats *st, int stage, unsigned long long since);
+void ecm_stats_add(struct ecm_stats *st, unsigned long long *cycles);
+void ecm_stats_classes(struct ecm_stats *st, unsigned classes);
+void ecm_stats_record(struct ecm_stats *st, unsigned kind, unsigned long count);
+void ecm_stats_progress(struct ecm_stats *st, unsigned long long done);
+void ecm_stats_close(struct ecm_stats *st, unsigned long long done, unsigned long long written);
+int ecm_check_type(unsigned char *sector, int canbetype1);
+int ecm_check_type_reference(unsigned char *sector, int canbetype1);
+int ecm_classify_selftest(int verbose);
+void ecm_eccedc_generate_decode(ecc_uint8 *sector, int type);
+unsigned ecm_write_type_count(struct ecm_output *out, unsigned type, unsigned count);
+int ecm_v2_select(const char *sectors);
+void ecm_dedup_select(void);
+const char *ecm_cue_select(const char *cue, char **image);
+const struct ecm_track *ecm_cue_tracks(unsigned *count);
+int ecm_encode_file(FILE *in, FILE *out, int verbose, int threads);
+int ecm_read_type_count(struct ecm_input *in, unsigned *type, unsigned *num);
+int ecm_read_record_header(struct ecm_input *in, unsigned *kind, unsigned *num);
+unsigned ecm_record_payload(unsigned kind);
+unsigned ecm_record_prefix(unsigned kind);
+unsigned ecm_record_output(unsigned kind);
+void ecm_rebuild_record_sector(ecc_uint8 *sector, unsigned kind, const ecc_uint8 *header);
+void ecm_rebuild_sector(ecc_uint8 *sector, int type);
+int ecm_decode_file(FILE *in, FILE *out, int verbose, int threads);
+int batch_run(const struct batch_options *opt, char **names, int count);
 
 #endif /* ECM_H */
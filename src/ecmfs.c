@@ -0,0 +1,405 @@
+/**************************************************************************/
+/*
+** ecmfs - read-only FUSE view of a directory of ECM files.
+** Copyright (C) 2024 Jonathan Birge
+**
+***************************************************************************/
+/*
+** Every foo.ecm under the source directory shows up as foo, decoded on
+** demand; other files are hidden and subdirectories are followed.
+**
+** Reads go through the random-access reader (index.c): an image is indexed
+** the first time it is looked at (or its sidecar index is loaded), and again
+** if the file changes; an open file keeps the index it started with.  A
+** read rebuilds only the sectors it touches, plus a few following ones as
+** read-ahead.  All images share one sector cache bounded by a memory limit.
+**
+** Usage: ecmfs [-o cache=MB,readahead=SECTORS] sourcedir mountpoint
+**
+***************************************************************************/
+
+#define FUSE_USE_VERSION 31
+#define _GNU_SOURCE
+#include <fuse.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "ecm.h"
+
+/* An ECM file that has been indexed; kept until unmount, or until the file
+   changes and the last user of the old index lets go of it */
+struct ecmfs_image
+{
+    char *path;
+    struct timespec mtime;
+    off_t size;
+    ecm_handle *h;
+    unsigned refs;
+    int stale;
+    int opened;
+    struct ecmfs_image *next;
+};
+
+struct ecmfs_options
+{
+    char *source;
+    unsigned long cache;
+    unsigned readahead;
+    int help;
+};
+
+static struct ecmfs_options options = {NULL, 64, 16, 0};
+static ecm_cache *cache;
+static struct ecmfs_image *images;
+static pthread_mutex_t images_lock = PTHREAD_MUTEX_INITIALIZER;
+
+#define KEY_HELP 0
+
+static const struct fuse_opt ecmfs_opts[] = {
+    {"cache=%lu", offsetof(struct ecmfs_options, cache), 0},
+    {"readahead=%u", offsetof(struct ecmfs_options, readahead), 0},
+    FUSE_OPT_KEY("-h", KEY_HELP),
+    FUSE_OPT_KEY("--help", KEY_HELP),
+    FUSE_OPT_END};
+
+/***************************************************************************/
+/*
+** Path of path in the source directory, with suffix appended; returns
+** nonzero if it does not fit
+*/
+static int source_path(char *real, const char *path, const char *suffix)
+{
+    return snprintf(real, PATH_MAX, "%s%s%s", options.source, path, suffix) >= PATH_MAX;
+}
+
+static int image_current(const struct ecmfs_image *image, const struct stat *st)
+{
+    return (image->size == st->st_size) && (image->mtime.tv_sec == st->st_mtim.tv_sec) &&
+           (image->mtime.tv_nsec == st->st_mtim.tv_nsec);
+}
+
+static void image_free(struct ecmfs_image *image)
+{
+    ecm_close(image->h);
+    free(image->path);
+    free(image);
+}
+
+/*
+** Let go of an image from image_get
+*/
+static void image_put(struct ecmfs_image *image)
+{
+    int gone;
+    pthread_mutex_lock(&images_lock);
+    gone = !--image->refs && image->stale;
+    pthread_mutex_unlock(&images_lock);
+    if (gone)
+        image_free(image);
+}
+
+/*
+** The ECM file at real, whose stat is st, indexing it the first time or
+** when it has changed.  Returns NULL if it cannot be read; otherwise the
+** caller lets go of it with image_put.
+*/
+static struct ecmfs_image *image_get(const char *real, const struct stat *st)
+{
+    struct ecmfs_image *image, *fresh, **link, *dead = NULL;
+    ecm_handle *h;
+    pthread_mutex_lock(&images_lock);
+    for (image = images; image; image = image->next)
+        if (!strcmp(image->path, real) && image_current(image, st))
+            break;
+    if (image)
+        image->refs++;
+    pthread_mutex_unlock(&images_lock);
+    if (image)
+        return image;
+    /* Index outside the lock */
+    h = ecm_open(real);
+    if (!h)
+        return NULL;
+    fresh = malloc(sizeof(*fresh));
+    if (!fresh || !(fresh->path = strdup(real)) ||
+        ecm_set_cache(h, cache, options.readahead))
+    {
+        if (fresh)
+            free(fresh->path);
+        free(fresh);
+        ecm_close(h);
+        return NULL;
+    }
+    fresh->mtime = st->st_mtim;
+    fresh->size = st->st_size;
+    fresh->h = h;
+    fresh->refs = 1;
+    fresh->stale = 0;
+    fresh->opened = 0;
+    /* Another thread may have indexed it meanwhile, and an index of the
+       file as it was before goes once nothing uses it */
+    pthread_mutex_lock(&images_lock);
+    image = NULL;
+    link = &images;
+    while (*link)
+    {
+        struct ecmfs_image *entry = *link;
+        if (strcmp(entry->path, real))
+            link = &entry->next;
+        else if (image_current(entry, st))
+        {
+            image = entry;
+            image->refs++;
+            link = &entry->next;
+        }
+        else
+        {
+            *link = entry->next;
+            entry->stale = 1;
+            if (!entry->refs)
+            {
+                entry->next = dead;
+                dead = entry;
+            }
+        }
+    }
+    if (!image)
+    {
+        fresh->next = images;
+        images = fresh;
+    }
+    pthread_mutex_unlock(&images_lock);
+    while (dead)
+    {
+        struct ecmfs_image *next = dead->next;
+        image_free(dead);
+        dead = next;
+    }
+    if (image)
+    {
+        image_free(fresh);
+        return image;
+    }
+    return fresh;
+}
+
+/*
+** Look up path: a directory of the source, or an image backed by path.ecm
+*/
+static int lookup(const char *path, struct stat *st, struct ecmfs_image **image)
+{
+    char real[PATH_MAX];
+    *image = NULL;
+    if (source_path(real, path, ""))
+        return -ENAMETOOLONG;
+    if (!stat(real, st) && S_ISDIR(st->st_mode))
+        return 0;
+    if (source_path(real, path, ".ecm"))
+        return -ENAMETOOLONG;
+    if (stat(real, st) || !S_ISREG(st->st_mode))
+        return -ENOENT;
+    *image = image_get(real, st);
+    return *image ? 0 : -EIO;
+}
+
+/***************************************************************************/
+
+static int ecmfs_getattr(const char *path, struct stat *st, struct fuse_file_info *fi)
+{
+    struct ecmfs_image *image;
+    int error = lookup(path, st, &image);
+    (void)fi;
+    if (error)
+        return error;
+    st->st_mode &= ~0222;
+    if (image)
+    {
+        st->st_size = ecm_size(image->h);
+        st->st_blocks = (st->st_size + 511) / 512;
+        st->st_nlink = 1;
+        image_put(image);
+    }
+    return 0;
+}
+
+static int ecmfs_readdir(
+    const char *path,
+    void *buf,
+    fuse_fill_dir_t filler,
+    off_t offset,
+    struct fuse_file_info *fi,
+    enum fuse_readdir_flags flags)
+{
+    char real[PATH_MAX];
+    char name[NAME_MAX + 1];
+    struct dirent *de;
+    struct stat st;
+    DIR *dir;
+    (void)offset;
+    (void)fi;
+    (void)flags;
+    if (source_path(real, path, ""))
+        return -ENAMETOOLONG;
+    dir = opendir(real);
+    if (!dir)
+        return -errno;
+    filler(buf, ".", NULL, 0, 0);
+    filler(buf, "..", NULL, 0, 0);
+    while ((de = readdir(dir)))
+    {
+        size_t n = strlen(de->d_name);
+        int isdir = de->d_type == DT_DIR;
+        if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+            continue;
+        if (de->d_type == DT_UNKNOWN)
+            isdir = !fstatat(dirfd(dir), de->d_name, &st, 0) && S_ISDIR(st.st_mode);
+        if (isdir)
+            filler(buf, de->d_name, NULL, 0, 0);
+        else if ((n > 4) && !strcmp(de->d_name + n - 4, ".ecm"))
+        {
+            memcpy(name, de->d_name, n - 4);
+            name[n - 4] = 0;
+            filler(buf, name, NULL, 0, 0);
+        }
+    }
+    closedir(dir);
+    return 0;
+}
+
+static int ecmfs_open(const char *path, struct fuse_file_info *fi)
+{
+    struct stat st;
+    struct ecmfs_image *image;
+    int error;
+    if ((fi->flags & O_ACCMODE) != O_RDONLY)
+        return -EROFS;
+    error = lookup(path, &st, &image);
+    if (error)
+        return error;
+    if (!image)
+        return -EISDIR;
+    /* Held until release, so the index outlives a change to the file */
+    fi->fh = (uint64_t)(uintptr_t)image;
+    /* The page cache can stay, unless it is from before the file changed */
+    pthread_mutex_lock(&images_lock);
+    fi->keep_cache = image->opened;
+    image->opened = 1;
+    pthread_mutex_unlock(&images_lock);
+    return 0;
+}
+
+static int ecmfs_read(
+    const char *path,
+    char *buf,
+    size_t size,
+    off_t offset,
+    struct fuse_file_info *fi)
+{
+    struct ecmfs_image *image = (struct ecmfs_image *)(uintptr_t)fi->fh;
+    long got;
+    (void)path;
+    if (offset < 0)
+        return -EINVAL;
+    got = ecm_pread(image->h, buf, size, offset);
+    return (got < 0) ? -EIO : got;
+}
+
+static int ecmfs_release(const char *path, struct fuse_file_info *fi)
+{
+    (void)path;
+    image_put((struct ecmfs_image *)(uintptr_t)fi->fh);
+    return 0;
+}
+
+static void ecmfs_destroy(void *private_data)
+{
+    (void)private_data;
+    while (images)
+    {
+        struct ecmfs_image *next = images->next;
+        image_free(images);
+        images = next;
+    }
+    ecm_cache_destroy(cache);
+    cache = NULL;
+}
+
+static const struct fuse_operations ecmfs_ops = {
+    .getattr = ecmfs_getattr,
+    .readdir = ecmfs_readdir,
+    .open = ecmfs_open,
+    .read = ecmfs_read,
+    .release = ecmfs_release,
+    .destroy = ecmfs_destroy,
+};
+
+/***************************************************************************/
+
+static void ecmfs_usage(const char *prog_name)
+{
+    fprintf(stderr,
+            "Usage: %s [options] sourcedir mountpoint\n"
+            "\n"
+            "Shows each .ecm file in sourcedir as the image it decodes to.\n"
+            "\n"
+            "    -o cache=MB            decoded sector cache shared by all images (64)\n"
+            "    -o readahead=SECTORS   sectors rebuilt ahead of each read (16)\n"
+            "\n",
+            prog_name);
+}
+
+static int ecmfs_opt(void *data, const char *arg, int key, struct fuse_args *outargs)
+{
+    (void)data;
+    if ((key == FUSE_OPT_KEY_NONOPT) && !options.source)
+    {
+        options.source = realpath(arg, NULL);
+        if (!options.source)
+        {
+            perror(arg);
+            return -1;
+        }
+        return 0;
+    }
+    if (key == KEY_HELP)
+    {
+        /* Keep the option so that fuse_main lists its own as well */
+        ecmfs_usage(outargs->argv[0]);
+        options.help = 1;
+    }
+    return 1;
+}
+
+int main(int argc, char *argv[])
+{
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    int status;
+    if (fuse_opt_parse(&args, &options, ecmfs_opts, ecmfs_opt))
+        return 1;
+    if (!options.source && !options.help)
+    {
+        ecmfs_usage(argv[0]);
+        fuse_opt_free_args(&args);
+        return 1;
+    }
+    ecm_eccedc_init();
+    cache = ecm_cache_create((size_t)options.cache << 20);
+    if (!cache)
+    {
+        fprintf(stderr, "%s: cannot allocate a %lu MB cache\n", argv[0], options.cache);
+        fuse_opt_free_args(&args);
+        return 1;
+    }
+    status = fuse_main(args.argc, args.argv, &ecmfs_ops, NULL);
+    fuse_opt_free_args(&args);
+    return status;
+}
@@ -18,13 +18,16 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <pthread.h>
 #include "ecm.h"
 
 /***************************************************************************/
 /*
 ** Compute ECC for a block (can do either P or Q)
 */
-int ecc_computeblock_encode(
+int ecm_ecc_computeblock_encode(
     ecc_uint8 *src,
     ecc_uint32 major_count,
     ecc_uint32 minor_count,
@@ -32,65 +35,34 @@ int ecc_computeblock_encode(
     ecc_uint32 minor_inc,
     ecc_uint8 *dest)
 {
-    ecc_uint32 size = major_count * minor_count;
-    ecc_uint32 major, minor;
-    for (major = 0; major < major_count; major++)
-    {
-        ecc_uint32 index = (major >> 1) * major_mult + (major & 1);
-        ecc_uint8 ecc_a = 0;
-        ecc_uint8 ecc_b = 0;
-        for (minor = 0; minor < minor_count; minor++)
-        {
-            ecc_uint8 temp = src[index];
-            index += minor_inc;
-            if (index >= size)
-                index -= size;
-            ecc_a ^= temp;
-            ecc_b ^= temp;
-            ecc_a = ecc_f_lut[ecc_a];
-        }
-        ecc_a = ecc_b_lut[ecc_f_lut[ecc_a] ^ ecc_b];
-        
-        if (dest[major] != (ecc_a))
-            return 0;
-        if (dest[major + major_count] != (ecc_a ^ ecc_b))
-            return 0;
-    }
-    return 1;
+    ecc_uint8 ecc[2 * 86];
+    ecm_ecc_computeblock(src, major_count, minor_count, major_mult, minor_inc, ecc);
+    return !memcmp(ecc, dest, 2 * major_count);
 }
 
 /*
 ** Generate ECC P and Q codes for a block
+**
+** With zeroaddress the check runs on a copy with the address zeroed, so the
+** sector itself is never written and may be shared between threads.
 */
-int ecc_generate_encode(
+int ecm_ecc_generate_encode(
     ecc_uint8 *sector,
     int zeroaddress,
     ecc_uint8 *dest)
 {
-    int r;
-    ecc_uint8 address[4], i;
-    /* Save the address and zero it out */
+    ecc_uint8 zeroed[0x8C8];
     if (zeroaddress)
-        for (i = 0; i < 4; i++)
-        {
-            address[i] = sector[12 + i];
-            sector[12 + i] = 0;
-        }
-    /* Compute ECC P code */
-    if (!(ecc_computeblock_encode(sector + 0xC, 86, 24, 2, 86, dest + 0x81C - 0x81C)))
     {
-        if (zeroaddress)
-            for (i = 0; i < 4; i++)
-                sector[12 + i] = address[i];
-        return 0;
+        memset(zeroed + 0xC, 0, 4);
+        memcpy(zeroed + 0x10, sector + 0x10, 0x8C8 - 0x10);
+        sector = zeroed;
     }
+    /* Compute ECC P code */
+    if (!(ecm_ecc_computeblock_encode(sector + 0xC, 86, 24, 2, 86, dest + 0x81C - 0x81C)))
+        return 0;
     /* Compute ECC Q code */
-    r = ecc_computeblock_encode(sector + 0xC, 52, 43, 86, 88, dest + 0x8C8 - 0x81C);
-    /* Restore the address */
-    if (zeroaddress)
-        for (i = 0; i < 4; i++)
-            sector[12 + i] = address[i];
-    return r;
+    return ecm_ecc_computeblock_encode(sector + 0xC, 52, 43, 86, 88, dest + 0x8C8 - 0x81C);
 }
 
 /***************************************************************************/
@@ -103,7 +75,11 @@ int ecc_generate_encode(
 ** 03 - 2336 mode 2 form 2  predict redundant flags, edc
 */
 
-int check_type(unsigned char *sector, int canbetype1)
+/*
+** Reference classifier: the original single pass that carries every
+** candidate type through EDC and ECC.  Kept for the self-check.
+*/
+int ecm_check_type_reference(unsigned char *sector, int canbetype1)
 {
     int canbetype2 = 1;
     int canbetype3 = 1;
@@ -151,7 +127,7 @@ int check_type(unsigned char *sector, int canbetype1)
     }
 
     /* Check EDC */
-    myedc = edc_partial_computeblock(0, sector, 0x808);
+    myedc = ecm_edc_partial_computeblock(0, sector, 0x808);
     if (canbetype2)
         if (
             (sector[0x808] != ((myedc >> 0) & 0xFF)) ||
@@ -161,7 +137,7 @@ int check_type(unsigned char *sector, int canbetype1)
         {
             canbetype2 = 0;
         }
-    myedc = edc_partial_computeblock(myedc, sector + 0x808, 8);
+    myedc = ecm_edc_partial_computeblock(myedc, sector + 0x808, 8);
     if (canbetype1)
         if (
             (sector[0x810] != ((myedc >> 0) & 0xFF)) ||
@@ -171,7 +147,7 @@ int check_type(unsigned char *sector, int canbetype1)
         {
             canbetype1 = 0;
         }
-    myedc = edc_partial_computeblock(myedc, sector + 0x810, 0x10C);
+    myedc = ecm_edc_partial_computeblock(myedc, sector + 0x810, 0x10C);
     if (canbetype3)
         if (
             (sector[0x91C] != ((myedc >> 0) & 0xFF)) ||
@@ -184,14 +160,14 @@ int check_type(unsigned char *sector, int canbetype1)
     /* Check ECC */
     if (canbetype1)
     {
-        if (!(ecc_generate_encode(sector, 0, sector + 0x81C)))
+        if (!(ecm_ecc_generate_encode(sector, 0, sector + 0x81C)))
         {
             canbetype1 = 0;
         }
     }
     if (canbetype2)
     {
-        if (!(ecc_generate_encode(sector - 0x10, 1, sector + 0x80C)))
+        if (!(ecm_ecc_generate_encode(sector - 0x10, 1, sector + 0x80C)))
         {
             canbetype2 = 0;
         }
@@ -207,270 +183,1793 @@ int check_type(unsigned char *sector, int canbetype1)
 
 /***************************************************************************/
 /*
-** Encode a type/count combo
+** Staged classifier
+**
+** The checks run cheapest first and stop as soon as no type is left:
+**
+**   1. header: a Mode 1 sync and a Mode 2 subheader copy exclude each other
+**      (byte 0 is 00 in one and must equal byte 4, FF, in the other), so
+**      this alone picks Mode 1 or Mode 2
+**   2. Mode 1 mode byte and reserved bytes
+**   3. spot check of one P and one Q major against the stored parity
+**   4. EDC, only as far as the remaining types need
+**   5. full ECC
+**
+** The spot check filters out near misses before the EDC, so it is skipped
+** when the type predicted from the previous sector is being checked.  The
+** result is always the same as ecm_check_type_reference.
+*/
+#define STAGE_HEADER 0
+#define STAGE_FIELDS 1
+#define STAGE_ECC_SPOT 2
+#define STAGE_EDC 3
+#define STAGE_ECC 4
+#define STAGE_COUNT 5
+
+struct classify_stats
+{
+    unsigned long checks;
+    unsigned long predicted;
+    unsigned long rejects[STAGE_COUNT];
+    unsigned long scanned;
+    unsigned long repeated;
+    unsigned long cued;
+    unsigned long holes;
+    /* --stats timing, handed over by classifier_flush */
+    struct ecm_stats *timing;
+    unsigned long long cycles[STAT_COUNT];
+};
+
+/*
+** ECC of major 0 of a P or Q block, compared with the stored parity.  With
+** zeroaddress the first four bytes of src are taken as zero without being
+** read.
+*/
+static int ecc_major_check(
+    const ecc_uint8 *src,
+    int zeroaddress,
+    ecc_uint32 major_count,
+    ecc_uint32 minor_count,
+    ecc_uint32 minor_inc,
+    const ecc_uint8 *parity)
+{
+    ecc_uint32 size = major_count * minor_count;
+    ecc_uint32 index = 0;
+    ecc_uint32 minor;
+    ecc_uint8 ecc_a = 0;
+    ecc_uint8 ecc_b = 0;
+    for (minor = 0; minor < minor_count; minor++)
+    {
+        ecc_uint8 temp = (zeroaddress && index < 4) ? 0 : src[index];
+        index += minor_inc;
+        if (index >= size)
+            index -= size;
+        ecc_a ^= temp;
+        ecc_b ^= temp;
+        ecc_a = ecm_ecc_f_lut[ecc_a];
+    }
+    ecc_a = ecm_ecc_b_lut[ecm_ecc_f_lut[ecc_a] ^ ecc_b];
+    return (parity[0] == ecc_a) && (parity[major_count] == (ecc_a ^ ecc_b));
+}
+
+static int ecc_spot_check(const ecc_uint8 *src, int zeroaddress, const ecc_uint8 *parity)
+{
+    return ecc_major_check(src, zeroaddress, 86, 24, 86, parity) &&
+           ecc_major_check(src, zeroaddress, 52, 43, 88, parity + 0xAC);
+}
+
+static int edc_matches(ecc_uint32 edc, const ecc_uint8 *stored)
+{
+    return (stored[0] == ((edc >> 0) & 0xFF)) &&
+           (stored[1] == ((edc >> 8) & 0xFF)) &&
+           (stored[2] == ((edc >> 16) & 0xFF)) &&
+           (stored[3] == ((edc >> 24) & 0xFF));
+}
+
+static int classify_accept(struct classify_stats *stats, int type, int predicted)
+{
+    if (type == predicted)
+        stats->predicted++;
+    return type;
+}
+
+static int classify_sector(
+    unsigned char *sector,
+    int canbetype1,
+    int predicted,
+    struct classify_stats *stats)
+{
+    ecc_uint32 edc;
+    unsigned long long t;
+    int ok;
+    stats->checks++;
+    /* Stage 1: header */
+    if (canbetype1 &&
+        (sector[0x00] == 0x00) &&
+        (sector[0x01] == 0xFF) &&
+        (sector[0x02] == 0xFF) &&
+        (sector[0x03] == 0xFF) &&
+        (sector[0x04] == 0xFF) &&
+        (sector[0x05] == 0xFF) &&
+        (sector[0x06] == 0xFF) &&
+        (sector[0x07] == 0xFF) &&
+        (sector[0x08] == 0xFF) &&
+        (sector[0x09] == 0xFF) &&
+        (sector[0x0A] == 0xFF) &&
+        (sector[0x0B] == 0x00))
+    {
+        /* Stage 2: mode and reserved bytes */
+        if (
+            (sector[0x0F] != 0x01) ||
+            (sector[0x814] != 0x00) ||
+            (sector[0x815] != 0x00) ||
+            (sector[0x816] != 0x00) ||
+            (sector[0x817] != 0x00) ||
+            (sector[0x818] != 0x00) ||
+            (sector[0x819] != 0x00) ||
+            (sector[0x81A] != 0x00) ||
+            (sector[0x81B] != 0x00))
+        {
+            stats->rejects[STAGE_FIELDS]++;
+            return 0;
+        }
+        /* Stage 3: ECC spot check */
+        if ((predicted != 1) && !ecc_spot_check(sector + 0xC, 0, sector + 0x81C))
+        {
+            stats->rejects[STAGE_ECC_SPOT]++;
+            return 0;
+        }
+        /* Stage 4: EDC */
+        t = ecm_stats_now(stats->timing);
+        edc = ecm_edc_partial_computeblock(0, sector, 0x810);
+        t = ecm_stats_tally(stats->timing, stats->cycles, STAT_EDC, t);
+        if (!edc_matches(edc, sector + 0x810))
+        {
+            stats->rejects[STAGE_EDC]++;
+            return 0;
+        }
+        /* Stage 5: ECC */
+        ok = ecm_ecc_generate_encode(sector, 0, sector + 0x81C);
+        ecm_stats_tally(stats->timing, stats->cycles, STAT_ECC, t);
+        if (!ok)
+        {
+            stats->rejects[STAGE_ECC]++;
+            return 0;
+        }
+        return classify_accept(stats, 1, predicted);
+    }
+    if (
+        (sector[0x0] != sector[0x4]) ||
+        (sector[0x1] != sector[0x5]) ||
+        (sector[0x2] != sector[0x6]) ||
+        (sector[0x3] != sector[0x7]))
+    {
+        stats->rejects[STAGE_HEADER]++;
+        return 0;
+    }
+    /*
+    ** Mode 2: form 1 wins over form 2, and the form 1 EDC is on the way to
+    ** the form 2 one, so it is always checked first.  Only the final form 2
+    ** rejection is counted.
+    */
+    t = ecm_stats_now(stats->timing);
+    edc = ecm_edc_partial_computeblock(0, sector, 0x808);
+    ecm_stats_tally(stats->timing, stats->cycles, STAT_EDC, t);
+    if (edc_matches(edc, sector + 0x808) &&
+        ((predicted == 2) || ecc_spot_check(sector - 0x4, 1, sector + 0x80C)))
+    {
+        t = ecm_stats_now(stats->timing);
+        ok = ecm_ecc_generate_encode(sector - 0x10, 1, sector + 0x80C);
+        ecm_stats_tally(stats->timing, stats->cycles, STAT_ECC, t);
+        if (ok)
+            return classify_accept(stats, 2, predicted);
+    }
+    t = ecm_stats_now(stats->timing);
+    edc = ecm_edc_partial_computeblock(edc, sector + 0x808, 0x114);
+    ecm_stats_tally(stats->timing, stats->cycles, STAT_EDC, t);
+    if (!edc_matches(edc, sector + 0x91C))
+    {
+        stats->rejects[STAGE_EDC]++;
+        return 0;
+    }
+    return classify_accept(stats, 3, predicted);
+}
+
+/*
+** Classify a sector with no type prediction
+*/
+int ecm_check_type(unsigned char *sector, int canbetype1)
+{
+    struct classify_stats stats;
+    memset(&stats, 0, sizeof(stats));
+    return classify_sector(sector, canbetype1, 0, &stats);
+}
+
+/*
+** Check the staged classifier against the reference on random data, fill
+** patterns and valid sectors of each type, intact and with one byte
+** corrupted, under every type prediction.  Returns 0 if they all agree.
+*/
+int ecm_classify_selftest(int verbose)
+{
+    static ecc_uint8 raw[2352 + 0x10];
+    struct classify_stats stats;
+    ecc_uint32 seed = 0x6C078965;
+    ecc_uint32 round, i;
+    ecc_uint8 *sector;
+    int predicted, canbetype1, kind, errors = 0;
+    memset(&stats, 0, sizeof(stats));
+    for (round = 0; round < 1200; round++)
+    {
+        for (i = 0; i < sizeof(raw); i++)
+        {
+            seed = seed * 1103515245 + 12345;
+            raw[i] = seed >> 16;
+        }
+        kind = round % 6;
+        switch (kind)
+        {
+        case 1:
+            memset(raw, 0x00, sizeof(raw));
+            break;
+        case 2:
+            memset(raw, 0xFF, sizeof(raw));
+            break;
+        case 3: /* Mode 1 */
+        case 4: /* Mode 2 form 1 */
+        case 5: /* Mode 2 form 2 */
+            raw[0x00] = 0x00;
+            memset(raw + 0x01, 0xFF, 10);
+            raw[0x0B] = 0x00;
+            raw[0x0F] = (kind == 3) ? 1 : 2;
+            memcpy(raw + 0x14, raw + 0x10, 4);
+            ecm_eccedc_generate_decode(raw, kind - 2);
+            break;
+        }
+        sector = (kind >= 4) ? raw + 0x10 : raw;
+        /* Corrupt one byte in half of the rounds */
+        if ((round / 6) & 1)
+        {
+            seed = seed * 1103515245 + 12345;
+            sector[(seed >> 8) % 2336] ^= 1 << (round % 8);
+        }
+        for (canbetype1 = 0; canbetype1 < 2; canbetype1++)
+        {
+            int ref = ecm_check_type_reference(sector, canbetype1);
+            for (predicted = 0; predicted < 4; predicted++)
+            {
+                int got = classify_sector(sector, canbetype1, predicted, &stats);
+                if (got != ref)
+                {
+                    if (verbose && errors < 8)
+                        fprintf(stderr,
+                                "Classifier mismatch: round %u prediction %d (%d, should be %d)\n",
+                                round, predicted, got, ref);
+                    errors++;
+                }
+            }
+        }
+    }
+    if (verbose)
+        fprintf(stderr, "Classifier   %s\n", errors ? "FAILED" : "ok");
+    return errors != 0;
+}
+
+/***************************************************************************/
+/*
+** Encode a type/count combo; returns the number of bytes written
 */
-void write_type_count(
-    FILE *out,
+unsigned ecm_write_type_count(
+    struct ecm_output *out,
     unsigned type,
     unsigned count)
 {
+    unsigned n = 1;
+    /* Extended kinds carry their flags above the largest v1 count */
+    if (type > 3)
+    {
+        count += RECORD_EXTENDED + (type >> 2) * RECORD_EXTENDED_MAX;
+        type &= 3;
+    }
     count--;
-    fputc(((count >= 32) << 7) | ((count & 31) << 2) | type, out);
+    ecm_output_putc(out, ((count >= 32) << 7) | ((count & 31) << 2) | type);
     count >>= 5;
     while (count)
     {
-        fputc(((count >= 128) << 7) | (count & 127), out);
+        ecm_output_putc(out, ((count >= 128) << 7) | (count & 127));
         count >>= 7;
+        n++;
     }
+    return n;
 }
 
 /***************************************************************************/
+/*
+** Encoder state
+**
+** Everything one encode needs is kept in a struct encoder, so ecm_encode_file
+** and any number of streams (ecm_encode) can run at the same time.  The
+** buffers are allocated when an encoder is set up and reused to the end.
+*/
+#define RING_SIZE 1048576
+#define RING_MIRROR 2352
+#define RING_KEEP 16
+
+/* Run buffer size for ecm_encode_file, and the smaller one used by streams */
+#define RUN_SIZE (8 * 1048576)
+#define STREAM_RUN_SIZE 262144
+
+struct encoder;
+
+/*
+** Classifier state carried along one path through the input
+**
+** Besides the type prediction, this remembers the last stretch found to
+** repeat with period four.  Where the input repeats like that, the sector
+** at an offset is the same as the one four bytes earlier, so inside a
+** literal stretch (padding, fill patterns, blank media) whole spans can be
+** passed over without classifying them or even scanning for candidates.
+*/
+struct classifier
+{
+    const struct encoder *e;
+    int predicted;
+    unsigned long repeat_from;
+    unsigned long repeat_end;
+    unsigned long repeat_cap;
+    struct classify_stats stats;
+};
+
+/*
+** Current run
+**
+** The encoded payload of the run being built is held until the type changes,
+** since the record header (which carries the count) has to come first.  A
+** run that outgrows the buffer is written out as a record and continued as
+** another record of the same type, which decodes identically; this keeps
+** memory bounded without re-reading input.  Literals from a mapped file are
+** not copied; the run just remembers where they start.
+*/
+struct encode_run
+{
+    struct ecm_output *out;
+    unsigned long outbytes;
+    int type;
+    unsigned count;
+    size_t length;
+    size_t size;
+    unsigned long literal_from;
+    unsigned long typetally[4];
+    unsigned long zerotally;
+    unsigned long formlesstally;
+    unsigned long copytally;
+    ecc_uint8 next_header[4];
+    unsigned long copy_next;
+    unsigned long copy_back;
+    unsigned char *data;
+};
+
+struct encoder
+{
+    unsigned char *ring;
+    const unsigned char *mapped;
+    size_t mapped_size;
+    signed char *classified;
+    ecm_pool *pool;
+    struct encode_run run;
+    struct classifier cls;
+    struct classify_stats worker_stats;
+    struct ecm_stats *stats;
+    unsigned long pos;
+    unsigned long head;
+    unsigned long literal_start;
+    unsigned long streak;
+    unsigned long classified_limit;
+    int ineof;
+    unsigned inedc;
+    int verbose;
+    unsigned long counter_analyze;
+    unsigned long counter_encode;
+    unsigned long counter_total;
+    /* Streams, and the records of a v2 block */
+    struct ecm_output sink;
+    int finished;
+    /* v2 container only */
+    struct ecm_output *container;
+    struct ecm_output table;
+    unsigned long block_bytes;
+    unsigned long block_start;
+    unsigned nblocks;
+    /* Extended record kinds, in the v2 container */
+    int extended;
+    struct dedup *dedup;
+    unsigned long copy_seq;
+    unsigned long copy_back;
+    /* Track layout from a cue sheet, if any */
+    const struct ecm_track *tracks;
+    unsigned ntracks;
+    unsigned track;
+    /* Holes in a sparse input: the next one, found lazily */
+    struct ecm_input *holes;
+    unsigned long hole_start;
+    unsigned long hole_end;
+};
+
+/* Sectors per block of the v2 container, or 0 for v1 */
+static unsigned long v2_sectors;
+
+/* Copy records for repeated sectors, in the v2 container */
+static int dedup_selected;
 
-unsigned long mycounter_analyze;
-unsigned long mycounter_encode;
-unsigned long mycounter_total;
+/***************************************************************************/
 
-void resetcounter(unsigned long total)
+static void resetcounter(struct encoder *e, unsigned long total)
 {
-    mycounter_analyze = 0;
-    mycounter_encode = 0;
-    mycounter_total = total;
+    e->counter_analyze = 0;
+    e->counter_encode = 0;
+    e->counter_total = total;
 }
 
-void setcounter_analyze(unsigned long n, int verbose)
+static void setcounter_analyze(struct encoder *e, unsigned long n)
 {
-    if ((n >> 20) != (mycounter_analyze >> 20))
+    if ((n >> 20) != (e->counter_analyze >> 20))
     {
         unsigned long a = (n + 64) / 128;
-        unsigned long e = (mycounter_encode + 64) / 128;
-        unsigned long d = (mycounter_total + 64) / 128;
+        unsigned long c = (e->counter_encode + 64) / 128;
+        unsigned long d = (e->counter_total + 64) / 128;
         if (!d)
             d = 1;
-        if (verbose)
+        if (e->verbose && !e->counter_total)
+            fprintf(stderr, "Analyzing (%luMB) Encoding (%luMB)\r",
+                    n >> 20, e->counter_encode >> 20);
+        else if (e->verbose)
             fprintf(stderr, "Analyzing (%02lu%%) Encoding (%02lu%%)\r",
-                    (100 * a) / d, (100 * e) / d);
+                    (100 * a) / d, (100 * c) / d);
     }
-    mycounter_analyze = n;
+    e->counter_analyze = n;
 }
 
-void setcounter_encode(unsigned long n, int verbose)
+static void setcounter_encode(struct encoder *e, unsigned long n)
 {
-    if ((n >> 20) != (mycounter_encode >> 20))
+    if ((n >> 20) != (e->counter_encode >> 20))
     {
-        unsigned long a = (mycounter_analyze + 64) / 128;
-        unsigned long e = (n + 64) / 128;
-        unsigned long d = (mycounter_total + 64) / 128;
+        unsigned long a = (e->counter_analyze + 64) / 128;
+        unsigned long c = (n + 64) / 128;
+        unsigned long d = (e->counter_total + 64) / 128;
         if (!d)
             d = 1;
-        if (verbose)
+        if (e->verbose && !e->counter_total)
+            fprintf(stderr, "Analyzing (%luMB) Encoding (%luMB)\r",
+                    e->counter_analyze >> 20, n >> 20);
+        else if (e->verbose)
             fprintf(stderr, "Analyzing (%02lu%%) Encoding (%02lu%%)\r",
-                    (100 * a) / d, (100 * e) / d);
+                    (100 * a) / d, (100 * c) / d);
     }
-    mycounter_encode = n;
+    e->counter_encode = n;
 }
 
 /***************************************************************************/
 /*
-** Encode a run of sectors/literals of the same type
+** Input ring
+**
+** Input is read exactly once into a ring buffer.  The first 2352 bytes of
+** the ring are mirrored past its end, so the sector at any offset can be
+** examined in place without unwrapping.  Offsets are absolute stream
+** positions; ring_at() maps them into the buffer.  A refill keeps the few
+** bytes before the current offset, which the repeat check looks back at.
+**
+** When the input is a mapped file the ring is bypassed: ring_at() points
+** into the mapping and a refill only moves the end of the visible input
+** forward, so the rest of the encoder works the same way on both.
 */
-unsigned in_flush(
-    unsigned edc,
-    unsigned type,
-    unsigned count,
-    FILE *in,
-    FILE *out,
-    int verbose)
-{
-    size_t read_result;
-    unsigned char buf[2352];
-    write_type_count(out, type, count);
-    if (!type)
-    {
-        while (count)
-        {
-            unsigned b = count;
-            if (b > 2352)
-                b = 2352;
-            read_result = fread(buf, 1, b, in);
-            if (read_result != b)
-            {
-                fprintf(stderr, "Unexpected EOF\n");
-                exit(1);
-            }
-            edc = edc_partial_computeblock(edc, buf, b);
-            fwrite(buf, 1, b, out);
-            count -= b;
-            setcounter_encode(ftell(in), verbose);
-        }
-        return edc;
-    }
-    while (count--)
+static unsigned char *ring_at(const struct encoder *e, unsigned long pos)
+{
+    if (e->mapped)
+        return (unsigned char *)e->mapped + pos;
+    return e->ring + (pos % RING_SIZE);
+}
+
+/*
+** Number of bytes that can be read contiguously from ring_at(pos)
+*/
+static size_t ring_span(const struct encoder *e, unsigned long pos)
+{
+    if (e->mapped)
+        return e->mapped_size - pos;
+    return RING_SIZE + RING_MIRROR - (pos % RING_SIZE);
+}
+
+/*
+** Keep the mirror in step after n bytes were stored at ring offset at
+*/
+static void ring_mirror(struct encoder *e, size_t at, size_t n)
+{
+    if (at < RING_MIRROR)
+        memcpy(e->ring + RING_SIZE + at, e->ring + at,
+               (n < RING_MIRROR - at) ? n : RING_MIRROR - at);
+}
+
+/*
+** Read up to n bytes into the ring at the head; returns the number of bytes
+** read (less than n only at end of input)
+*/
+static size_t ring_fill(struct encoder *e, struct ecm_input *in, size_t n)
+{
+    size_t done = 0;
+    if (e->mapped)
+        return (n < e->mapped_size - e->head) ? n : e->mapped_size - e->head;
+    while (done < n)
     {
-        switch (type)
-        {
-        case 1:
-            read_result = fread(buf, 1, 2352, in);
-            if (read_result != 2352)
-            {
-                fprintf(stderr, "Unexpected EOF\n");
-                exit(1);
-            }
-            edc = edc_partial_computeblock(edc, buf, 2352);
-            fwrite(buf + 0x00C, 1, 0x003, out);
-            fwrite(buf + 0x010, 1, 0x800, out);
-            setcounter_encode(ftell(in), verbose);
+        size_t at = (e->head + done) % RING_SIZE;
+        size_t chunk = n - done;
+        size_t got;
+        if (chunk > RING_SIZE - at)
+            chunk = RING_SIZE - at;
+        got = ecm_input_read(in, e->ring + at, chunk);
+        ring_mirror(e, at, got);
+        done += got;
+        if (got != chunk)
             break;
-        case 2:
-            read_result = fread(buf, 1, 2336, in);
-            if (read_result != 2336)
-            {
-                fprintf(stderr, "Unexpected EOF\n");
-                exit(1);
-            }
-            edc = edc_partial_computeblock(edc, buf, 2336);
-            fwrite(buf + 0x004, 1, 0x804, out);
-            setcounter_encode(ftell(in), verbose);
+    }
+    return done;
+}
+
+/*
+** Store n bytes from caller memory into the ring at the head
+*/
+static void ring_put(struct encoder *e, const unsigned char *src, size_t n)
+{
+    size_t done = 0;
+    while (done < n)
+    {
+        size_t at = (e->head + done) % RING_SIZE;
+        size_t chunk = n - done;
+        if (chunk > RING_SIZE - at)
+            chunk = RING_SIZE - at;
+        memcpy(e->ring + at, src + done, chunk);
+        ring_mirror(e, at, chunk);
+        done += chunk;
+    }
+}
+
+/*
+** Copy n bytes starting at stream position pos out of the ring
+*/
+static void ring_copy(
+    const struct encoder *e,
+    unsigned char *dest,
+    unsigned long pos,
+    size_t n)
+{
+    size_t at = pos % RING_SIZE;
+    size_t first = (n < RING_SIZE - at) ? n : RING_SIZE - at;
+    memcpy(dest, e->ring + at, first);
+    memcpy(dest + first, e->ring, n - first);
+}
+
+/*
+** First offset in [pos, limit) at which ecm_check_type could find a sector, or
+** limit if there is none.  The bytes up to limit + 11 must be in the ring.
+*/
+static unsigned long ring_scan(
+    const struct encoder *e,
+    unsigned long pos,
+    unsigned long limit)
+{
+    while (pos < limit)
+    {
+        size_t n = limit - pos;
+        size_t hit;
+        if (n > ring_span(e, pos) - 11)
+            n = ring_span(e, pos) - 11;
+        hit = ecm_sector_scan(ring_at(e, pos), n);
+        pos += hit;
+        if (hit < n)
             break;
-        case 3:
-            read_result = fread(buf, 1, 2336, in);
-            if (read_result != 2336)
-            {
-                fprintf(stderr, "Unexpected EOF\n");
-                exit(1);
-            }
-            edc = edc_partial_computeblock(edc, buf, 2336);
-            fwrite(buf + 0x004, 1, 0x918, out);
-            setcounter_encode(ftell(in), verbose);
+    }
+    return pos;
+}
+
+/*
+** First offset in [pos, limit) whose byte differs from the one four bytes
+** later, or limit.  The bytes up to limit + 3 must be in the ring.
+*/
+static unsigned long ring_repeat(
+    const struct encoder *e,
+    unsigned long pos,
+    unsigned long limit)
+{
+    while (pos < limit)
+    {
+        size_t n = limit - pos;
+        size_t hit;
+        if (n > ring_span(e, pos) - 4)
+            n = ring_span(e, pos) - 4;
+        hit = ecm_repeat_scan(ring_at(e, pos), n);
+        pos += hit;
+        if (hit < n)
             break;
-        }
     }
-    return edc;
+    return pos;
+}
+
+/*
+** End of the range that ring_scan may skip over: past it there is not a
+** full sector of lookahead yet (or, at end of input, nothing can match)
+*/
+static unsigned long scan_limit(unsigned long pos, unsigned long head, int ineof)
+{
+    unsigned long reach = ineof ? 2335 : 2351;
+    return (head - pos > reach) ? head - reach : pos;
 }
 
 /***************************************************************************/
+/*
+** Classifier
+*/
+static void classifier_init(struct classifier *c, const struct encoder *e)
+{
+    memset(c, 0, sizeof(*c));
+    c->e = e;
+    c->stats.timing = e->stats;
+}
+
+static int classifier_check(struct classifier *c, unsigned long pos, int canbetype1)
+{
+    unsigned long long t = ecm_stats_now(c->stats.timing);
+    c->predicted = classify_sector(ring_at(c->e, pos), canbetype1, c->predicted, &c->stats);
+    ecm_stats_tally(c->stats.timing, c->stats.cycles, STAT_CLASSIFY, t);
+    return c->predicted;
+}
 
-unsigned char inputqueue[1048576 + 4];
+/*
+** Hand the classifier's time over to --stats.  The classify time includes
+** the EDC and ECC checks made along the way, which are counted apart.
+*/
+static void classifier_flush(struct classifier *c)
+{
+    unsigned long long *cycles = c->stats.cycles;
+    cycles[STAT_CLASSIFY] -= cycles[STAT_EDC] + cycles[STAT_ECC];
+    ecm_stats_add(c->stats.timing, cycles);
+}
 
-int encode_file(FILE *in, FILE *out, int verbose)
+static void classify_stats_add(struct classify_stats *to, const struct classify_stats *from)
 {
-    unsigned inedc = 0;
-    int curtype = -1;
-    int curtypecount = 0;
-    int curtype_in_start = 0;
-    int detecttype;
-    size_t read_result;
-    int incheckpos = 0;
-    long inbufferpos = 0;
-    long intotallength;
-    int inqueuestart = 0;
-    size_t dataavail = 0;
-    int typetally[4];
-    fseek(in, 0, SEEK_END);
-    intotallength = ftell(in);
-    resetcounter(intotallength);
-    typetally[0] = 0;
-    typetally[1] = 0;
-    typetally[2] = 0;
-    typetally[3] = 0;
-    /* Magic identifier */
-    fputc('E', out);
-    fputc('C', out);
-    fputc('M', out);
-    fputc(0x00, out);
-    for (;;)
+    int i;
+    to->checks += from->checks;
+    to->predicted += from->predicted;
+    for (i = 0; i < STAGE_COUNT; i++)
+        to->rejects[i] += from->rejects[i];
+    to->scanned += from->scanned;
+    to->repeated += from->repeated;
+    to->cued += from->cued;
+    to->holes += from->holes;
+}
+
+/*
+** Skip ahead from pos, where every offset from streak up to pos has been
+** found to be literal.  Returns the next offset that needs classifying.
+*/
+static unsigned long classifier_skip(
+    struct classifier *c,
+    unsigned long pos,
+    unsigned long streak,
+    unsigned long head,
+    int ineof)
+{
+    unsigned long limit = scan_limit(pos, head, 0);
+    unsigned long next;
+    unsigned long long t = ecm_stats_now(c->stats.timing);
+    if ((pos >= streak + 4) && (pos < limit))
     {
-        if ((dataavail < 2352) && (dataavail < (intotallength - inbufferpos)))
-        {
-            long willread = intotallength - inbufferpos;
-            if (willread > ((sizeof(inputqueue) - 4) - dataavail))
-                willread = (sizeof(inputqueue) - 4) - dataavail;
-            if (inqueuestart)
-            {
-                memmove(inputqueue + 4, inputqueue + 4 + inqueuestart, dataavail);
-                inqueuestart = 0;
-            }
-            if (willread)
-            {
-                setcounter_analyze(inbufferpos, verbose);
-                fseek(in, inbufferpos, SEEK_SET);
-                read_result = fread(inputqueue + 4 + dataavail, 1, willread, in);
-                if (read_result != willread)
-                {
-                    fprintf(stderr, "Unexpected EOF\n");
-                    exit(1);
-                }
-                inbufferpos += willread;
-                dataavail += willread;
-            }
-        }
-        if (dataavail <= 0)
-            break;
-        if (dataavail < 2336)
-            detecttype = 0;
-        else
-            detecttype = check_type(inputqueue + 4 + inqueuestart, dataavail >= 2352);
-        if (detecttype != curtype)
+        unsigned long from = pos - 4;
+        if ((from < c->repeat_from) || (from > c->repeat_end))
         {
-            if (curtypecount)
-            {
-                fseek(in, curtype_in_start, SEEK_SET);
-                typetally[curtype] += curtypecount;
-                inedc = in_flush(inedc, curtype, curtypecount, in, out, verbose);
-            }
-            curtype = detecttype;
-            curtype_in_start = incheckpos;
-            curtypecount = 1;
+            c->repeat_from = from;
+            c->repeat_cap = limit + 2347;
+            c->repeat_end = ring_repeat(c->e, from, c->repeat_cap);
         }
-        else
+        else if ((c->repeat_end == c->repeat_cap) && (c->repeat_cap < limit + 2347))
         {
-            curtypecount++;
+            c->repeat_cap = limit + 2347;
+            c->repeat_end = ring_repeat(c->e, c->repeat_end, c->repeat_cap);
         }
-        switch (curtype)
+        /* Every window starting before repeat_end - 2347 repeats */
+        if (c->repeat_end >= pos + 2348)
         {
-        case 0:
-            incheckpos += 1;
-            inqueuestart += 1;
-            dataavail -= 1;
-            break;
-        case 1:
-            incheckpos += 2352;
-            inqueuestart += 2352;
-            dataavail -= 2352;
-            break;
-        case 2:
-            incheckpos += 2336;
-            inqueuestart += 2336;
-            dataavail -= 2336;
-            break;
-        case 3:
-            incheckpos += 2336;
-            inqueuestart += 2336;
-            dataavail -= 2336;
-            break;
+            next = c->repeat_end - 2347;
+            c->stats.repeated += next - pos;
+            pos = next;
         }
     }
-    if (curtypecount)
+    /* Offsets up to the next candidate can only be literals */
+    next = ring_scan(c->e, pos, scan_limit(pos, head, ineof));
+    c->stats.scanned += next - pos;
+    ecm_stats_tally(c->stats.timing, c->stats.cycles, STAT_CLASSIFY, t);
+    return next;
+}
+
+/***************************************************************************/
+/*
+** Run output
+*/
+static void run_flush(struct encoder *e)
+{
+    struct encode_run *run = &e->run;
+    unsigned long long t = ecm_stats_now(e->stats);
+    if (run->count)
     {
-        fseek(in, curtype_in_start, SEEK_SET);
-        typetally[curtype] += curtypecount;
-        inedc = in_flush(inedc, curtype, curtypecount, in, out, verbose);
+        ecm_stats_record(e->stats, run->type, run->count);
+        if (run->type == RECORD_COPY)
+            run->copytally += run->count;
+        else if (run->type && !(run->type & 3))
+            run->formlesstally += run->count;
+        else
+            run->typetally[run->type & 3] += run->count;
+        run->outbytes += ecm_write_type_count(run->out, run->type, run->count);
+        if (e->mapped && run->type == 0)
+            ecm_output_write(run->out, e->mapped + run->literal_from, run->length);
+        else
+            ecm_output_write(run->out, run->data, run->length);
+        run->outbytes += run->length;
+        ecm_stats_lap(e->stats, STAT_WRITE, t);
     }
-    /* End-of-records indicator */
-    write_type_count(out, 0, 0);
-    /* Input file EDC */
-    fputc((inedc >> 0) & 0xFF, out);
-    fputc((inedc >> 8) & 0xFF, out);
-    fputc((inedc >> 16) & 0xFF, out);
-    fputc((inedc >> 24) & 0xFF, out);
-    /* Show report */
-    if (verbose)
+    run->count = 0;
+    run->length = 0;
+}
+
+/*
+** Append literal bytes from the ring to the run
+*/
+static unsigned run_literal(struct encoder *e, unsigned edc, unsigned long pos, size_t n)
+{
+    struct encode_run *run = &e->run;
+    while (n)
     {
-        fprintf(stderr, "Literal bytes........... %10d\n", typetally[0]);
-        fprintf(stderr, "Mode 1 sectors.......... %10d\n", typetally[1]);
-        fprintf(stderr, "Mode 2 form 1 sectors... %10d\n", typetally[2]);
-        fprintf(stderr, "Mode 2 form 2 sectors... %10d\n", typetally[3]);
-        fprintf(stderr, "Encoded %ld bytes -> %ld bytes\n", intotallength, ftell(out));
-        fprintf(stderr, "Done\n");
-    }
+        size_t chunk = run->size - run->length;
+        if (!chunk)
+        {
+            run_flush(e);
+            chunk = run->size;
+        }
+        if (chunk > n)
+            chunk = n;
+        if (e->mapped)
+        {
+            unsigned long long t = ecm_stats_now(e->stats);
+            if (!run->length)
+                run->literal_from = pos;
+            edc = ecm_edc_partial_computeblock_long(edc, e->mapped + pos, chunk);
+            ecm_stats_lap(e->stats, STAT_EDC, t);
+        }
+        else
+        {
+            unsigned long long t;
+            ring_copy(e, run->data + run->length, pos, chunk);
+            t = ecm_stats_now(e->stats);
+            edc = ecm_edc_partial_computeblock_long(edc, run->data + run->length, chunk);
+            ecm_stats_lap(e->stats, STAT_EDC, t);
+        }
+        run->length += chunk;
+        run->count += chunk;
+        pos += chunk;
+        n -= chunk;
+    }
+    return edc;
+}
+
+/*
+** Append one sector from the ring to the run, keeping only what the decoder
+** cannot predict.  sector is where a record of kind takes the sector from:
+** its sync for Mode 1 and sequential records, its subheader otherwise.
+** Formless sectors keep all but their sync and header.
+*/
+static unsigned run_sector(struct encoder *e, unsigned edc, const unsigned char *sector, int kind)
+{
+    struct encode_run *run = &e->run;
+    unsigned char *p;
+    unsigned long long t;
+    if ((run->size - run->length < 0x920 + ecm_record_prefix(kind)) ||
+        (run->count == RECORD_EXTENDED_MAX))
+        run_flush(e);
+    t = ecm_stats_now(e->stats);
+    edc = ecm_edc_partial_computeblock(edc, sector, ecm_record_output(kind));
+    p = run->data + run->length;
+    if (kind & RECORD_SEQUENTIAL)
+    {
+        /* Only a record's first address (and mode, if formless) is kept */
+        if (!run->count)
+        {
+            memcpy(p, sector + 0x00C, ecm_record_prefix(kind));
+            p += ecm_record_prefix(kind);
+        }
+        memcpy(run->next_header, sector + 0x00C, 4);
+        ecm_msf_next(run->next_header);
+        if ((kind & 3) != 1)
+            sector += 0x010;
+    }
+    if (kind & RECORD_ZERO)
+        run->zerotally++;
+    switch (kind & 3)
+    {
+    case 0:
+        if (!(kind & RECORD_ZERO))
+        {
+            memcpy(p, sector, 0x920);
+            p += 0x920;
+        }
+        break;
+    case 1:
+        if (!(kind & RECORD_SEQUENTIAL))
+        {
+            memcpy(p, sector + 0x00C, 0x003);
+            p += 0x003;
+        }
+        if (!(kind & RECORD_ZERO))
+        {
+            memcpy(p, sector + 0x010, 0x800);
+            p += 0x800;
+        }
+        break;
+    case 2:
+    case 3:
+        memcpy(p, sector + 0x004, 0x004);
+        p += 0x004;
+        if (!(kind & RECORD_ZERO))
+        {
+            size_t n = ((kind & 3) == 2) ? 0x800 : 0x914;
+            memcpy(p, sector + 0x008, n);
+            p += n;
+        }
+        break;
+    }
+    run->length = p - run->data;
+    ecm_stats_lap(e->stats, STAT_EDC, t);
+    run->count++;
+    return edc;
+}
+
+/*
+** Append the sector at sector to the copy record being built, as a repeat
+** of the one back bytes before it
+*/
+static unsigned run_copy(struct encoder *e, unsigned edc, const unsigned char *sector, unsigned long back)
+{
+    struct encode_run *run = &e->run;
+    unsigned char *p;
+    unsigned long long t;
+    if ((run->size - run->length < ecm_record_prefix(RECORD_COPY)) ||
+        (run->count == RECORD_EXTENDED_MAX))
+        run_flush(e);
+    t = ecm_stats_now(e->stats);
+    edc = ecm_edc_partial_computeblock(edc, sector, 2352);
+    if (!run->count)
+    {
+        p = run->data + run->length;
+        memcpy(p, sector + 0x00C, 3);
+        ecm_put_le(p + 3, back, 4);
+        run->length += ecm_record_prefix(RECORD_COPY);
+    }
+    memcpy(run->next_header, sector + 0x00C, 3);
+    ecm_msf_next(run->next_header);
+    ecm_stats_lap(e->stats, STAT_EDC, t);
+    run->count++;
+    return edc;
+}
+
+/***************************************************************************/
+/*
+** Parallel classification
+**
+** Sector types depend only on the bytes at an offset (and on how much input
+** is left), so workers can walk windows of the ring speculatively, each
+** starting at its window's first offset, and record the type at every
+** offset they visit.  The serial loop in encoder_step then follows the real
+** path through the table; where it enters a window off the speculative path
+** it classifies the few offsets nobody visited itself until the two paths
+** meet again.
+*/
+#define CLASSIFY_UNKNOWN (-1)
+#define CLASSIFY_MIN_WINDOW 16384
+
+struct classify_batch
+{
+    struct encoder *e;
+    unsigned long start;
+    unsigned long limit;
+    unsigned long avail;
+    int ineof;
+    unsigned long window;
+    pthread_mutex_t lock;
+    struct classify_stats stats;
+};
+
+static size_t sector_step(int type)
+{
+    if (type & (RECORD_SEQUENTIAL | RECORD_COPY))
+        return 2352;
+    switch (type & 3)
+    {
+    case 1:
+        return 2352;
+    case 2:
+    case 3:
+        return 2336;
+    }
+    return 1;
+}
+
+static void classify_window(void *arg, unsigned job)
+{
+    struct classify_batch *batch = arg;
+    unsigned long pos = batch->start + (unsigned long)job * batch->window;
+    unsigned long end = pos + batch->window;
+    unsigned long streak = pos;
+    struct classifier c;
+    int type;
+    classifier_init(&c, batch->e);
+    if (end > batch->limit)
+        end = batch->limit;
+    while (pos < end)
+    {
+        unsigned long left = batch->avail - pos;
+        if (left < 2336)
+            type = 0;
+        else
+            type = classifier_check(&c, pos, left >= 2352);
+        batch->e->classified[pos % RING_SIZE] = type;
+        pos += sector_step(type);
+        if (type)
+            streak = pos;
+        else
+            pos = classifier_skip(&c, pos, streak, batch->avail, batch->ineof);
+    }
+    classifier_flush(&c);
+    pthread_mutex_lock(&batch->lock);
+    classify_stats_add(&batch->stats, &c.stats);
+    pthread_mutex_unlock(&batch->lock);
+}
+
+static void classify_parallel(
+    struct encoder *e,
+    unsigned long start,
+    unsigned long limit,
+    unsigned long avail,
+    int ineof,
+    struct classify_stats *stats)
+{
+    struct classify_batch batch;
+    unsigned long range = limit - start;
+    unsigned long at = start % RING_SIZE;
+    unsigned njobs;
+    if (range > RING_SIZE - at)
+    {
+        memset(e->classified + at, CLASSIFY_UNKNOWN, RING_SIZE - at);
+        memset(e->classified, CLASSIFY_UNKNOWN, range - (RING_SIZE - at));
+    }
+    else
+        memset(e->classified + at, CLASSIFY_UNKNOWN, range);
+    batch.e = e;
+    batch.start = start;
+    batch.limit = limit;
+    batch.avail = avail;
+    batch.ineof = ineof;
+    memset(&batch.stats, 0, sizeof(batch.stats));
+    pthread_mutex_init(&batch.lock, NULL);
+    batch.window = range / (4 * ecm_pool_size(e->pool));
+    if (batch.window < CLASSIFY_MIN_WINDOW)
+        batch.window = CLASSIFY_MIN_WINDOW;
+    njobs = (range + batch.window - 1) / batch.window;
+    ecm_pool_run(e->pool, classify_window, &batch, njobs);
+    pthread_mutex_destroy(&batch.lock);
+    classify_stats_add(stats, &batch.stats);
+}
+
+/***************************************************************************/
+/*
+** Track layout
+**
+** With a cue sheet, audio tracks are taken as literal bytes without being
+** classified, and so are the sync and header of each sector in a Mode 2
+** track, which a v1 Mode 2 record for the rest of the sector leaves out.
+** Sectors are then only looked for where the track says they start; the
+** usual byte-by-byte search takes over where one is not found there.  The
+** parallel classifier stops short of audio tracks.
+*/
+
+/*
+** Mode of the track at pos, and its extent; before the first track there
+** is no telling.  The encoder only moves forward, so the search carries on
+** from the last track found.
+*/
+static int track_at(struct encoder *e, unsigned long pos, unsigned long *start, unsigned long *end)
+{
+    while ((e->track + 1 < e->ntracks) && (e->tracks[e->track + 1].start <= pos))
+        e->track++;
+    if (pos < e->tracks[e->track].start)
+    {
+        *start = 0;
+        *end = e->tracks[e->track].start;
+        return TRACK_OTHER;
+    }
+    *start = e->tracks[e->track].start;
+    *end = (e->track + 1 < e->ntracks) ? e->tracks[e->track + 1].start : ULONG_MAX;
+    return e->tracks[e->track].mode;
+}
+
+/*
+** Start of the first audio track after pos, or ULONG_MAX
+*/
+static unsigned long audio_after(const struct encoder *e, unsigned long pos)
+{
+    unsigned i;
+    for (i = e->track; i < e->ntracks; i++)
+        if ((e->tracks[i].mode == TRACK_AUDIO) && (e->tracks[i].start > pos))
+            return e->tracks[i].start;
+    return ULONG_MAX;
+}
+
+/*
+** Take whatever the track layout says needs no classifying at the current
+** position as literal bytes; returns nonzero if there was any
+*/
+static int encoder_cue_step(struct encoder *e)
+{
+    unsigned long start, end;
+    int mode = track_at(e, e->pos, &start, &end);
+    if (mode == TRACK_AUDIO)
+    {
+        if (end > e->head)
+            end = e->head;
+    }
+    else if ((mode == TRACK_MODE2) && !e->extended && !((e->pos - start) % 2352) &&
+             (e->head - e->pos >= 2352))
+        end = e->pos + 0x10;
+    else
+        return 0;
+    if (e->run.type != 0)
+    {
+        run_flush(e);
+        e->run.type = 0;
+        e->literal_start = e->pos;
+    }
+    e->cls.stats.cued += end - e->pos;
+    e->pos = end;
+    e->streak = end;
+    return 1;
+}
+
+/*
+** Find the first hole in the input at or after the current position
+*/
+static void encoder_find_hole(struct encoder *e)
+{
+    unsigned long long start, end;
+    if (ecm_input_hole(e->holes, e->pos, &start, &end))
+    {
+        e->holes = NULL;
+        return;
+    }
+    if (start == end)
+        start = end = ULONG_MAX;
+    e->hole_start = start;
+    e->hole_end = end;
+}
+
+/*
+** Whether the sector's worth at the current position lies in a hole.  A
+** hole reads as zeros, which the classifier would always find to be a Mode
+** 2 form 1 sector, so it is taken as one without being read or checked.
+*/
+static int encoder_in_hole(struct encoder *e, unsigned long dataavail)
+{
+    if (e->holes && (e->pos >= e->hole_end))
+        encoder_find_hole(e);
+    return (dataavail >= 2336) && (e->pos >= e->hole_start) && (e->pos + 2336 <= e->hole_end);
+}
+
+/***************************************************************************/
+/*
+** Extended record kinds
+**
+** In the v2 container, runs of whole sectors whose addresses count up
+** keep only the first address, and Mode 2 sectors are taken whole, sync
+** and header included, rather than leaving those 16 bytes to a literal
+** record between every two sectors.  Sectors with all-zero user data, as
+** in the padding between files and tracks, keep none of it.
+**
+** Two more classes come only with a sync and header to find them by: Mode 2
+** form 2 sectors whose EDC is left zero, as on many VCD and XA streams, and
+** formless sectors (Mode 0, and Mode 2 sectors that are neither form),
+** which are kept whole but for their sync and address.
+*/
+static const unsigned char sync_pattern[12] = {
+    0x00, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0x00};
+
+static int all_zero(const unsigned char *p, size_t n)
+{
+    return !p[0] && !memcmp(p, p + 1, n - 1);
+}
+
+/*
+** Sequential kind of the Mode 0 or Mode 2 sector whose sync and header are
+** at the current position, or 0 if there is none
+*/
+static int raw_sector_kind(struct encoder *e, unsigned long dataavail)
+{
+    const unsigned char *s = ring_at(e, e->pos);
+    const unsigned char *p = s + 0x010;
+    int type = CLASSIFY_UNKNOWN;
+    if ((dataavail < 2352) || (s[0x0F] > 0x02) || (s[0x0F] == 0x01) ||
+        memcmp(s, sync_pattern, sizeof(sync_pattern)))
+        return 0;
+    if (s[0x0F] == 0x00)
+        return RECORD_SEQUENTIAL;
+    if (e->pool && (e->pos + 0x10 < e->classified_limit))
+        type = e->classified[(e->pos + 0x10) % RING_SIZE];
+    if (type == CLASSIFY_UNKNOWN)
+        type = classifier_check(&e->cls, e->pos + 0x10, 0);
+    if (type >= 2)
+        return RECORD_SEQUENTIAL | type;
+    /* Form 2 (both subheader copies agree) with no EDC */
+    if (!memcmp(p, p + 4, 4) && (p[2] & 0x20) && all_zero(p + 0x91C, 4))
+        return RECORD_SEQUENTIAL | RECORD_NOEDC | 3;
+    return RECORD_SEQUENTIAL;
+}
+
+/*
+** Kind of record to store the sector of type (or sequential kind) at
+** sector in
+*/
+static int record_kind(const unsigned char *sector, int kind)
+{
+    if ((kind & 3) == 1)
+        kind |= RECORD_SEQUENTIAL;
+    if ((kind & RECORD_SEQUENTIAL) && ((kind & 3) != 1))
+        sector += 0x010;
+    switch (kind & 3)
+    {
+    case 0:
+        if (all_zero(sector, 0x920))
+            kind |= RECORD_ZERO;
+        break;
+    case 1:
+        if (all_zero(sector + 0x010, 0x800))
+            kind |= RECORD_ZERO;
+        break;
+    case 2:
+        if (all_zero(sector + 0x008, 0x800))
+            kind |= RECORD_ZERO;
+        break;
+    case 3:
+        if (all_zero(sector + 0x008, 0x914))
+            kind |= RECORD_ZERO;
+        break;
+    }
+    return kind;
+}
+
+/***************************************************************************/
+/*
+** Sector dedup
+**
+** With --dedup, the sectors of extended kinds (but for all-zero ones, which
+** cost next to nothing already) are remembered in a window of the last
+** DEDUP_WINDOW, and found again by a hash of what their record would keep.
+** A sector repeating one in the window, and in the same block, goes into a
+** copy record instead, which carries on for as long as the sectors after it
+** repeat the ones after its source.  Every match is checked byte for byte,
+** so the hash only has to be quick.
+*/
+#define DEDUP_WINDOW 4096
+#define DEDUP_TABLE (4 * DEDUP_WINDOW)
+
+struct dedup
+{
+    /* Sectors remembered so far; sector n is in slot n % DEDUP_WINDOW */
+    unsigned long next;
+    unsigned long pos[DEDUP_WINDOW];
+    int kind[DEDUP_WINDOW];
+    unsigned char sectors[DEDUP_WINDOW][2352];
+    /* Hash to sector number + 1, or 0 */
+    unsigned long table[DEDUP_TABLE];
+};
+
+/*
+** Where the part of a sector of kind that its record would keep starts
+** (the mode byte, for formless sectors), and how long it is; the hash
+** leaves out the mode byte
+*/
+static size_t dedup_span(int kind)
+{
+    return ((kind & 3) == 1) ? 0x801 : 0x921;
+}
+
+static unsigned long dedup_hash(const unsigned char *sector, int kind)
+{
+    const unsigned char *p = sector + 0x010;
+    size_t n = dedup_span(kind) - 1;
+    unsigned long long h = kind;
+    size_t i;
+    for (i = 0; i < n; i += 8)
+    {
+        unsigned long long w;
+        memcpy(&w, p + i, 8);
+        h = (h ^ w) * 0x9E3779B97F4A7C15ULL;
+    }
+    return (unsigned long)(h >> 32) % DEDUP_TABLE;
+}
+
+/*
+** Nonzero if remembered sector n is in the window and the block, and the
+** sector of kind at sector repeats it
+*/
+static int dedup_match(struct encoder *e, unsigned long n, int kind, const unsigned char *sector)
+{
+    struct dedup *d = e->dedup;
+    unsigned slot = n % DEDUP_WINDOW;
+    if ((n >= d->next) || (d->next - n > DEDUP_WINDOW) ||
+        (d->kind[slot] != kind) || (d->pos[slot] < e->block_start))
+        return 0;
+    return !memcmp(d->sectors[slot] + 0x00F, sector + 0x00F, dedup_span(kind));
+}
+
+/*
+** Kind to store the sector of kind at the current position as: RECORD_COPY
+** if it repeats a remembered sector, whose number goes in copy_seq and
+** distance back in copy_back
+*/
+static int dedup_kind(struct encoder *e, const unsigned char *sector, int kind)
+{
+    struct dedup *d = e->dedup;
+    struct encode_run *run = &e->run;
+    unsigned long hash = dedup_hash(sector, kind);
+    unsigned slot = d->next % DEDUP_WINDOW;
+    int found = 0;
+    /* Carry on with the copy being built, or look for a new source */
+    if ((run->type == RECORD_COPY) && run->count &&
+        dedup_match(e, run->copy_next, kind, sector) &&
+        (e->pos - d->pos[run->copy_next % DEDUP_WINDOW] == run->copy_back))
+    {
+        e->copy_seq = run->copy_next;
+        found = 1;
+    }
+    else if (d->table[hash] && dedup_match(e, d->table[hash] - 1, kind, sector))
+    {
+        e->copy_seq = d->table[hash] - 1;
+        found = 1;
+    }
+    if (found)
+        e->copy_back = e->pos - d->pos[e->copy_seq % DEDUP_WINDOW];
+    memcpy(d->sectors[slot], sector, 2352);
+    d->pos[slot] = e->pos;
+    d->kind[slot] = kind;
+    d->table[hash] = ++d->next;
+    return found ? RECORD_COPY : kind;
+}
+
+/***************************************************************************/
+/*
+** Encoder steps, shared by ecm_encode_file and the streaming interface
+*/
+
+/*
+** Set up a zeroed encoder writing to out, with a run buffer of run_size
+** bytes.  Returns nonzero if memory ran out.
+*/
+static int encoder_init(struct encoder *e, struct ecm_output *out, size_t run_size, int threads)
+{
+    e->ring = malloc(RING_SIZE + RING_MIRROR);
+    e->run.data = malloc(run_size);
+    if (!e->ring || !e->run.data)
+        return 1;
+    if (threads > 1)
+    {
+        e->classified = malloc(RING_SIZE);
+        if (e->classified)
+            e->pool = ecm_pool_create(threads);
+    }
+    classifier_init(&e->cls, e);
+    e->run.out = out;
+    e->run.type = -1;
+    e->run.size = run_size;
+    return 0;
+}
+
+/*
+** Magic identifier: "ECM" and the format, 0 or ECM_V2_VERSION
+*/
+static unsigned write_magic(struct ecm_output *out, int version)
+{
+    ecm_output_putc(out, 'E');
+    ecm_output_putc(out, 'C');
+    ecm_output_putc(out, 'M');
+    ecm_output_putc(out, version);
+    return 4;
+}
+
+static void encoder_free(struct encoder *e)
+{
+    free(e->dedup);
+    ecm_pool_destroy(e->pool);
+    free(e->classified);
+    free(e->run.data);
+    free(e->ring);
+}
+
+/*
+** Nonzero when less than a sector is buffered and more input may follow
+*/
+static int encoder_hungry(const struct encoder *e)
+{
+    return (e->head - e->pos < 2352) && !e->ineof;
+}
+
+/*
+** Get ready for more input at the head; returns how much the ring can take
+*/
+static size_t encoder_room(struct encoder *e)
+{
+    /* Pending literals are about to be overwritten */
+    if (e->run.type == 0 && e->literal_start < e->pos)
+    {
+        e->inedc = run_literal(e, e->inedc, e->literal_start, e->pos - e->literal_start);
+        e->literal_start = e->pos;
+    }
+    setcounter_encode(e, e->pos);
+    setcounter_analyze(e, e->head);
+    classifier_flush(&e->cls);
+    ecm_stats_progress(e->stats, e->pos);
+    return RING_SIZE - RING_KEEP - (e->head - e->pos);
+}
+
+/*
+** Classify the current position and add what is there to the run
+*/
+static void encoder_step(struct encoder *e)
+{
+    unsigned long dataavail = e->head - e->pos;
+    static const unsigned char zero_sector[2352];
+    const unsigned char *sector = ring_at(e, e->pos);
+    int detecttype;
+    if (e->tracks && encoder_cue_step(e))
+        return;
+    if (encoder_in_hole(e, dataavail))
+    {
+        sector = zero_sector;
+        detecttype = e->cls.predicted = 2;
+        e->cls.stats.holes += 2336;
+    }
+    else
+    {
+        if (e->pool && (dataavail >= 2336) && (e->pos >= e->classified_limit))
+        {
+            /* Classify up to where the next refill (or hole) would start */
+            e->classified_limit = e->ineof ? e->head : e->head - 2351;
+            if (e->tracks && (audio_after(e, e->pos) < e->classified_limit))
+                e->classified_limit = audio_after(e, e->pos);
+            if ((e->hole_start > e->pos) && (e->hole_end - e->hole_start >= 2336) &&
+                (e->hole_start < e->classified_limit))
+                e->classified_limit = e->hole_start;
+            classify_parallel(e, e->pos, e->classified_limit, e->head, e->ineof,
+                              &e->worker_stats);
+        }
+        detecttype = e->extended ? raw_sector_kind(e, dataavail) : 0;
+        if (!detecttype && (dataavail >= 2336))
+        {
+            detecttype = e->pool ? e->classified[e->pos % RING_SIZE] : CLASSIFY_UNKNOWN;
+            if (detecttype < 0)
+                detecttype = classifier_check(&e->cls, e->pos, dataavail >= 2352);
+        }
+    }
+    if (e->extended && detecttype)
+        detecttype = record_kind(sector, detecttype);
+    if (e->dedup && (detecttype & RECORD_SEQUENTIAL) && !(detecttype & RECORD_ZERO))
+        detecttype = dedup_kind(e, sector, detecttype);
+    if ((detecttype != e->run.type) ||
+        ((detecttype & RECORD_SEQUENTIAL) && e->run.count &&
+         memcmp(sector + 0x00C, e->run.next_header, ecm_record_prefix(detecttype))) ||
+        ((detecttype == RECORD_COPY) && e->run.count &&
+         ((e->copy_back != e->run.copy_back) || memcmp(sector + 0x00C, e->run.next_header, 3))))
+    {
+        if (e->run.type == 0)
+            e->inedc = run_literal(e, e->inedc, e->literal_start, e->pos - e->literal_start);
+        run_flush(e);
+        e->run.type = detecttype;
+        e->literal_start = e->pos;
+    }
+    if (detecttype == RECORD_COPY)
+    {
+        e->inedc = run_copy(e, e->inedc, sector, e->copy_back);
+        e->run.copy_next = e->copy_seq + 1;
+        e->run.copy_back = e->copy_back;
+    }
+    else if (detecttype)
+        e->inedc = run_sector(e, e->inedc, sector, detecttype);
+    e->pos += sector_step(detecttype);
+    if (detecttype)
+        e->streak = e->pos;
+    else
+        e->pos = classifier_skip(&e->cls, e->pos, e->streak, e->head, e->ineof);
+}
+
+/*
+** Write out the last run and the end-of-records indicator
+*/
+static void encoder_end_records(struct encoder *e)
+{
+    if (e->run.type == 0)
+        e->inedc = run_literal(e, e->inedc, e->literal_start, e->pos - e->literal_start);
+    run_flush(e);
+    classifier_flush(&e->cls);
+    e->run.outbytes += ecm_write_type_count(e->run.out, 0, 0);
+}
+
+/*
+** Write out the last run, the end-of-records indicator and the input EDC
+*/
+static void encoder_finish(struct encoder *e)
+{
+    struct ecm_output *out = e->run.out;
+    encoder_end_records(e);
+    /* Input file EDC */
+    ecm_output_putc(out, (e->inedc >> 0) & 0xFF);
+    ecm_output_putc(out, (e->inedc >> 8) & 0xFF);
+    ecm_output_putc(out, (e->inedc >> 16) & 0xFF);
+    ecm_output_putc(out, (e->inedc >> 24) & 0xFF);
+    e->run.outbytes += 4;
+}
+
+/***************************************************************************/
+/*
+** v2 container
+**
+** The records of each block collect in the sink until the block is done,
+** since its header gives their length.  Then the encoder starts afresh, as
+** if the input began there, so that every block decodes on its own.
+*/
+
+/*
+** Write the block the encoder has been working on, if it has anything in it
+*/
+static void encoder_end_block(struct encoder *e)
+{
+    ecc_uint8 entry[ECM_V2_ENTRY_SIZE];
+    ecc_uint8 *header = entry + 8;
+    const ecc_uint8 *records;
+    size_t length;
+    if (e->pos == e->block_start)
+        return;
+    encoder_end_records(e);
+    records = e->sink.block + e->sink.drained;
+    length = ecm_output_pending(&e->sink);
+    ecm_put_le(entry, ecm_output_tell(e->container), 8);
+    ecm_put_le(header, length, 4);
+    ecm_put_le(header + 4, e->pos - e->block_start, 4);
+    ecm_put_le(header + 8, ecm_edc_partial_computeblock_long(0, records, length), 4);
+    ecm_put_le(header + 12, e->inedc, 4);
+    ecm_output_write(e->container, header, ECM_V2_HEADER_SIZE);
+    ecm_output_write(e->container, records, length);
+    ecm_output_write(&e->table, entry, ECM_V2_ENTRY_SIZE);
+    e->sink.fill = e->sink.drained = 0;
+    e->run.outbytes += ECM_V2_HEADER_SIZE;
+    e->nblocks++;
+    /* Start the next block from scratch */
+    e->block_start = e->pos;
+    e->literal_start = e->pos;
+    e->streak = e->pos;
+    e->inedc = 0;
+    e->run.type = -1;
+    e->cls.predicted = 0;
+    e->cls.repeat_from = 0;
+    e->cls.repeat_end = 0;
+    e->cls.repeat_cap = 0;
+}
+
+/*
+** Write the last block, the end of the blocks and the footer
+*/
+static void encoder_end_container(struct encoder *e)
+{
+    ecc_uint8 field[ECM_V2_HEADER_SIZE];
+    const ecc_uint8 *table;
+    size_t length;
+    encoder_end_block(e);
+    memset(field, 0, sizeof(field));
+    ecm_put_le(field + 4, e->nblocks, 4);
+    ecm_output_write(e->container, field, ECM_V2_HEADER_SIZE);
+    table = e->table.block + e->table.drained;
+    length = ecm_output_pending(&e->table);
+    ecm_output_write(e->container, table, length);
+    ecm_put_le(field, e->nblocks, 4);
+    ecm_put_le(field + 4, ecm_edc_partial_computeblock_long(0, table, length), 4);
+    memcpy(field + 8, "ECMF", 4);
+    ecm_output_write(e->container, field, ECM_V2_TRAILER_SIZE);
+    e->run.outbytes += ECM_V2_HEADER_SIZE + length + ECM_V2_TRAILER_SIZE;
+}
+
+/*
+** Write the v2 container with blocks of sectors sectors (NULL for the
+** default); returns nonzero if the number is out of range
+*/
+int ecm_v2_select(const char *sectors)
+{
+    unsigned long n = ECM_V2_DEFAULT_SECTORS;
+    char *end;
+    if (sectors)
+    {
+        n = strtoul(sectors, &end, 0);
+        if ((end == sectors) || *end || !n || (n > ECM_V2_MAX_SECTORS))
+            return -1;
+    }
+    v2_sectors = n;
     return 0;
 }
+
+/*
+** Store sectors that repeat earlier ones in their block as copy records
+** (v2 container only)
+*/
+void ecm_dedup_select(void)
+{
+    dedup_selected = 1;
+}
+
+static void encoder_report(struct encoder *e)
+{
+    struct classify_stats *stats = &e->cls.stats;
+    fprintf(stderr, "Literal bytes........... %10lu\n", e->run.typetally[0]);
+    fprintf(stderr, "Mode 1 sectors.......... %10lu\n", e->run.typetally[1]);
+    fprintf(stderr, "Mode 2 form 1 sectors... %10lu\n", e->run.typetally[2]);
+    fprintf(stderr, "Mode 2 form 2 sectors... %10lu\n", e->run.typetally[3]);
+    if (e->extended)
+    {
+        fprintf(stderr, "Formless sectors........ %10lu\n", e->run.formlesstally);
+        fprintf(stderr, "Zero user data sectors.. %10lu\n", e->run.zerotally);
+    }
+    if (e->dedup)
+        fprintf(stderr, "Copied sectors.......... %10lu\n", e->run.copytally);
+    if (e->block_bytes)
+        fprintf(stderr, "Blocks.................. %10u\n", e->nblocks);
+    fprintf(stderr, "Encoded %lu bytes -> %lu bytes\n", e->pos, e->run.outbytes);
+    /* Skips along the path actually taken are counted here already */
+    e->worker_stats.scanned = 0;
+    e->worker_stats.repeated = 0;
+    classify_stats_add(stats, &e->worker_stats);
+    fprintf(stderr, "Sector checks........... %10lu\n", stats->checks);
+    fprintf(stderr, "  as predicted.......... %10lu\n", stats->predicted);
+    fprintf(stderr, "  rejected by header.... %10lu\n", stats->rejects[STAGE_HEADER]);
+    fprintf(stderr, "  rejected by fields.... %10lu\n", stats->rejects[STAGE_FIELDS]);
+    fprintf(stderr, "  rejected by ECC spot.. %10lu\n", stats->rejects[STAGE_ECC_SPOT]);
+    fprintf(stderr, "  rejected by EDC....... %10lu\n", stats->rejects[STAGE_EDC]);
+    fprintf(stderr, "  rejected by ECC....... %10lu\n", stats->rejects[STAGE_ECC]);
+    fprintf(stderr, "Offsets skipped by scan. %10lu\n", stats->scanned);
+    fprintf(stderr, "Offsets skipped repeat.. %10lu\n", stats->repeated);
+    if (e->tracks)
+        fprintf(stderr, "Offsets taken from cue.. %10lu\n", stats->cued);
+    if (stats->holes)
+        fprintf(stderr, "Offsets taken from holes %10lu\n", stats->holes);
+    fprintf(stderr, "Done\n");
+}
+
+/***************************************************************************/
+
+int ecm_encode_file(FILE *in, FILE *out, int verbose, int threads)
+{
+    struct ecm_input input;
+    struct ecm_output output;
+    struct encoder *e = calloc(1, sizeof(*e));
+    struct ecm_stats *stats = NULL;
+    unsigned long intotallength = 0;
+    struct stat st;
+    int eof = 0;
+    int error = 0;
+    ecm_input_open(&input, in);
+    ecm_output_open(&output, out);
+    if (ecm_output_compress(&output, threads))
+    {
+        fprintf(stderr, "Cannot start the compressor\n");
+        error = 1;
+        goto done;
+    }
+    if (!e || encoder_init(e, &output, RUN_SIZE, threads))
+    {
+        fprintf(stderr, "Out of memory\n");
+        error = 1;
+        goto done;
+    }
+    if (v2_sectors)
+    {
+        e->block_bytes = v2_sectors * 2352;
+        e->extended = 1;
+        if (dedup_selected && !(e->dedup = calloc(1, sizeof(*e->dedup))))
+        {
+            fprintf(stderr, "Out of memory\n");
+            error = 1;
+            goto done;
+        }
+        e->container = &output;
+        e->run.out = &e->sink;
+        if (ecm_output_open_memory(&e->sink, e->block_bytes) ||
+            ecm_output_open_memory(&e->table, 4096))
+        {
+            fprintf(stderr, "Out of memory\n");
+            error = 1;
+            goto done;
+        }
+        e->run.outbytes = write_magic(&output, ECM_V2_VERSION) + 4;
+        ecm_output_putc(&output, (v2_sectors >> 0) & 0xFF);
+        ecm_output_putc(&output, (v2_sectors >> 8) & 0xFF);
+        ecm_output_putc(&output, (v2_sectors >> 16) & 0xFF);
+        ecm_output_putc(&output, (v2_sectors >> 24) & 0xFF);
+    }
+    else
+        e->run.outbytes = write_magic(&output, 0);
+    e->verbose = verbose;
+    e->tracks = ecm_cue_tracks(&e->ntracks);
+    e->mapped = input.data;
+    e->mapped_size = input.size;
+    e->holes = input.data ? &input : NULL;
+    /* The size is only needed for progress, so pipes are fine */
+    if (!fstat(fileno(in), &st) && S_ISREG(st.st_mode))
+        intotallength = st.st_size;
+    resetcounter(e, intotallength);
+    stats = ecm_stats_open("encode", intotallength, ecm_pool_size(e->pool));
+    e->stats = e->cls.stats.timing = stats;
+    if (e->extended)
+        ecm_stats_classes(stats, e->dedup ? STAT_RECORDS : STAT_RECORD_COPY);
+    for (;;)
+    {
+        if (encoder_hungry(e))
+        {
+            size_t want = encoder_room(e);
+            unsigned long long t = ecm_stats_now(stats);
+            size_t got;
+            if (e->block_bytes && (want > e->block_start + e->block_bytes - e->head))
+                want = e->block_start + e->block_bytes - e->head;
+            got = ring_fill(e, &input, want);
+            ecm_stats_lap(stats, STAT_READ, t);
+            if (ecm_input_error(&input))
+            {
+                fprintf(stderr, "Read error\n");
+                error = 1;
+                goto done;
+            }
+            if (got < want)
+                eof = e->ineof = 1;
+            e->head += got;
+            /* As far as its records go, a block ends where the input does */
+            if (e->block_bytes && (e->head == e->block_start + e->block_bytes))
+                e->ineof = 1;
+        }
+        if (e->head == e->pos)
+        {
+            if (!e->block_bytes || eof)
+                break;
+            encoder_end_block(e);
+            e->ineof = 0;
+            continue;
+        }
+        encoder_step(e);
+    }
+    if (e->block_bytes)
+        encoder_end_container(e);
+    else
+        encoder_finish(e);
+    /* Show report */
+    if (verbose)
+        encoder_report(e);
+done:
+    if (e)
+    {
+        encoder_free(e);
+        ecm_output_close(&e->sink);
+        ecm_output_close(&e->table);
+    }
+    ecm_input_close(&input);
+    if (ecm_output_close(&output) && !error)
+    {
+        fprintf(stderr, "Write error\n");
+        error = 1;
+    }
+    if (stats)
+        ecm_stats_close(stats, e->pos, e->run.outbytes);
+    free(e);
+    return error;
+}
+
+/***************************************************************************/
+/*
+** Streaming encoder (libecm.h)
+**
+** The same encoder, fed from the caller's buffers: input is copied into the
+** ring as it arrives and output collects in a memory sink that is drained
+** into next_out.  A step is only taken once the sink is empty, so the sink
+** never holds more than one step's worth, which is at most a ring of
+** literals plus a run; it is allocated that large up front.
+*/
+#define STREAM_SINK_SIZE (RING_SIZE + 2 * STREAM_RUN_SIZE)
+
+int ecm_encode_init(ecm_stream *strm)
+{
+    struct encoder *e;
+    ecm_eccedc_init();
+    strm->total_in = 0;
+    strm->total_out = 0;
+    strm->msg = NULL;
+    strm->state = NULL;
+    e = calloc(1, sizeof(*e));
+    if (!e)
+        return ECM_STREAM_MEMORY;
+    if (ecm_output_open_memory(&e->sink, STREAM_SINK_SIZE) ||
+        encoder_init(e, &e->sink, STREAM_RUN_SIZE, 1))
+    {
+        encoder_free(e);
+        ecm_output_close(&e->sink);
+        free(e);
+        return ECM_STREAM_MEMORY;
+    }
+    e->run.outbytes = write_magic(&e->sink, 0);
+    strm->state = e;
+    return ECM_STREAM_OK;
+}
+
+int ecm_encode(ecm_stream *strm, int flush)
+{
+    struct encoder *e = strm->state;
+    size_t n;
+    if (!e)
+        return ECM_STREAM_ERROR;
+    for (;;)
+    {
+        n = ecm_output_drain(&e->sink, strm->next_out, strm->avail_out);
+        strm->next_out += n;
+        strm->avail_out -= n;
+        strm->total_out += n;
+        if (e->sink.failed)
+        {
+            strm->msg = "out of memory";
+            return ECM_STREAM_MEMORY;
+        }
+        if (ecm_output_pending(&e->sink))
+            return ECM_STREAM_OK;
+        if (e->finished)
+            return ECM_STREAM_END;
+        if (encoder_hungry(e))
+        {
+            if (strm->avail_in)
+            {
+                n = encoder_room(e);
+                if (n > strm->avail_in)
+                    n = strm->avail_in;
+                ring_put(e, strm->next_in, n);
+                e->head += n;
+                strm->next_in += n;
+                strm->avail_in -= n;
+                strm->total_in += n;
+                continue;
+            }
+            if (flush != ECM_FINISH)
+                return ECM_STREAM_OK;
+            e->ineof = 1;
+        }
+        if (e->head == e->pos)
+        {
+            encoder_finish(e);
+            e->finished = 1;
+        }
+        else
+            encoder_step(e);
+    }
+}
+
+void ecm_encode_end(ecm_stream *strm)
+{
+    struct encoder *e = strm->state;
+    if (!e)
+        return;
+    encoder_free(e);
+    ecm_output_close(&e->sink);
+    free(e);
+    strm->state = NULL;
+}
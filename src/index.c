@@ -0,0 +1,825 @@
+/**************************************************************************/
+/*
+** Random access into ECM files.
+** Copyright (C) 2024 Jonathan Birge
+**
+***************************************************************************/
+/*
+** An ECM file is a run of type/count records, each followed by a fixed
+** size payload per sector (or by the raw bytes of a literal run), so one
+** pass over the record headers is enough to know where every output byte
+** comes from.  The index keeps one entry per record with the offsets of its
+** payload and of its output; a read finds its record by binary search and
+** rebuilds just the sectors it touches.
+**
+** Rebuilt sectors are kept in an LRU cache, since readers tend to come back
+** for the rest of a sector they have just read part of.  Each handle has a
+** small one of its own, or several handles can share one bounded by a
+** memory limit (ecm_set_cache).  On a miss the following sectors of the
+** record can be rebuilt along with the one asked for, from one read.
+**
+** The index can be saved next to the ECM file as a sidecar (<file>.idx):
+**
+**   "ECMI", version, ECM file size (8), trailer EDC, output size (8),
+**   record count, then per record: type (1), count (4), payload offset (8),
+**   output offset (8); finally the EDC of everything before it.
+**
+** All fields are little endian.  The ECM file size and trailer tie the
+** sidecar to the file it was built from; a stale one is ignored.  For a v2
+** container the block table's EDC stands in for the trailer, and the index
+** runs through the blocks' records as if they were one stream.
+**
+** Random reads cannot check the whole-file EDC in the trailer, which covers
+** the complete output.  Sector EDC/ECC are regenerated as usual.
+**
+***************************************************************************/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "ecm.h"
+
+#define INDEX_VERSION 1
+#define INDEX_HEADER_SIZE 32
+#define INDEX_RECORD_SIZE 25
+#define INDEX_CACHE 16
+#define CACHE_NONE 0xFFFFFFFF
+
+struct index_record
+{
+    unsigned type;
+    unsigned count;
+    unsigned long long in_offset;
+    unsigned long long out_offset;
+};
+
+/*
+** A cached sector, in the hash chain of its bucket and in the LRU list;
+** entries without an owner are free and sit at the old end
+*/
+struct cache_entry
+{
+    const ecm_handle *owner;
+    unsigned long long offset;
+    unsigned chain;
+    unsigned older;
+    unsigned newer;
+    ecc_uint8 data[2352];
+};
+
+struct ecm_cache
+{
+    pthread_mutex_t lock;
+    struct cache_entry *entries;
+    unsigned *buckets;
+    unsigned count;
+    unsigned oldest;
+    unsigned newest;
+};
+
+struct ecm_handle
+{
+    int fd;
+    unsigned long long file_size;
+    ecc_uint32 trailer;
+    unsigned long long size;
+    struct index_record *records;
+    unsigned nrecords;
+    pthread_mutex_t lock;
+    ecm_cache *cache;
+    int own_cache;
+    unsigned readahead;
+    ecc_uint8 *payload;
+};
+
+/***************************************************************************/
+/*
+** Read exactly n bytes at offset; returns 0 on success
+*/
+static int read_at(int fd, void *dest, size_t n, unsigned long long offset)
+{
+    ecc_uint8 *p = dest;
+    while (n)
+    {
+        ssize_t got = pread(fd, p, n, offset);
+        if (got < 0 && errno == EINTR)
+            continue;
+        if (got <= 0)
+            return -1;
+        p += got;
+        n -= got;
+        offset += got;
+    }
+    return 0;
+}
+
+/***************************************************************************/
+/*
+** Sector cache
+*/
+ecm_cache *ecm_cache_create(size_t bytes)
+{
+    ecm_cache *c = calloc(1, sizeof(*c));
+    unsigned i;
+    if (!c)
+        return NULL;
+    c->count = bytes / sizeof(struct cache_entry);
+    if (c->count < 1)
+        c->count = 1;
+    if (c->count > 0x10000000)
+        c->count = 0x10000000;
+    c->entries = malloc(c->count * sizeof(*c->entries));
+    c->buckets = malloc(c->count * sizeof(*c->buckets));
+    if (!c->entries || !c->buckets)
+    {
+        ecm_cache_destroy(c);
+        return NULL;
+    }
+    for (i = 0; i < c->count; i++)
+    {
+        c->entries[i].owner = NULL;
+        c->entries[i].older = i ? i - 1 : CACHE_NONE;
+        c->entries[i].newer = (i + 1 < c->count) ? i + 1 : CACHE_NONE;
+        c->buckets[i] = CACHE_NONE;
+    }
+    c->oldest = 0;
+    c->newest = c->count - 1;
+    pthread_mutex_init(&c->lock, NULL);
+    return c;
+}
+
+void ecm_cache_destroy(ecm_cache *c)
+{
+    if (!c)
+        return;
+    if (c->entries && c->buckets)
+        pthread_mutex_destroy(&c->lock);
+    free(c->entries);
+    free(c->buckets);
+    free(c);
+}
+
+static unsigned cache_bucket(
+    const ecm_cache *c,
+    const ecm_handle *owner,
+    unsigned long long offset)
+{
+    unsigned long long key = (unsigned long long)(size_t)owner ^ (offset / 2336);
+    key *= 0x9E3779B97F4A7C15ULL;
+    return (key >> 32) % c->count;
+}
+
+static void cache_unlink(ecm_cache *c, unsigned i)
+{
+    struct cache_entry *e = &c->entries[i];
+    if (e->older != CACHE_NONE)
+        c->entries[e->older].newer = e->newer;
+    else
+        c->oldest = e->newer;
+    if (e->newer != CACHE_NONE)
+        c->entries[e->newer].older = e->older;
+    else
+        c->newest = e->older;
+}
+
+static void cache_make_newest(ecm_cache *c, unsigned i)
+{
+    struct cache_entry *e = &c->entries[i];
+    cache_unlink(c, i);
+    e->older = c->newest;
+    e->newer = CACHE_NONE;
+    if (c->newest != CACHE_NONE)
+        c->entries[c->newest].newer = i;
+    else
+        c->oldest = i;
+    c->newest = i;
+}
+
+static void cache_make_oldest(ecm_cache *c, unsigned i)
+{
+    struct cache_entry *e = &c->entries[i];
+    cache_unlink(c, i);
+    e->newer = c->oldest;
+    e->older = CACHE_NONE;
+    if (c->oldest != CACHE_NONE)
+        c->entries[c->oldest].older = i;
+    else
+        c->newest = i;
+    c->oldest = i;
+}
+
+/*
+** Take an entry out of its hash chain and mark it free
+*/
+static void cache_drop(ecm_cache *c, unsigned i)
+{
+    struct cache_entry *e = &c->entries[i];
+    unsigned *link = &c->buckets[cache_bucket(c, e->owner, e->offset)];
+    while (*link != i)
+        link = &c->entries[*link].chain;
+    *link = e->chain;
+    e->owner = NULL;
+}
+
+static unsigned cache_find(
+    const ecm_cache *c,
+    const ecm_handle *owner,
+    unsigned long long offset)
+{
+    unsigned i = c->buckets[cache_bucket(c, owner, offset)];
+    while ((i != CACHE_NONE) &&
+           ((c->entries[i].owner != owner) || (c->entries[i].offset != offset)))
+        i = c->entries[i].chain;
+    return i;
+}
+
+/*
+** Copy n bytes of a cached sector to dest; returns 0 if it was there
+*/
+static int cache_get(
+    ecm_cache *c,
+    const ecm_handle *owner,
+    unsigned long long offset,
+    ecc_uint8 *dest,
+    size_t n)
+{
+    unsigned i;
+    pthread_mutex_lock(&c->lock);
+    i = cache_find(c, owner, offset);
+    if (i != CACHE_NONE)
+    {
+        memcpy(dest, c->entries[i].data, n);
+        cache_make_newest(c, i);
+    }
+    pthread_mutex_unlock(&c->lock);
+    return i == CACHE_NONE;
+}
+
+static void cache_put(
+    ecm_cache *c,
+    const ecm_handle *owner,
+    unsigned long long offset,
+    const ecc_uint8 *src,
+    size_t n)
+{
+    unsigned i;
+    pthread_mutex_lock(&c->lock);
+    i = cache_find(c, owner, offset);
+    if (i == CACHE_NONE)
+    {
+        unsigned *bucket = &c->buckets[cache_bucket(c, owner, offset)];
+        i = c->oldest;
+        if (c->entries[i].owner)
+            cache_drop(c, i);
+        c->entries[i].owner = owner;
+        c->entries[i].offset = offset;
+        c->entries[i].chain = *bucket;
+        *bucket = i;
+        memcpy(c->entries[i].data, src, n);
+    }
+    cache_make_newest(c, i);
+    pthread_mutex_unlock(&c->lock);
+}
+
+/*
+** Free every entry belonging to owner
+*/
+static void cache_forget(ecm_cache *c, const ecm_handle *owner)
+{
+    unsigned i;
+    pthread_mutex_lock(&c->lock);
+    for (i = 0; i < c->count; i++)
+        if (c->entries[i].owner == owner)
+        {
+            cache_drop(c, i);
+            cache_make_oldest(c, i);
+        }
+    pthread_mutex_unlock(&c->lock);
+}
+
+/***************************************************************************/
+/*
+** Build the index with one pass over the record headers
+*/
+static int index_build(ecm_handle *h, FILE *file)
+{
+    struct ecm_input input;
+    struct ecm_input *in = &input;
+    unsigned long long out = 0;
+    unsigned cap = 0;
+    ecc_uint8 trailer[4];
+    ecc_uint8 header[ECM_V2_HEADER_SIZE];
+    unsigned type;
+    unsigned num;
+    int version;
+    int status;
+    ecm_input_open(in, file);
+    if (
+        (ecm_input_getc(in) != 'E') ||
+        (ecm_input_getc(in) != 'C') ||
+        (ecm_input_getc(in) != 'M') ||
+        (((version = ecm_input_getc(in)) != 0x00) && (version != ECM_V2_VERSION)))
+    {
+        status = DECODE_CORRUPT;
+        goto done;
+    }
+    /* The records of a v2 container's blocks, headers skipped, run on */
+    if ((version == ECM_V2_VERSION) && (ecm_input_skip(in, 4) != 4))
+    {
+        status = DECODE_UNEOF;
+        goto done;
+    }
+    for (;;)
+    {
+        if (version == ECM_V2_VERSION)
+        {
+            if (ecm_input_read(in, header, ECM_V2_HEADER_SIZE) != ECM_V2_HEADER_SIZE)
+            {
+                status = DECODE_UNEOF;
+                break;
+            }
+            if (!ecm_get_le(header, 4))
+            {
+                h->size = out;
+                status = DECODE_OK;
+                break;
+            }
+        }
+        while ((status = (version == ECM_V2_VERSION) ? ecm_read_record_header(in, &type, &num)
+                                                     : ecm_read_type_count(in, &type, &num)) == DECODE_OK)
+        {
+            struct index_record *r;
+            size_t payload = (size_t)num * ecm_record_payload(type);
+            if (h->nrecords == cap)
+            {
+                cap = cap ? 2 * cap : 256;
+                r = realloc(h->records, cap * sizeof(*r));
+                if (!r)
+                {
+                    status = DECODE_CORRUPT;
+                    goto done;
+                }
+                h->records = r;
+            }
+            r = &h->records[h->nrecords++];
+            r->type = type;
+            r->count = num;
+            /* The first address of a sequential record comes before its sectors */
+            if (ecm_input_skip(in, ecm_record_prefix(type)) != ecm_record_prefix(type))
+            {
+                status = DECODE_UNEOF;
+                goto done;
+            }
+            r->in_offset = ecm_input_tell(in);
+            r->out_offset = out;
+            if (ecm_input_skip(in, payload) != payload)
+            {
+                status = DECODE_UNEOF;
+                goto done;
+            }
+            out += (unsigned long long)num * ecm_record_output(type);
+        }
+        if (status != DECODE_END)
+            break;
+        if (version == ECM_V2_VERSION)
+            continue;
+        status = DECODE_OK;
+        if (ecm_input_read(in, trailer, 4) != 4)
+            status = DECODE_UNEOF;
+        h->trailer = ecm_get_le(trailer, 4);
+        h->size = out;
+        break;
+    }
+done:
+    ecm_input_close(in);
+    return status;
+}
+
+/*
+** Load a sidecar index if there is one that matches; returns 0 on success
+*/
+static int index_load(ecm_handle *h, const char *path)
+{
+    ecc_uint8 header[INDEX_HEADER_SIZE];
+    ecc_uint8 record[INDEX_RECORD_SIZE];
+    ecc_uint8 tail[4];
+    ecc_uint32 edc;
+    unsigned long long out = 0;
+    unsigned i, n;
+    FILE *f = fopen(path, "rb");
+    if (!f)
+        return -1;
+    if ((fread(header, 1, sizeof(header), f) != sizeof(header)) ||
+        memcmp(header, "ECMI", 4) ||
+        (ecm_get_le(header + 4, 4) != INDEX_VERSION) ||
+        (ecm_get_le(header + 8, 8) != h->file_size) ||
+        (ecm_get_le(header + 16, 4) != h->trailer))
+        goto fail;
+    edc = ecm_edc_partial_computeblock(0, header, sizeof(header));
+    n = ecm_get_le(header + 28, 4);
+    h->records = malloc((n ? n : 1) * sizeof(*h->records));
+    if (!h->records)
+        goto fail;
+    for (i = 0; i < n; i++)
+    {
+        struct index_record *r = &h->records[i];
+        if (fread(record, 1, sizeof(record), f) != sizeof(record))
+            goto fail;
+        edc = ecm_edc_partial_computeblock(edc, record, sizeof(record));
+        r->type = record[0];
+        r->count = ecm_get_le(record + 1, 4);
+        r->in_offset = ecm_get_le(record + 5, 8);
+        r->out_offset = ecm_get_le(record + 13, 8);
+        if ((r->type >= RECORD_KINDS) ||
+            (r->type && !(r->type & 3) && !(r->type & RECORD_SEQUENTIAL) && (r->type != RECORD_COPY)) ||
+            ((r->type & RECORD_NOEDC) && ((r->type & 3) != 3)) ||
+            ((r->type & RECORD_COPY) && (r->type != RECORD_COPY)) || !r->count ||
+            (r->out_offset != out) ||
+            (r->in_offset + (unsigned long long)r->count * ecm_record_payload(r->type) >
+             h->file_size))
+            goto fail;
+        out += (unsigned long long)r->count * ecm_record_output(r->type);
+    }
+    if ((fread(tail, 1, 4, f) != 4) || (ecm_get_le(tail, 4) != edc) ||
+        (out != ecm_get_le(header + 20, 8)))
+        goto fail;
+    fclose(f);
+    h->nrecords = n;
+    h->size = out;
+    return 0;
+fail:
+    fclose(f);
+    free(h->records);
+    h->records = NULL;
+    return -1;
+}
+
+/*
+** Save the index as a sidecar; returns nonzero on a write error
+*/
+int ecm_index_write(ecm_handle *h, FILE *out)
+{
+    ecc_uint8 header[INDEX_HEADER_SIZE];
+    ecc_uint8 record[INDEX_RECORD_SIZE];
+    ecc_uint32 edc;
+    unsigned i;
+    memcpy(header, "ECMI", 4);
+    ecm_put_le(header + 4, INDEX_VERSION, 4);
+    ecm_put_le(header + 8, h->file_size, 8);
+    ecm_put_le(header + 16, h->trailer, 4);
+    ecm_put_le(header + 20, h->size, 8);
+    ecm_put_le(header + 28, h->nrecords, 4);
+    edc = ecm_edc_partial_computeblock(0, header, sizeof(header));
+    fwrite(header, 1, sizeof(header), out);
+    for (i = 0; i < h->nrecords; i++)
+    {
+        const struct index_record *r = &h->records[i];
+        record[0] = r->type;
+        ecm_put_le(record + 1, r->count, 4);
+        ecm_put_le(record + 5, r->in_offset, 8);
+        ecm_put_le(record + 13, r->out_offset, 8);
+        edc = ecm_edc_partial_computeblock(edc, record, sizeof(record));
+        fwrite(record, 1, sizeof(record), out);
+    }
+    ecm_put_le(record, edc, 4);
+    fwrite(record, 1, 4, out);
+    return (fflush(out) != 0) || ferror(out);
+}
+
+/***************************************************************************/
+/*
+** Open an ECM file for random access, using its sidecar index when that
+** is present and current, otherwise indexing it.  Returns NULL on failure.
+*/
+ecm_handle *ecm_open(const char *path)
+{
+    ecm_handle *h;
+    FILE *file;
+    struct stat st;
+    ecc_uint8 trailer[8];
+    char *sidecar;
+    ecm_eccedc_init();
+    file = fopen(path, "rb");
+    if (!file)
+        return NULL;
+    h = calloc(1, sizeof(*h));
+    sidecar = malloc(strlen(path) + 5);
+    if (!h || !sidecar || fstat(fileno(file), &st) || (st.st_size < 9))
+        goto fail;
+    h->fd = fileno(file);
+    h->file_size = st.st_size;
+    if (read_at(h->fd, trailer, 8, h->file_size - 8))
+        goto fail;
+    /* A v2 container ends in its table's EDC and "ECMF" */
+    h->trailer = ecm_get_le(trailer + (memcmp(trailer + 4, "ECMF", 4) ? 4 : 0), 4);
+    strcpy(sidecar, path);
+    strcat(sidecar, ".idx");
+    if (index_load(h, sidecar) && (index_build(h, file) != DECODE_OK))
+        goto fail;
+    free(sidecar);
+    /* Keep the descriptor; the stream itself is no longer needed */
+    h->fd = dup(fileno(file));
+    fclose(file);
+    h->cache = ecm_cache_create(INDEX_CACHE * sizeof(struct cache_entry));
+    h->own_cache = 1;
+    h->payload = malloc(0x920);
+    if ((h->fd < 0) || !h->cache || !h->payload)
+    {
+        if (h->fd >= 0)
+            close(h->fd);
+        ecm_cache_destroy(h->cache);
+        free(h->payload);
+        free(h->records);
+        free(h);
+        return NULL;
+    }
+    pthread_mutex_init(&h->lock, NULL);
+    return h;
+fail:
+    fclose(file);
+    free(sidecar);
+    if (h)
+        free(h->records);
+    free(h);
+    return NULL;
+}
+
+void ecm_close(ecm_handle *h)
+{
+    if (!h)
+        return;
+    close(h->fd);
+    pthread_mutex_destroy(&h->lock);
+    if (h->own_cache)
+        ecm_cache_destroy(h->cache);
+    else
+        cache_forget(h->cache, h);
+    free(h->payload);
+    free(h->records);
+    free(h);
+}
+
+/*
+** Keep rebuilt sectors in cache, which may be shared with other handles
+** (NULL goes back to a small private cache), and on a miss also rebuild
+** up to readahead following sectors.  Returns nonzero if out of memory.
+** Must not be called while reads on the handle are in progress.
+*/
+int ecm_set_cache(ecm_handle *h, ecm_cache *cache, unsigned readahead)
+{
+    ecc_uint8 *payload = realloc(h->payload, (size_t)(readahead + 1) * 0x920);
+    ecm_cache *own = NULL;
+    if (!payload)
+        return 1;
+    h->payload = payload;
+    if (!cache && !h->own_cache)
+    {
+        own = ecm_cache_create(INDEX_CACHE * sizeof(struct cache_entry));
+        if (!own)
+            return 1;
+    }
+    if (h->own_cache)
+        ecm_cache_destroy(h->cache);
+    else
+        cache_forget(h->cache, h);
+    if (cache)
+    {
+        h->cache = cache;
+        h->own_cache = 0;
+    }
+    else
+    {
+        h->cache = own ? own : ecm_cache_create(INDEX_CACHE * sizeof(struct cache_entry));
+        h->own_cache = 1;
+        if (!h->cache)
+            return 1;
+    }
+    h->readahead = readahead;
+    return 0;
+}
+
+/*
+** Size of the decoded image
+*/
+unsigned long long ecm_size(ecm_handle *h)
+{
+    return h->size;
+}
+
+/***************************************************************************/
+static long index_read(ecm_handle *h, ecc_uint8 *p, size_t len, unsigned long long offset);
+
+/*
+** Number of the last record starting at or before offset
+*/
+static unsigned index_find(const ecm_handle *h, unsigned long long offset)
+{
+    unsigned lo = 0;
+    unsigned hi = h->nrecords;
+    while (hi - lo > 1)
+    {
+        unsigned mid = lo + (hi - lo) / 2;
+        if (h->records[mid].out_offset <= offset)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+/*
+** Find where the sector copied from back bytes before at really comes from:
+** the first sector up the chain of copies that is not a copy itself.  A run
+** of repeated sectors is one copy record whose sectors each copy the one
+** before, so the chain is walked by whole records, not by sectors, and not
+** by recursion.  Copies are only ever made of whole sectors within one
+** sector record, as the encoder writes them.  Returns 0 with the sector's
+** offset in source, or 1 if the chain leads anywhere else.
+*/
+static int index_source(
+    ecm_handle *h,
+    unsigned long long at,
+    unsigned long back,
+    unsigned long long *source)
+{
+    for (;;)
+    {
+        const struct index_record *r;
+        unsigned long long within;
+        ecc_uint8 header[7];
+        if ((back < 2352) || (back > at))
+            return 1;
+        at -= back;
+        r = &h->records[index_find(h, at)];
+        within = at - r->out_offset;
+        if (r->type != RECORD_COPY)
+        {
+            if (!r->type || (within + 2352 > (unsigned long long)r->count * ecm_record_output(r->type)))
+                return 1;
+            *source = at;
+            return 0;
+        }
+        if ((within % 2352) || read_at(h->fd, header, 7, r->in_offset - 7))
+            return 1;
+        back = ecm_get_le(header + 3, 4);
+        /* Straight out of the record, when its copies line up with it */
+        if (back && !(back % 2352))
+            at -= back * (within / back);
+    }
+}
+
+/*
+** Rebuild the sector at out_offset within record r into dest, along with up
+** to readahead following sectors of the record, which go into the cache.
+** The sectors of a copy record are read back from earlier in the image.
+** Called with the handle lock held.  Returns 0 on success.
+*/
+static int index_rebuild(
+    ecm_handle *h,
+    const struct index_record *r,
+    unsigned long long out_offset,
+    ecc_uint8 *dest)
+{
+    unsigned type = r->type & 3;
+    unsigned in_size = ecm_record_payload(r->type);
+    unsigned out_size = ecm_record_output(r->type);
+    unsigned long long k = (out_offset - r->out_offset) / out_size;
+    unsigned long long n = r->count - k;
+    unsigned prefix = ecm_record_prefix(r->type);
+    unsigned data = (type == 0) ? 0x920 : (type == 3) ? 0x914 : 0x800;
+    ecc_uint8 sector[2352];
+    ecc_uint8 header[7];
+    unsigned long long j;
+    unsigned i;
+    if (n > h->readahead + 1)
+        n = h->readahead + 1;
+    if (read_at(h->fd, h->payload, n * in_size, r->in_offset + k * in_size))
+        return 1;
+    if (prefix)
+    {
+        if (read_at(h->fd, header, prefix, r->in_offset - prefix))
+            return 1;
+        for (j = 0; j < k; j++)
+            ecm_msf_next(header);
+    }
+    if (r->type == RECORD_COPY)
+    {
+        unsigned long back = ecm_get_le(header + 3, 4);
+        for (i = 0; i < n; i++)
+        {
+            unsigned long long at = out_offset + i * 2352ULL;
+            unsigned long long source;
+            if (index_source(h, at, back, &source) ||
+                (index_read(h, sector, 2352, source) != 2352))
+                return 1;
+            memcpy(sector + 0x00C, header, 3);
+            ecm_msf_next(header);
+            if (sector[0x00F] == 0x01)
+                ecm_eccedc_generate_decode(sector, 1);
+            cache_put(h->cache, h, at, sector, 2352);
+            if (!i)
+                memcpy(dest, sector, 2352);
+        }
+        return 0;
+    }
+    for (i = 0; i < n; i++)
+    {
+        const ecc_uint8 *src = h->payload + i * in_size;
+        ecc_uint8 *user = sector + ((type >= 2) ? 0x018 : 0x010);
+        if ((type == 1) && !prefix)
+        {
+            memcpy(sector + 0x00C, src, 0x003);
+            src += 0x003;
+        }
+        else if (type >= 2)
+        {
+            memcpy(sector + 0x014, src, 0x004);
+            src += 0x004;
+        }
+        if (r->type & RECORD_ZERO)
+            memset(user, 0, data);
+        else
+            memcpy(user, src, data);
+        ecm_rebuild_record_sector(sector, r->type, header);
+        if (prefix)
+            ecm_msf_next(header);
+        /* Mode 2 output starts at the subheader, unless taken whole */
+        cache_put(h->cache, h, out_offset + i * out_size, sector + 2352 - out_size, out_size);
+        if (!i)
+            memcpy(dest, sector + 2352 - out_size, out_size);
+    }
+    return 0;
+}
+
+/*
+** ecm_pread, with the handle lock held
+*/
+static long index_read(ecm_handle *h, ecc_uint8 *p, size_t len, unsigned long long offset)
+{
+    size_t done = 0;
+    unsigned lo;
+    if (offset >= h->size)
+        return 0;
+    if (len > h->size - offset)
+        len = h->size - offset;
+    if (len > 0x7FFFFFFF)
+        len = 0x7FFFFFFF;
+    lo = index_find(h, offset);
+    while (done < len)
+    {
+        const struct index_record *r = &h->records[lo];
+        unsigned long long end = r->out_offset +
+                                 (unsigned long long)r->count * ecm_record_output(r->type);
+        unsigned long long at = offset + done;
+        size_t chunk;
+        if (at >= end)
+        {
+            lo++;
+            continue;
+        }
+        if (r->type == 0)
+        {
+            chunk = (end - at < len - done) ? end - at : len - done;
+            if (read_at(h->fd, p + done, chunk, r->in_offset + (at - r->out_offset)))
+                break;
+        }
+        else
+        {
+            unsigned size = ecm_record_output(r->type);
+            unsigned within = (at - r->out_offset) % size;
+            ecc_uint8 sector[2352];
+            if (cache_get(h->cache, h, at - within, sector, size) &&
+                index_rebuild(h, r, at - within, sector))
+                break;
+            chunk = size - within;
+            if (chunk > len - done)
+                chunk = len - done;
+            memcpy(p + done, sector + within, chunk);
+        }
+        done += chunk;
+    }
+    if (done < len)
+        return -1;
+    return done;
+}
+
+/*
+** Read up to len bytes of the decoded image at offset.  Returns the number
+** read, 0 at the end of the image, or -1 on an I/O error.  Safe to call from
+** several threads on the same handle.
+*/
+long ecm_pread(ecm_handle *h, void *buf, size_t len, unsigned long long offset)
+{
+    long n;
+    pthread_mutex_lock(&h->lock);
+    n = index_read(h, buf, len, offset);
+    pthread_mutex_unlock(&h->lock);
+    return n;
+}
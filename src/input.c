@@ -0,0 +1,281 @@
+/**************************************************************************/
+/*
+** Input source for the encoder and decoder.
+** Copyright (C) 2024 Jonathan Birge
+**
+***************************************************************************/
+/*
+** A regular file is mapped read-only, from its current offset to the end,
+** and the codecs read straight out of the mapping.  Anything that cannot be
+** mapped (pipes, terminals, empty files, or a failed mmap) is read ahead in
+** blocks by the background I/O layer (aio.c), or through stdio when that is
+** turned off.  The reading functions work the same in every case, and also
+** when the input turns out to be compressed and is read through a
+** decompressor (compress.c).
+**
+** A mapped file can also be asked where its holes are (ecm_input_hole), so
+** the encoder can take them as zeros without reading them.
+**
+***************************************************************************/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "ecm.h"
+#include "../config.h"
+
+#if defined(HAVE_SYS_MMAN_H) && defined(HAVE_MMAP)
+#define INPUT_HAVE_MMAP 1
+#include <sys/mman.h>
+#endif
+
+/*
+** Set up reading from file, mapping it when possible
+*/
+void ecm_input_open(struct ecm_input *in, FILE *file)
+{
+#ifdef INPUT_HAVE_MMAP
+    struct stat st;
+    off_t start;
+    void *map;
+#endif
+    memset(in, 0, sizeof(*in));
+    in->file = file;
+#ifdef INPUT_HAVE_MMAP
+    if (!fstat(fileno(file), &st) && S_ISREG(st.st_mode) && (st.st_size > 0) &&
+        ((unsigned long long)st.st_size <= (size_t)-1) &&
+        ((start = ftello(file)) >= 0) && (start < st.st_size))
+    {
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(file), 0);
+        if (map != MAP_FAILED)
+        {
+#ifdef HAVE_MADVISE
+            madvise(map, st.st_size, MADV_SEQUENTIAL);
+#endif
+            in->map = map;
+            in->map_length = st.st_size;
+            in->data = (const ecc_uint8 *)map + start;
+            in->size = st.st_size - start;
+            return;
+        }
+    }
+#endif
+    in->aio = ecm_aio_open(fileno(file), 0);
+}
+
+void ecm_input_close(struct ecm_input *in)
+{
+    if (in->codec)
+        ecm_codec_close_input(in->codec);
+#ifdef INPUT_HAVE_MMAP
+    if (in->map)
+        munmap(in->map, in->map_length);
+#endif
+    if (in->aio)
+        ecm_aio_close(in->aio);
+    in->map = NULL;
+    in->data = NULL;
+    in->aio = NULL;
+    in->codec = NULL;
+}
+
+/*
+** Move on to the next block read ahead or decompressed; returns 0 at end
+** of input
+*/
+static int input_next_block(struct ecm_input *in)
+{
+    if (in->codec)
+        in->block_length = ecm_codec_read(in->codec, &in->block);
+    else
+        in->block_length = ecm_aio_read(in->aio, &in->block);
+    in->block_pos = 0;
+    return in->block_length != 0;
+}
+
+/*
+** Next byte, or EOF
+*/
+int ecm_input_getc(struct ecm_input *in)
+{
+    if (in->data)
+    {
+        if (in->pos >= in->size)
+            return EOF;
+        return in->data[in->pos++];
+    }
+    if (!in->aio && !in->codec)
+    {
+        int c = fgetc(in->file);
+        if (c != EOF)
+            in->pos++;
+        return c;
+    }
+    if ((in->block_pos == in->block_length) && !input_next_block(in))
+        return EOF;
+    in->pos++;
+    return in->block[in->block_pos++];
+}
+
+/*
+** Read up to n bytes; returns the number read (less than n only at end of
+** input or on error)
+*/
+size_t ecm_input_read(struct ecm_input *in, void *dest, size_t n)
+{
+    ecc_uint8 *p = dest;
+    size_t done = 0;
+    if (in->data)
+    {
+        if (n > in->size - in->pos)
+            n = in->size - in->pos;
+        memcpy(dest, in->data + in->pos, n);
+        in->pos += n;
+        return n;
+    }
+    if (!in->aio && !in->codec)
+    {
+        done = fread(dest, 1, n, in->file);
+        in->pos += done;
+        return done;
+    }
+    while (done < n)
+    {
+        size_t chunk = in->block_length - in->block_pos;
+        if (!chunk)
+        {
+            if (!input_next_block(in))
+                break;
+            chunk = in->block_length;
+        }
+        if (chunk > n - done)
+            chunk = n - done;
+        memcpy(p + done, in->block + in->block_pos, chunk);
+        in->block_pos += chunk;
+        done += chunk;
+    }
+    in->pos += done;
+    return done;
+}
+
+/*
+** Consume up to n bytes without looking at them; returns the number skipped
+*/
+size_t ecm_input_skip(struct ecm_input *in, size_t n)
+{
+    ecc_uint8 scratch[4096];
+    size_t done = 0;
+    if (in->data)
+    {
+        if (n > in->size - in->pos)
+            n = in->size - in->pos;
+        in->pos += n;
+        return n;
+    }
+    while (done < n)
+    {
+        size_t chunk = (n - done < sizeof(scratch)) ? n - done : sizeof(scratch);
+        size_t got = ecm_input_read(in, scratch, chunk);
+        done += got;
+        if (got < chunk)
+            break;
+    }
+    return done;
+}
+
+/*
+** Consume n bytes and return where they are in the mapping, or NULL (and
+** consume nothing) if the input is not mapped or is shorter than that
+*/
+const ecc_uint8 *ecm_input_view(struct ecm_input *in, size_t n)
+{
+    const ecc_uint8 *p;
+    if (!in->data || (n > in->size - in->pos))
+        return NULL;
+    p = in->data + in->pos;
+    in->pos += n;
+    return p;
+}
+
+/*
+** Bytes consumed so far; for compressed input, bytes of the compressed file.
+** Counted as they go, so this is cheap enough to call for every sector.
+*/
+unsigned long ecm_input_tell(struct ecm_input *in)
+{
+    if (in->codec)
+        return ecm_codec_tell(in->codec);
+    return in->pos;
+}
+
+int ecm_input_error(struct ecm_input *in)
+{
+    if (in->data)
+        return 0;
+    if (in->codec)
+        return ecm_codec_error(in->codec);
+    if (in->aio)
+        return ecm_aio_error(in->aio) != 0;
+    return ferror(in->file);
+}
+
+/*
+** Called once the decoder has read everything it expects.  Compressed
+** input must then be at the end of its compressed stream, with no data
+** left over; returns nonzero if not.
+*/
+int ecm_input_finish(struct ecm_input *in)
+{
+    if (!in->codec)
+        return 0;
+    if (in->block_pos != in->block_length)
+        return 1;
+    return ecm_codec_finish(in->codec);
+}
+
+/*
+** The first hole in the mapped input at or after pos, as offsets from the
+** start of the input: [*start, *end), empty at the end of the input if
+** there is none.  Returns nonzero if the file system cannot say.
+*/
+int ecm_input_hole(
+    struct ecm_input *in,
+    unsigned long long pos,
+    unsigned long long *start,
+    unsigned long long *end)
+{
+#ifdef SEEK_HOLE
+    int fd;
+    off_t base, saved, hole, data;
+    if (!in->map || in->codec)
+        return -1;
+    fd = fileno(in->file);
+    base = in->data - (const ecc_uint8 *)in->map;
+    saved = lseek(fd, 0, SEEK_CUR);
+    hole = lseek(fd, base + pos, SEEK_HOLE);
+    data = (hole < 0) ? -1 : lseek(fd, hole, SEEK_DATA);
+    if ((data < 0) && (errno == ENXIO))
+        data = base + in->size;
+    if (saved >= 0)
+        lseek(fd, saved, SEEK_SET);
+    if ((hole < 0) || (data < 0))
+        return -1;
+    *start = hole - base;
+    *end = data - base;
+    if (*start > in->size)
+        *start = in->size;
+    if (*end > in->size)
+        *end = in->size;
+    return 0;
+#else
+    (void)in;
+    (void)pos;
+    (void)start;
+    (void)end;
+    return -1;
+#endif
+}
@@ -0,0 +1,545 @@
+/**************************************************************************/
+/*
+** kernbench - microbenchmarks and differential checks for the kernels.
+** Copyright (C) 2024 Jonathan Birge
+**
+***************************************************************************/
+/*
+** Times each of the inner kernels, under every implementation tier this
+** CPU can run:
+**
+**   edc            ecm_edc_partial_computeblock over a Mode 1 EDC span
+**   ecc_encode     ecm_ecc_computeblock_encode, P and Q, as the encoder checks
+**   ecc_decode     ecm_ecc_computeblock_decode, P and Q, as the decoder rebuilds
+**   ecm_check_type     the staged classifier, and the reference one
+**   ecm_write_type_count  record headers into a memory sink
+**
+** "hot" runs repeat on a few sectors that stay in L1; "cold" runs visit the
+** sectors of a buffer much larger than the last-level cache in random
+** order.  Times are reported per call and as TSC cycles per byte (ns where
+** there is no TSC), the best of several passes.
+**
+** With --check, each optimized tier is instead compared with the scalar
+** reference on random sectors and on adversarial ones: all-0x00/0xFF,
+** valid sectors of each type, and valid ones with single bits flipped in
+** the header, data, EDC and P/Q parity, at every buffer alignment.
+**
+** Usage: kernbench [--check] [--rounds=N] [--json=FILE]
+**
+***************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "ecm.h"
+#include "../config.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define KERN_HAVE_TSC 1
+#include <x86intrin.h>
+#endif
+
+#define SECTOR_SIZE 2352
+#define HOT_SECTORS 4
+#define COLD_BYTES (128 * 1048576)
+#define PASSES 5
+
+static ecc_uint32 seed = 0x31415926;
+
+struct timing
+{
+    double ns;
+    double cycles;
+};
+
+/***************************************************************************/
+
+static ecc_uint32 rnd(void)
+{
+    seed = seed * 1103515245 + 12345;
+    return seed >> 8;
+}
+
+static double now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static double cycles_now(void)
+{
+#ifdef KERN_HAVE_TSC
+    return (double)__rdtsc();
+#else
+    return 0;
+#endif
+}
+
+/*
+** A valid sector of type 1-3 (or random bytes for type 0) into raw, which
+** has room for 0x10 bytes more than a sector.  Returns where the sector
+** starts as the encoder sees it: raw for Mode 1, raw + 0x10 for Mode 2.
+*/
+static ecc_uint8 *make_sector(ecc_uint8 *raw, int type)
+{
+    size_t i;
+    for (i = 0; i < SECTOR_SIZE + 0x10; i++)
+        raw[i] = rnd();
+    if (!type)
+        return raw;
+    raw[0x00] = 0x00;
+    memset(raw + 0x01, 0xFF, 10);
+    raw[0x0B] = 0x00;
+    raw[0x0F] = (type == 1) ? 1 : 2;
+    if (type != 1)
+    {
+        raw[0x12] = (type == 3) ? 0x20 : 0x08;
+        memcpy(raw + 0x14, raw + 0x10, 4);
+    }
+    ecm_eccedc_generate_decode(raw, type);
+    return (type == 1) ? raw : raw + 0x10;
+}
+
+/***************************************************************************/
+/*
+** Kernels under test; each call handles the sector at s and returns
+** something derived from the result so that it cannot be optimized away
+*/
+
+static ecc_uint32 kern_edc(ecc_uint8 *s)
+{
+    return ecm_edc_partial_computeblock(0, s, 0x810);
+}
+
+static ecc_uint32 kern_ecc_encode(ecc_uint8 *s)
+{
+    return ecm_ecc_computeblock_encode(s + 0xC, 86, 24, 2, 86, s + 0x81C) +
+           ecm_ecc_computeblock_encode(s + 0xC, 52, 43, 86, 88, s + 0x8C8);
+}
+
+static ecc_uint32 kern_ecc_decode(ecc_uint8 *s)
+{
+    static ecc_uint8 parity[2 * 86 + 2 * 52];
+    ecm_ecc_computeblock_decode(s + 0xC, 86, 24, 2, 86, parity);
+    ecm_ecc_computeblock_decode(s + 0xC, 52, 43, 86, 88, parity + 2 * 86);
+    return parity[0];
+}
+
+static ecc_uint32 kern_check_type(ecc_uint8 *s)
+{
+    return ecm_check_type(s, 1);
+}
+
+static ecc_uint32 kern_check_type_reference(ecc_uint8 *s)
+{
+    return ecm_check_type_reference(s, 1);
+}
+
+static struct ecm_output type_sink;
+
+static ecc_uint32 kern_write_type_count(ecc_uint8 *s)
+{
+    /* A spread of record lengths, from the bytes of the sector */
+    unsigned i, n = 0;
+    for (i = 0; i < 32; i++)
+        n += ecm_write_type_count(&type_sink, s[i] & 3, 1 + ((ecc_uint32)s[32 + i] << (s[64 + i] & 23)));
+    type_sink.fill = 0;
+    return n;
+}
+
+struct kernel
+{
+    const char *name;
+    ecc_uint32 (*fn)(ecc_uint8 *s);
+    unsigned bytes;  /* Input bytes one call covers */
+    int tiers;       /* Which tier setting applies */
+};
+
+#define TIERS_NONE 0
+#define TIERS_EDC 1
+#define TIERS_ECC 2
+#define TIERS_ALL 3
+
+static const struct kernel kernels[] = {
+    {"edc", kern_edc, 0x810, TIERS_EDC},
+    {"ecc_encode", kern_ecc_encode, 86 * 24 + 52 * 43, TIERS_ECC},
+    {"ecc_decode", kern_ecc_decode, 86 * 24 + 52 * 43, TIERS_ECC},
+    {"check_type", kern_check_type, SECTOR_SIZE, TIERS_ALL},
+    {"check_type_ref", kern_check_type_reference, SECTOR_SIZE, TIERS_ALL},
+    {"write_type_count", kern_write_type_count, 32, TIERS_NONE},
+};
+
+/***************************************************************************/
+
+static ecc_uint8 *arena;
+static size_t arena_sectors;
+static size_t *order;
+static volatile ecc_uint32 sink;
+
+/*
+** Fill the arena with a mix of valid sectors, so the classifier does the
+** work it does on real images, and shuffle the order the cold runs visit
+*/
+static int arena_init(void)
+{
+    ecc_uint8 raw[SECTOR_SIZE + 0x10];
+    size_t i;
+    arena_sectors = COLD_BYTES / SECTOR_SIZE;
+    arena = malloc(arena_sectors * SECTOR_SIZE + 0x10);
+    order = malloc(arena_sectors * sizeof(*order));
+    if (!arena || !order)
+        return -1;
+    for (i = 0; i < arena_sectors; i++)
+    {
+        ecc_uint8 *s = make_sector(raw, 1 + (i % 4) % 3);
+        memcpy(arena + i * SECTOR_SIZE, s, SECTOR_SIZE);
+        order[i] = i;
+    }
+    for (i = arena_sectors - 1; i > 0; i--)
+    {
+        size_t j = rnd() % (i + 1);
+        size_t t = order[i];
+        order[i] = order[j];
+        order[j] = t;
+    }
+    return 0;
+}
+
+/*
+** Time calls of k, hot or cold; returns the best pass, per call
+*/
+static struct timing time_kernel(const struct kernel *k, int cold)
+{
+    struct timing best = {0, 0};
+    size_t calls = cold ? arena_sectors : 20000;
+    int pass;
+    for (pass = 0; pass < PASSES; pass++)
+    {
+        double t0, c0, t, c;
+        ecc_uint32 acc = 0;
+        size_t i;
+        t0 = now_ns();
+        c0 = cycles_now();
+        if (cold)
+            for (i = 0; i < calls; i++)
+                acc += k->fn(arena + order[i] * SECTOR_SIZE);
+        else
+            for (i = 0; i < calls; i++)
+                acc += k->fn(arena + (i % HOT_SECTORS) * SECTOR_SIZE);
+        c = (cycles_now() - c0) / calls;
+        t = (now_ns() - t0) / calls;
+        sink += acc;
+        if (!pass || (t < best.ns))
+        {
+            best.ns = t;
+            best.cycles = c;
+        }
+    }
+    return best;
+}
+
+/*
+** Set every dispatcher to tier, or as near below it as the CPU allows
+*/
+static void set_tiers(int edc, int ecc)
+{
+    while (ecm_edc_set_tier(edc))
+        edc--;
+    while (ecm_ecc_set_tier(ecc))
+        ecc--;
+}
+
+static int bench(const char *json)
+{
+    FILE *f = NULL;
+    size_t k;
+    int first = 1;
+    if (arena_init())
+    {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+    if (ecm_output_open_memory(&type_sink, 65536))
+        return 1;
+    if (json)
+    {
+        f = fopen(json, "w");
+        if (!f)
+        {
+            perror(json);
+            return 1;
+        }
+        fprintf(f, "{\n  \"version\": \"%s\",\n  \"unit\": \"%s\",\n  \"results\": [\n",
+                VERSION, cycles_now() ? "tsc_cycles" : "ns");
+    }
+    printf("%-18s %-8s %-5s %10s %10s %11s\n",
+           "kernel", "tier", "cache", "ns/call", "cyc/call", "cyc/byte");
+    for (k = 0; k < sizeof(kernels) / sizeof(kernels[0]); k++)
+    {
+        const struct kernel *kern = &kernels[k];
+        int tier, cold;
+        for (tier = 0; tier < 3; tier++)
+        {
+            const char *name;
+            if (kern->tiers == TIERS_NONE)
+            {
+                if (tier)
+                    break;
+                name = "-";
+            }
+            else if (kern->tiers == TIERS_EDC)
+            {
+                if (ecm_edc_set_tier(tier))
+                    continue;
+                name = ecm_edc_tier_name();
+            }
+            else
+            {
+                if (ecm_ecc_set_tier(tier))
+                    continue;
+                /* The classifier gets scalar EDC with scalar ECC, else the fastest */
+                if (kern->tiers == TIERS_ALL)
+                    set_tiers(tier ? EDC_TIER_COUNT - 1 : EDC_TIER_SCALAR, tier);
+                name = ecm_ecc_tier_name();
+            }
+            for (cold = 0; cold < 2; cold++)
+            {
+                struct timing t = time_kernel(kern, cold);
+                double per_byte = (t.cycles ? t.cycles : t.ns) / kern->bytes;
+                printf("%-18s %-8s %-5s %10.1f %10.0f %11.3f\n",
+                       kern->name, name, cold ? "cold" : "hot", t.ns, t.cycles, per_byte);
+                if (f)
+                {
+                    fprintf(f, "%s    {\"kernel\": \"%s\", \"tier\": \"%s\", \"cache\": \"%s\", "
+                               "\"ns_per_call\": %.2f, \"cycles_per_call\": %.0f, \"per_byte\": %.4f}",
+                            first ? "" : ",\n", kern->name, name, cold ? "cold" : "hot",
+                            t.ns, t.cycles, per_byte);
+                    first = 0;
+                }
+            }
+        }
+        set_tiers(EDC_TIER_COUNT - 1, ECC_TIER_COUNT - 1);
+    }
+    ecm_output_close(&type_sink);
+    if (f)
+    {
+        fprintf(f, "\n  ]\n}\n");
+        if (fclose(f))
+        {
+            perror(json);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/***************************************************************************/
+/*
+** Differential checks
+*/
+
+static int errors;
+
+static void mismatch(const char *what, const char *tier, unsigned round, unsigned detail)
+{
+    if (errors < 16)
+        fprintf(stderr, "%s %s mismatch: round %u (%u)\n", what, tier, round, detail);
+    errors++;
+}
+
+/*
+** An adversarial or random sector for round into raw; returns where it
+** starts and its candidate type for the classifier
+*/
+static ecc_uint8 *pick_sector(ecc_uint8 *raw, unsigned round, int *canbetype1)
+{
+    static const unsigned flips[] = {
+        0x00F, 0x012, 0x016, 0x100, 0x80F, 0x810, 0x813, 0x81C, 0x8C7, 0x8C8, 0x92F};
+    ecc_uint8 *s;
+    int kind = round % 8;
+    *canbetype1 = (round / 8) & 1;
+    switch (kind)
+    {
+    case 0:
+        memset(raw, 0x00, SECTOR_SIZE + 0x10);
+        return raw;
+    case 1:
+        memset(raw, 0xFF, SECTOR_SIZE + 0x10);
+        return raw;
+    case 2:
+        return make_sector(raw, 0);
+    case 3:
+        /* Sync followed by junk, with an out-of-range mode */
+        s = make_sector(raw, 0);
+        s[0] = 0;
+        memset(s + 1, 0xFF, 10);
+        s[11] = 0;
+        s[15] = rnd() % 4 ? 3 : 0;
+        return s;
+    default:
+    {
+        int type = 1 + (kind - 4) % 3;
+        s = make_sector(raw, type);
+        /* Mode 2 with a zero address takes the other ECC path */
+        if ((type == 2) && (round & 16))
+        {
+            memset(raw + 0xC, 0, 4);
+            ecm_eccedc_generate_decode(raw, type);
+        }
+        if (kind == 7)
+        {
+            unsigned at = flips[(round / 8) % (sizeof(flips) / sizeof(flips[0]))];
+            if (at >= SECTOR_SIZE)
+                at = SECTOR_SIZE - 1;
+            raw[at] ^= 1 << (round % 8);
+        }
+        return s;
+    }
+    }
+}
+
+static int check(unsigned rounds)
+{
+    static ecc_uint8 buf[SECTOR_SIZE + 0x10 + 32];
+    static ecc_uint8 raw[SECTOR_SIZE + 0x10];
+    ecc_uint8 ref[2 * 86], got[2 * 86];
+    unsigned round, tier, align;
+    int edc, ecc;
+    errors = 0;
+    for (round = 0; round < rounds; round++)
+    {
+        int canbetype1, reference;
+        ecc_uint8 *s = pick_sector(raw, round, &canbetype1);
+        size_t offset = s - raw;
+        /* Every alignment of the buffer, to catch unaligned vector loads */
+        align = round % 32;
+        memcpy(buf + align, raw, sizeof(raw));
+        s = buf + align + offset;
+        /* EDC, at a spread of lengths and starting values */
+        for (tier = EDC_TIER_SLICE16; !ecm_edc_set_tier(tier); tier++)
+        {
+            static const unsigned lengths[] = {0, 1, 15, 16, 17, 63, 64, 0x808, 0x810, 0x91C, SECTOR_SIZE};
+            unsigned l;
+            for (l = 0; l < sizeof(lengths) / sizeof(lengths[0]); l++)
+            {
+                unsigned n = lengths[l];
+                ecc_uint32 init = (round & 1) ? rnd() : 0;
+                if (n > SECTOR_SIZE - offset)
+                    n = SECTOR_SIZE - offset;
+                if (ecm_edc_partial_computeblock(init, s, n) != ecm_edc_computeblock_scalar(init, s, n))
+                    mismatch("edc", ecm_edc_tier_name(), round, n);
+            }
+        }
+        /* ECC, both directions, against the reference loop */
+        ecm_ecc_computeblock_scalar(buf + align + 0xC, 86, 24, 2, 86, ref);
+        for (tier = ECC_TIER_SCALAR; !ecm_ecc_set_tier(tier); tier++)
+        {
+            ecc_uint8 *src = buf + align + 0xC;
+            ecm_ecc_computeblock_decode(src, 86, 24, 2, 86, got);
+            if (memcmp(ref, got, 2 * 86))
+                mismatch("ecc_decode P", ecm_ecc_tier_name(), round, 0);
+            if (ecm_ecc_computeblock_encode(src, 86, 24, 2, 86, buf + align + 0x81C) !=
+                !memcmp(ref, buf + align + 0x81C, 2 * 86))
+                mismatch("ecc_encode P", ecm_ecc_tier_name(), round, 0);
+        }
+        ecm_ecc_computeblock_scalar(buf + align + 0xC, 52, 43, 86, 88, ref);
+        for (tier = ECC_TIER_SCALAR; !ecm_ecc_set_tier(tier); tier++)
+        {
+            ecc_uint8 *src = buf + align + 0xC;
+            ecm_ecc_computeblock_decode(src, 52, 43, 86, 88, got);
+            if (memcmp(ref, got, 2 * 52))
+                mismatch("ecc_decode Q", ecm_ecc_tier_name(), round, 0);
+            if (ecm_ecc_computeblock_encode(src, 52, 43, 86, 88, buf + align + 0x8C8) !=
+                !memcmp(ref, buf + align + 0x8C8, 2 * 52))
+                mismatch("ecc_encode Q", ecm_ecc_tier_name(), round, 0);
+        }
+        /* The classifier under every combination of tiers */
+        set_tiers(EDC_TIER_SCALAR, ECC_TIER_SCALAR);
+        reference = ecm_check_type_reference(s, canbetype1);
+        for (edc = EDC_TIER_SCALAR; !ecm_edc_set_tier(edc); edc++)
+            for (ecc = ECC_TIER_SCALAR; !ecm_ecc_set_tier(ecc); ecc++)
+            {
+                int got_type = ecm_check_type(s, canbetype1);
+                if (got_type != reference)
+                    mismatch("check_type", ecm_ecc_tier_name(), round, got_type);
+                if (ecm_check_type_reference(s, canbetype1) != reference)
+                    mismatch("check_type_ref", ecm_ecc_tier_name(), round, edc);
+            }
+        set_tiers(EDC_TIER_COUNT - 1, ECC_TIER_COUNT - 1);
+    }
+    fprintf(stderr, "EDC/ECC/classifier  %s\n", errors ? "FAILED" : "ok");
+    return errors;
+}
+
+/*
+** Record headers read back as written, at every length boundary
+*/
+static int check_type_count(void)
+{
+    struct ecm_output out;
+    struct ecm_input in;
+    unsigned type, bit, delta, n, got_type, got_count;
+    int failed = 0;
+    if (ecm_output_open_memory(&out, 65536))
+        return 1;
+    for (type = 0; type < 4; type++)
+        for (bit = 0; bit < 31; bit++)
+            for (delta = 0; delta < 3; delta++)
+            {
+                n = (1u << bit) - 1 + delta;
+                if (n && (n < 0x80000000))
+                    ecm_write_type_count(&out, type, n);
+            }
+    ecm_write_type_count(&out, 0, 0);
+    memset(&in, 0, sizeof(in));
+    in.data = out.block;
+    in.size = out.fill;
+    for (type = 0; type < 4; type++)
+        for (bit = 0; bit < 31; bit++)
+            for (delta = 0; delta < 3; delta++)
+            {
+                n = (1u << bit) - 1 + delta;
+                if (!n || (n >= 0x80000000))
+                    continue;
+                if ((ecm_read_type_count(&in, &got_type, &got_count) != DECODE_OK) ||
+                    (got_type != type) || (got_count != n))
+                {
+                    if (!failed)
+                        fprintf(stderr, "write_type_count mismatch: type %u count %u\n", type, n);
+                    failed = 1;
+                }
+            }
+    if (ecm_read_type_count(&in, &got_type, &got_count) != DECODE_END)
+        failed = 1;
+    fprintf(stderr, "write_type_count    %s\n", failed ? "FAILED" : "ok");
+    ecm_output_close(&out);
+    return failed;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *json = NULL;
+    unsigned rounds = 4000;
+    int do_check = 0;
+    int i;
+    for (i = 1; i < argc; i++)
+    {
+        if (!strcmp(argv[i], "--check"))
+            do_check = 1;
+        else if (!strncmp(argv[i], "--rounds=", 9))
+            rounds = strtoul(argv[i] + 9, NULL, 0);
+        else if (!strncmp(argv[i], "--json=", 7))
+            json = argv[i] + 7;
+        else
+        {
+            fprintf(stderr, "Usage: %s [--check] [--rounds=N] [--json=FILE]\n", argv[0]);
+            return 1;
+        }
+    }
+    ecm_eccedc_init();
+    if (do_check)
+        return (check(rounds) | check_type_count()) ? 1 : 0;
+    return bench(json);
+}
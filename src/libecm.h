@@ -0,0 +1,71 @@
+#ifndef LIBECM_H
+#define LIBECM_H
+
+/*
+** libecm - ECM (Error Code Modeler) encoding and decoding as a library.
+**
+** Streams work like zlib's: point next_in/avail_in at input and
+** next_out/avail_out at room for output, then call ecm_encode or ecm_decode
+** until it returns ECM_STREAM_END.  Each call goes as far as the buffers
+** allow and updates the pointers, counts and totals.  Pass ECM_FINISH once
+** all input has been given.
+**
+** ecm_encode writes the original format.  ecm_decode reads both it and the
+** v2 block container (ecm --v2), checking each block as it goes and holding
+** one decoded block at a time.
+**
+** A stream allocates everything it needs when it is set up (a decoder, its
+** block buffers once a v2 header says how big blocks are) and never calls
+** exit.  Different streams may be used from different threads at the same
+** time; one stream must not be used by two threads at once.
+**
+** Every symbol the library defines starts with ecm_, so it can be linked
+** into a program that has names of its own.
+*/
+
+#include <stddef.h>
+#include <stdio.h>
+
+typedef struct ecm_stream
+{
+    const unsigned char *next_in;
+    size_t avail_in;
+    unsigned long long total_in;
+    unsigned char *next_out;
+    size_t avail_out;
+    unsigned long long total_out;
+    const char *msg;  /* Reason for the last error, or NULL */
+    void *state;
+} ecm_stream;
+
+/* Flush values */
+#define ECM_RUN 0
+#define ECM_FINISH 1
+
+/* Return values */
+#define ECM_STREAM_OK 0
+#define ECM_STREAM_END 1
+#define ECM_STREAM_ERROR (-1)
+#define ECM_STREAM_MEMORY (-2)
+
+int ecm_encode_init(ecm_stream *strm);
+int ecm_encode(ecm_stream *strm, int flush);
+void ecm_encode_end(ecm_stream *strm);
+int ecm_decode_init(ecm_stream *strm);
+int ecm_decode(ecm_stream *strm, int flush);
+void ecm_decode_end(ecm_stream *strm);
+
+/* Random access to the decoded image of an ECM file */
+typedef struct ecm_handle ecm_handle;
+typedef struct ecm_cache ecm_cache;
+
+ecm_handle *ecm_open(const char *path);
+int ecm_index_write(ecm_handle *h, FILE *out);
+unsigned long long ecm_size(ecm_handle *h);
+long ecm_pread(ecm_handle *h, void *buf, size_t len, unsigned long long offset);
+void ecm_close(ecm_handle *h);
+ecm_cache *ecm_cache_create(size_t bytes);
+void ecm_cache_destroy(ecm_cache *cache);
+int ecm_set_cache(ecm_handle *h, ecm_cache *cache, unsigned readahead);
+
+#endif /* LIBECM_H */
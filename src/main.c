@@ -8,7 +8,105 @@
 
 void print_usage(const char *prog_name)
 {
-    fprintf(stderr, "Usage: %s [--decode|-d] [--output|-o outputfile] [--verbose|-v] [--help|-h] [inputfile]\n", prog_name);
+    fprintf(stderr, "Usage: %s [--decode|-d] [--output|-o outputfile] [--verbose|-v] [--threads|-T n] [--io=auto|sync|thread|uring] [--compress=zstd|xz[:level]] [--v2[=sectors]] [--dedup] [--cue cuesheet] [--stats[=text|json]] [--index] [--range=offset[:length]] [--selftest] [--help|-h] [inputfile]\n"
+                    "       %s [--decode|-d] [--recursive|-r] [--jobs|-j n] [--force|-f] [other options] file|directory...\n", prog_name, prog_name);
+}
+
+/*
+** --index writes the sidecar index of an ECM file; --range decodes part of
+** one through the random-access reader
+*/
+static int random_access(
+    const char *prog_name,
+    const char *input_filename,
+    const char *output_filename,
+    FILE *output,
+    const char *range,
+    int verbose)
+{
+    static ecc_uint8 buf[65536];
+    unsigned long long offset = 0, length = 0;
+    ecm_handle *h;
+    char *end;
+    int error = 0;
+    if (!input_filename)
+    {
+        fprintf(stderr, "%s: --index and --range need an input file\n", prog_name);
+        return 1;
+    }
+    if (range)
+    {
+        offset = strtoull(range, &end, 0);
+        length = ~0ULL;
+        if (*end == ':')
+            length = strtoull(end + 1, &end, 0);
+        if ((end == range) || *end)
+        {
+            fprintf(stderr, "%s: invalid range '%s'\n", prog_name, range);
+            return 1;
+        }
+    }
+    h = ecm_open(input_filename);
+    if (!h)
+    {
+        fprintf(stderr, "%s: cannot index '%s'\n", prog_name, input_filename);
+        return 1;
+    }
+    if (range && (offset >= ecm_size(h)))
+    {
+        fprintf(stderr, "%s: range '%s' starts past the end (%llu bytes)\n",
+                prog_name, range, ecm_size(h));
+        ecm_close(h);
+        return 1;
+    }
+    if (!range)
+    {
+        FILE *sidecar = output;
+        if (!output_filename)
+        {
+            char *name = malloc(strlen(input_filename) + 5);
+            if (name)
+            {
+                sprintf(name, "%s.idx", input_filename);
+                sidecar = fopen(name, "wb");
+                if (!sidecar)
+                    perror("fopen");
+                free(name);
+            }
+            else
+            {
+                fprintf(stderr, "%s: out of memory\n", prog_name);
+                sidecar = NULL;
+            }
+        }
+        error = !sidecar || ecm_index_write(h, sidecar);
+        if (sidecar && (sidecar != output))
+            error |= fclose(sidecar) != 0;
+        if (verbose)
+            fprintf(stderr, "Indexed %llu bytes\n", ecm_size(h));
+    }
+    while (range && length)
+    {
+        long got = ecm_pread(h, buf, (length < sizeof(buf)) ? length : sizeof(buf), offset);
+        if (got <= 0)
+        {
+            error = got < 0;
+            break;
+        }
+        if (fwrite(buf, 1, got, output) != (size_t)got)
+        {
+            error = 1;
+            break;
+        }
+        offset += got;
+        length -= got;
+    }
+    if (range && fflush(output))
+        error = 1;
+    ecm_close(h);
+    if (error)
+        fprintf(stderr, "%s: I/O error\n", prog_name);
+    return error;
 }
 
 int main(int argc, char *argv[])
@@ -17,7 +115,18 @@ int main(int argc, char *argv[])
     FILE *output = stdout;
     int decode = 0;
     int verbose = 0;
+    int selftest = 0;
+    int threads = 1;
     char *input_filename = NULL;
+    char *output_filename = NULL;
+    int make_index = 0;
+    char *range = NULL;
+    int recursive = 0;
+    int force = 0;
+    int jobs = 0;
+    char *cue = NULL;
+    int v2 = 0;
+    int dedup = 0;
     int exit_code;
 
     char *prog_name = strrchr(argv[0], '/');
@@ -31,13 +140,26 @@ int main(int argc, char *argv[])
         {"decode", no_argument, 0, 'd'},
         {"output", required_argument, 0, 'o'},
         {"verbose", no_argument, 0, 'v'},
+        {"threads", required_argument, 0, 'T'},
         {"help", no_argument, 0, 'h'},
         {"version", no_argument, 0, 'V'},
+        {"selftest", no_argument, 0, 'S'},
+        {"io", required_argument, 0, 'I'},
+        {"index", no_argument, 0, 'X'},
+        {"range", required_argument, 0, 'R'},
+        {"compress", required_argument, 0, 'C'},
+        {"recursive", no_argument, 0, 'r'},
+        {"jobs", required_argument, 0, 'j'},
+        {"force", no_argument, 0, 'f'},
+        {"stats", optional_argument, 0, 'P'},
+        {"v2", optional_argument, 0, '2'},
+        {"cue", required_argument, 0, 'c'},
+        {"dedup", no_argument, 0, 'D'},
         {0, 0, 0, 0}};
 
     int opt;
     int option_index = 0;
-    while ((opt = getopt_long(argc, argv, "dvo:hV", long_options, &option_index)) != -1)
+    while ((opt = getopt_long(argc, argv, "dvo:T:j:rfhV", long_options, &option_index)) != -1)
     {
         switch (opt)
         {
@@ -45,6 +167,7 @@ int main(int argc, char *argv[])
             decode = 1;
             break;
         case 'o':
+            output_filename = optarg;
             output = fopen(optarg, "w");
             if (output == NULL)
             {
@@ -55,6 +178,72 @@ int main(int argc, char *argv[])
         case 'v':
             verbose = 1;
             break;
+        case 'T':
+            threads = atoi(optarg);
+            if (threads < 1)
+            {
+                fprintf(stderr, "%s: invalid thread count '%s'\n", prog_name, optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'j':
+            jobs = atoi(optarg);
+            if (jobs < 1)
+            {
+                fprintf(stderr, "%s: invalid job count '%s'\n", prog_name, optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'r':
+            recursive = 1;
+            break;
+        case 'f':
+            force = 1;
+            break;
+        case 'S':
+            selftest = 1;
+            break;
+        case 'I':
+            if (ecm_aio_select(optarg))
+            {
+                fprintf(stderr, "%s: unknown or unsupported I/O backend '%s'\n", prog_name, optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'C':
+            if (ecm_codec_select(optarg))
+            {
+                fprintf(stderr, "%s: unknown or unsupported compression '%s'\n", prog_name, optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case '2':
+            if (ecm_v2_select(optarg))
+            {
+                fprintf(stderr, "%s: invalid block size '%s'\n", prog_name, optarg);
+                exit(EXIT_FAILURE);
+            }
+            v2 = 1;
+            break;
+        case 'D':
+            dedup = 1;
+            break;
+        case 'P':
+            if (ecm_stats_select(optarg))
+            {
+                fprintf(stderr, "%s: unknown stats format '%s'\n", prog_name, optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'c':
+            cue = optarg;
+            break;
+        case 'X':
+            make_index = 1;
+            break;
+        case 'R':
+            range = optarg;
+            break;
         case 'V':
             printf("%s %s\n", prog_name, VERSION);
             exit(EXIT_SUCCESS);
@@ -65,9 +254,55 @@ int main(int argc, char *argv[])
         }
     }
 
-    if (optind < argc)
+    /* Copy records only exist in the v2 container */
+    if (dedup)
+    {
+        if (!v2 || decode)
+        {
+            fprintf(stderr, "%s: --dedup only applies when encoding with --v2\n", prog_name);
+            exit(EXIT_FAILURE);
+        }
+        ecm_dedup_select();
+    }
+
+    /* Several inputs, or -r or -j, convert files to files beside them */
+    if ((argc - optind > 1) || recursive || jobs)
     {
+        struct batch_options opt;
+        if (output_filename || make_index || range || cue || (optind == argc))
+        {
+            fprintf(stderr, "%s: batch mode takes files or directories, and no --output, --index, --range or --cue\n", prog_name);
+            exit(EXIT_FAILURE);
+        }
+        ecm_eccedc_init();
+        opt.prog_name = prog_name;
+        opt.decode = decode;
+        opt.recursive = recursive;
+        opt.force = force;
+        opt.verbose = verbose;
+        opt.jobs = jobs ? jobs : 1;
+        opt.threads = threads;
+        return batch_run(&opt, argv + optind, argc - optind) ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+
+    if (optind < argc)
         input_filename = argv[optind];
+
+    /* The cue sheet describes the image, and may be all that names it */
+    if (cue)
+    {
+        const char *error = (decode || make_index || range)
+                                ? "a cue sheet only applies when encoding"
+                                : ecm_cue_select(cue, &input_filename);
+        if (error)
+        {
+            fprintf(stderr, "%s: %s: %s\n", prog_name, cue, error);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (input_filename)
+    {
         input = fopen(input_filename, "r");
         if (input == NULL)
         {
@@ -76,15 +311,32 @@ int main(int argc, char *argv[])
         }
     }
 
-    eccedc_init();
+    ecm_eccedc_init();
 
-    if (decode)
+    if (selftest)
+    {
+        if (verbose)
+        {
+            fprintf(stderr, "EDC implementation: %s\n", ecm_edc_tier_name());
+            fprintf(stderr, "ECC implementation: %s\n", ecm_ecc_tier_name());
+            fprintf(stderr, "Scan implementation: %s\n", ecm_scan_tier_name());
+        }
+        exit((ecm_edc_selftest(1) | ecm_ecc_selftest(1) | ecm_scan_selftest(1) |
+              ecm_classify_selftest(1)) ? EXIT_FAILURE : EXIT_SUCCESS);
+    }
+
+    if (make_index || range)
+    {
+        exit_code = random_access(prog_name, input_filename, output_filename,
+                                  output, range, verbose);
+    }
+    else if (decode)
     {
-        exit_code = decode_file(input, output, verbose);
+        exit_code = ecm_decode_file(input, output, verbose, threads);
     }
     else
     {
-        exit_code = encode_file(input, output, verbose);
+        exit_code = ecm_encode_file(input, output, verbose, threads);
     }
 
     if (input != stdin)
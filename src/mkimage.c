@@ -0,0 +1,312 @@
+/**************************************************************************/
+/*
+** mkimage - synthetic CD images for benchmarking.
+** Copyright (C) 2024 Jonathan Birge
+**
+***************************************************************************/
+/*
+** Writes a raw 2352-byte-sector image of one class to standard output.
+** Sectors carry proper sync, BCD addresses and subheaders, and their EDC
+** and ECC come from the decoder's own generator, so the encoder sees them
+** exactly as it would sectors ripped from a disc.  The contents are made
+** from a fixed seed, so an image is the same on every run and machine.
+**
+** Classes:
+**
+**   mode1       Mode 1 data sectors
+**   mode2form1  Mode 2 XA form 1 sectors
+**   mode2form2  Mode 2 XA form 2 sectors (video/audio streams)
+**   audio       CD-DA audio, no sector structure at all
+**   zero        Mode 1 sectors with empty user data, as in gaps
+**   junk        Mode 1 sectors knocked out of alignment by stray bytes
+**   mode0       Mode 0 sectors, all zeros, as in some lead-ins and gaps
+**   form2noedc  Mode 2 XA form 2 sectors with the EDC left zero
+**   formless    Mode 2 sectors without XA subheaders or EDC
+**   repeat      Mode 1 sectors all holding the same user data
+**   mixed       a data track of all the above followed by audio tracks
+**
+** Usage: mkimage [-n sectors] [-s seed] class > image.bin
+**
+***************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include "ecm.h"
+
+#define SECTOR_SIZE 2352
+
+/* Sector kinds */
+#define KIND_MODE1 0
+#define KIND_FORM1 1
+#define KIND_FORM2 2
+#define KIND_AUDIO 3
+#define KIND_ZERO 4
+#define KIND_JUNK 5
+#define KIND_MODE0 6
+#define KIND_NOEDC 7
+#define KIND_FORMLESS 8
+#define KIND_REPEAT 9
+
+static const char *classes[] = {
+    "mode1", "mode2form1", "mode2form2", "audio", "zero", "junk",
+    "mode0", "form2noedc", "formless", "repeat", "mixed", NULL};
+
+static ecc_uint32 seed = 1;
+static unsigned long lba;
+static unsigned long audio_phase;
+
+/***************************************************************************/
+
+static ecc_uint32 rnd(void)
+{
+    /* xorshift32 */
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+    return seed;
+}
+
+static const char *words[] = {
+    "the ", "disc ", "track ", "sector ", "data ", "file ", "level ",
+    "sound ", "\r\n", "image ", "SYSTEM.CNF", "BOOT ", "0000 ", "game "};
+
+/*
+** User data that looks like a mix of what discs hold: incompressible
+** (already compressed) data, text, tables and mostly-empty structures
+*/
+static void fill_data(ecc_uint8 *p, size_t n)
+{
+    size_t i = 0;
+    switch (rnd() % 4)
+    {
+    case 0:
+        for (i = 0; i < n; i++)
+            p[i] = rnd() >> 24;
+        break;
+    case 1:
+        while (i < n)
+        {
+            const char *w = words[rnd() % (sizeof(words) / sizeof(words[0]))];
+            while (*w && (i < n))
+                p[i++] = *w++;
+        }
+        break;
+    case 2:
+    {
+        ecc_uint8 pattern[16];
+        for (i = 0; i < sizeof(pattern); i++)
+            pattern[i] = rnd() >> 24;
+        for (i = 0; i < n; i++)
+            p[i] = pattern[i % sizeof(pattern)] + (ecc_uint8)(i / 256);
+        break;
+    }
+    default:
+        memset(p, 0, n);
+        for (i = 0; i < n / 64; i++)
+            p[rnd() % n] = rnd() >> 24;
+        break;
+    }
+}
+
+/*
+** Sync pattern, BCD address of the next sector and mode
+*/
+static void header(ecc_uint8 *s, int mode)
+{
+    unsigned long a = lba++ + 150;
+    unsigned m = a / 4500, sec = (a / 75) % 60, f = a % 75;
+    memset(s, 0, SECTOR_SIZE);
+    memset(s + 1, 0xFF, 10);
+    s[0x0C] = ((m / 10) << 4) | (m % 10);
+    s[0x0D] = ((sec / 10) << 4) | (sec % 10);
+    s[0x0E] = ((f / 10) << 4) | (f % 10);
+    s[0x0F] = mode;
+}
+
+/*
+** XA subheader, given twice: file, channel, submode, coding
+*/
+static void subheader(ecc_uint8 *s, ecc_uint8 submode)
+{
+    s[0x10] = s[0x14] = 1;
+    s[0x11] = s[0x15] = 0;
+    s[0x12] = s[0x16] = submode;
+    s[0x13] = s[0x17] = 0;
+}
+
+/*
+** One sector of the given kind into s
+*/
+static void make_sector(ecc_uint8 *s, int kind)
+{
+    unsigned i;
+    switch (kind)
+    {
+    case KIND_MODE1:
+    case KIND_JUNK:
+        header(s, 1);
+        fill_data(s + 0x10, 0x800);
+        ecm_eccedc_generate_decode(s, 1);
+        break;
+    case KIND_ZERO:
+        header(s, 1);
+        ecm_eccedc_generate_decode(s, 1);
+        break;
+    case KIND_REPEAT:
+        header(s, 1);
+        for (i = 0; i < 0x800; i++)
+            s[0x10 + i] = i ^ (i >> 8);
+        ecm_eccedc_generate_decode(s, 1);
+        break;
+    case KIND_FORM1:
+        header(s, 2);
+        subheader(s, 0x08);
+        fill_data(s + 0x18, 0x800);
+        ecm_eccedc_generate_decode(s, 2);
+        break;
+    case KIND_FORM2:
+        header(s, 2);
+        subheader(s, 0x24);
+        fill_data(s + 0x18, 0x914);
+        ecm_eccedc_generate_decode(s, 3);
+        break;
+    case KIND_MODE0:
+        header(s, 0);
+        break;
+    case KIND_NOEDC:
+        header(s, 2);
+        subheader(s, 0x24);
+        fill_data(s + 0x18, 0x914);
+        break;
+    case KIND_FORMLESS:
+        header(s, 2);
+        fill_data(s + 0x10, 0x920);
+        break;
+    case KIND_AUDIO:
+        /* 16-bit stereo: two slowly drifting tones and a little noise */
+        for (i = 0; i < SECTOR_SIZE / 4; i++)
+        {
+            double t = (audio_phase++) / 44100.0;
+            int l = 9000 * sin(2 * M_PI * 440 * t) + 3000 * sin(2 * M_PI * 0.5 * t) + (int)(rnd() % 512) - 256;
+            int r = 9000 * sin(2 * M_PI * 660 * t) + (int)(rnd() % 512) - 256;
+            s[4 * i + 0] = l & 0xFF;
+            s[4 * i + 1] = (l >> 8) & 0xFF;
+            s[4 * i + 2] = r & 0xFF;
+            s[4 * i + 3] = (r >> 8) & 0xFF;
+        }
+        break;
+    }
+}
+
+static int put(const ecc_uint8 *p, size_t n)
+{
+    return fwrite(p, 1, n, stdout) != n;
+}
+
+/*
+** Write count sectors of kind; junk sectors are each preceded by a few
+** stray bytes so that no two are 2352 bytes apart
+*/
+static int write_sectors(int kind, unsigned long count)
+{
+    ecc_uint8 s[SECTOR_SIZE];
+    ecc_uint8 stray[64];
+    while (count--)
+    {
+        if (kind == KIND_JUNK)
+        {
+            size_t n = 1 + rnd() % sizeof(stray);
+            size_t i;
+            for (i = 0; i < n; i++)
+                stray[i] = rnd() >> 24;
+            if (put(stray, n))
+                return 1;
+        }
+        make_sector(s, kind);
+        if (put(s, SECTOR_SIZE))
+            return 1;
+    }
+    return 0;
+}
+
+/*
+** A disc: one data track mixing every kind of data sector, then audio
+*/
+static int write_mixed(unsigned long sectors)
+{
+    unsigned long data = sectors * 6 / 10;
+    unsigned long done = 0;
+    static const int pattern[] = {
+        KIND_MODE1, KIND_MODE1, KIND_FORM1, KIND_FORM2, KIND_MODE1, KIND_ZERO, KIND_JUNK,
+        KIND_MODE0, KIND_NOEDC, KIND_FORMLESS};
+    unsigned i = 0;
+    while (done < data)
+    {
+        unsigned long n = 1 + rnd() % 400;
+        if (n > data - done)
+            n = data - done;
+        if (write_sectors(pattern[i++ % (sizeof(pattern) / sizeof(pattern[0]))], n))
+            return 1;
+        done += n;
+    }
+    return write_sectors(KIND_AUDIO, sectors - data);
+}
+
+static void usage(const char *prog_name)
+{
+    int i;
+    fprintf(stderr, "Usage: %s [-n sectors] [-s seed] class > image.bin\nClasses:", prog_name);
+    for (i = 0; classes[i]; i++)
+        fprintf(stderr, " %s", classes[i]);
+    fprintf(stderr, "\n");
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned long sectors = 10000;
+    int kind, opt, error;
+    while ((opt = getopt(argc, argv, "n:s:h")) != -1)
+    {
+        switch (opt)
+        {
+        case 'n':
+            sectors = strtoul(optarg, NULL, 0);
+            break;
+        case 's':
+            seed = strtoul(optarg, NULL, 0);
+            if (!seed)
+                seed = 1;
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (optind != argc - 1)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+    for (kind = 0; classes[kind]; kind++)
+        if (!strcmp(argv[optind], classes[kind]))
+            break;
+    if (!classes[kind])
+    {
+        usage(argv[0]);
+        return 1;
+    }
+    ecm_eccedc_init();
+    if (!strcmp(classes[kind], "mixed"))
+        error = write_mixed(sectors);
+    else
+        error = write_sectors(kind, sectors);
+    if (error || fflush(stdout))
+    {
+        perror("write");
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,440 @@
+/**************************************************************************/
+/*
+** Output sink for the encoder and decoder.
+** Copyright (C) 2024 Jonathan Birge
+**
+***************************************************************************/
+/*
+** Output is collected into blocks that are written behind the codec by the
+** background I/O layer (aio.c).  With background I/O turned off, or if it
+** cannot be started, the bytes go straight to stdio.  When the output is
+** compressed (compress.c), the blocks go to the compressor instead.
+**
+** Long stretches that already sit in a mapped input file can be passed
+** through without copying: copy_file_range() when the output is a regular
+** file, otherwise a write straight from the mapping.
+**
+** For the streaming interface the output is instead collected in memory,
+** in a buffer that grows to the most that is ever pending at once, and
+** handed to the caller with ecm_output_drain.
+**
+** A sparse output (ecm_output_sparse) holds back stretches of zeros and,
+** once there are SPARSE_MIN of them in a row, seeks over them instead of
+** writing them, leaving a hole in the file.  The last zero is written, so
+** a file that ends in zeros still comes out at its full size.
+**
+***************************************************************************/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "ecm.h"
+#include "../config.h"
+
+/* Largest single write queued from caller memory */
+#define PASSTHROUGH_CHUNK (16 * 1048576)
+
+/* Sparse output: zeros are looked for in units of SPARSE_UNIT bytes (or a
+   whole write, if smaller), and runs of SPARSE_MIN or more become holes */
+#define SPARSE_UNIT 65536
+#define SPARSE_MIN 65536
+
+static const ecc_uint8 zeros[SPARSE_UNIT];
+
+void ecm_output_open(struct ecm_output *out, FILE *file)
+{
+    memset(out, 0, sizeof(*out));
+    out->file = file;
+    fflush(file);
+    out->aio = ecm_aio_open(fileno(file), 1);
+    if (out->aio)
+        out->block = ecm_aio_buffer(out->aio, &out->block_size);
+}
+
+/*
+** Start with room for size bytes; returns nonzero if that cannot be had
+*/
+int ecm_output_open_memory(struct ecm_output *out, size_t size)
+{
+    memset(out, 0, sizeof(*out));
+    out->block = malloc(size);
+    out->block_size = size;
+    return !out->block;
+}
+
+/*
+** Leave holes for long runs of zeros from now on, if the output is a
+** regular file with nothing beyond the current position (a hole must not
+** uncover what was there before)
+*/
+void ecm_output_sparse(struct ecm_output *out)
+{
+    unsigned long long offset;
+    struct stat st;
+    off_t at;
+    if (!out->file || out->codec || fstat(fileno(out->file), &st) || !S_ISREG(st.st_mode))
+        return;
+    if (out->aio)
+    {
+        if (!ecm_aio_offset(out->aio, &offset))
+            return;
+        at = offset + out->fill;
+    }
+    else
+    {
+        fflush(out->file);
+        if (fcntl(fileno(out->file), F_GETFL) & O_APPEND)
+            return;
+        at = ftello(out->file);
+    }
+    if ((at >= 0) && (st.st_size <= at))
+        out->sparse = 1;
+}
+
+static void output_write(struct ecm_output *out, const ecc_uint8 *p, size_t n);
+
+/*
+** Write out the zeros held back: as a hole, if there are enough of them
+*/
+static void output_settle(struct ecm_output *out)
+{
+    unsigned long long n = out->zeros;
+    out->zeros = 0;
+    if (n < SPARSE_MIN)
+    {
+        output_write(out, zeros, n);
+        return;
+    }
+    if (out->aio)
+    {
+        if (out->fill)
+            ecm_aio_write(out->aio, out->fill);
+        out->fill = 0;
+        ecm_aio_skip(out->aio, n - 1);
+        out->block = ecm_aio_buffer(out->aio, &out->block_size);
+    }
+    else
+    {
+        fflush(out->file);
+        fseeko(out->file, n - 1, SEEK_CUR);
+    }
+    output_write(out, zeros, 1);
+}
+
+/*
+** Flush everything; returns nonzero if any write failed
+*/
+int ecm_output_close(struct ecm_output *out)
+{
+    int error;
+    if (out->zeros)
+        output_settle(out);
+    if (!out->file)
+    {
+        free(out->block);
+        out->block = NULL;
+        return out->failed;
+    }
+    if (out->codec)
+    {
+        ecm_codec_write(out->codec, out->block, out->fill);
+        error = ecm_codec_close_output(out->codec);
+        free(out->block);
+        out->codec = NULL;
+        out->block = NULL;
+        return error;
+    }
+    if (!out->aio)
+        return (fflush(out->file) != 0) || ferror(out->file);
+    if (out->fill)
+        ecm_aio_write(out->aio, out->fill);
+    error = ecm_aio_close(out->aio);
+    out->aio = NULL;
+    return error != 0;
+}
+
+/*
+** Append to the memory buffer, making room first
+*/
+static void output_memory(struct ecm_output *out, const void *src, size_t n)
+{
+    if (out->fill + n > out->block_size)
+    {
+        memmove(out->block, out->block + out->drained, out->fill - out->drained);
+        out->fill -= out->drained;
+        out->drained = 0;
+    }
+    if (out->fill + n > out->block_size)
+    {
+        size_t size = 2 * out->block_size;
+        ecc_uint8 *block;
+        if (size < out->fill + n)
+            size = out->fill + n;
+        if (size < 65536)
+            size = 65536;
+        block = realloc(out->block, size);
+        if (!block)
+        {
+            out->failed = 1;
+            return;
+        }
+        out->block = block;
+        out->block_size = size;
+    }
+    memcpy(out->block + out->fill, src, n);
+    out->fill += n;
+}
+
+/*
+** Move up to n bytes of memory output to dest; returns the number moved
+*/
+size_t ecm_output_drain(struct ecm_output *out, void *dest, size_t n)
+{
+    if (n > out->fill - out->drained)
+        n = out->fill - out->drained;
+    if (!n)
+        return 0;
+    memcpy(dest, out->block + out->drained, n);
+    out->drained += n;
+    if (out->drained == out->fill)
+        out->fill = out->drained = 0;
+    return n;
+}
+
+/*
+** Bytes of memory output not drained yet
+*/
+size_t ecm_output_pending(const struct ecm_output *out)
+{
+    return out->fill - out->drained;
+}
+
+static void output_next_block(struct ecm_output *out)
+{
+    if (out->codec)
+    {
+        ecm_codec_write(out->codec, out->block, out->fill);
+        out->fill = 0;
+        return;
+    }
+    ecm_aio_write(out->aio, out->fill);
+    out->block = ecm_aio_buffer(out->aio, &out->block_size);
+    out->fill = 0;
+}
+
+void ecm_output_putc(struct ecm_output *out, int c)
+{
+    out->total++;
+    if (out->zeros)
+        output_settle(out);
+    if (!out->file)
+    {
+        ecc_uint8 b = c;
+        output_memory(out, &b, 1);
+        return;
+    }
+    if (!out->aio && !out->codec)
+    {
+        fputc(c, out->file);
+        return;
+    }
+    out->block[out->fill++] = c;
+    if (out->fill == out->block_size)
+        output_next_block(out);
+}
+
+static int output_zero(const ecc_uint8 *p, size_t n)
+{
+    return !p[0] && !memcmp(p, p + 1, n - 1);
+}
+
+static void output_write(struct ecm_output *out, const ecc_uint8 *p, size_t n)
+{
+    if (!out->file)
+    {
+        output_memory(out, p, n);
+        return;
+    }
+    if (!out->aio && !out->codec)
+    {
+        fwrite(p, 1, n, out->file);
+        return;
+    }
+    while (n)
+    {
+        size_t chunk = out->block_size - out->fill;
+        if (chunk > n)
+            chunk = n;
+        memcpy(out->block + out->fill, p, chunk);
+        out->fill += chunk;
+        p += chunk;
+        n -= chunk;
+        if (out->fill == out->block_size)
+            output_next_block(out);
+    }
+}
+
+void ecm_output_write(struct ecm_output *out, const void *src, size_t n)
+{
+    const ecc_uint8 *p = src;
+    out->total += n;
+    if (!out->sparse)
+    {
+        output_write(out, p, n);
+        return;
+    }
+    while (n)
+    {
+        size_t chunk = (n < SPARSE_UNIT) ? n : SPARSE_UNIT;
+        if (output_zero(p, chunk))
+            out->zeros += chunk;
+        else
+        {
+            if (out->zeros)
+                output_settle(out);
+            output_write(out, p, chunk);
+        }
+        p += chunk;
+        n -= chunk;
+    }
+}
+
+#ifdef HAVE_COPY_FILE_RANGE
+/*
+** Copy up to n bytes of the input file starting at the mapped bytes src,
+** to the output file at out_offset (or the current position if NULL).
+** Returns the number copied, which falls short if the kernel refuses.
+*/
+static size_t output_copy_range(
+    struct ecm_output *out,
+    struct ecm_input *in,
+    const ecc_uint8 *src,
+    size_t n,
+    loff_t *out_offset)
+{
+    loff_t in_offset = src - (const ecc_uint8 *)in->map;
+    size_t done = 0;
+    while (done < n)
+    {
+        ssize_t got = copy_file_range(fileno(in->file), &in_offset,
+                                      fileno(out->file), out_offset, n - done, 0);
+        if (got <= 0)
+            break;
+        done += got;
+    }
+    return done;
+}
+#endif
+
+static void output_passthrough(
+    struct ecm_output *out,
+    struct ecm_input *in,
+    const ecc_uint8 *src,
+    size_t n)
+{
+    size_t done = 0;
+#ifdef HAVE_COPY_FILE_RANGE
+    unsigned long long offset;
+    struct stat st;
+#endif
+    /* Memory in or out, or a compressor, takes an ordinary write */
+    if (out->codec || !out->file || !in->map)
+    {
+        output_write(out, src, n);
+        return;
+    }
+    if (!out->aio)
+    {
+        fflush(out->file);
+#ifdef HAVE_COPY_FILE_RANGE
+        if (!fstat(fileno(out->file), &st) && S_ISREG(st.st_mode))
+            done = output_copy_range(out, in, src, n, NULL);
+#endif
+        fwrite(src + done, 1, n - done, out->file);
+        return;
+    }
+    if (out->fill)
+        ecm_aio_write(out->aio, out->fill);
+    out->fill = 0;
+#ifdef HAVE_COPY_FILE_RANGE
+    if (ecm_aio_offset(out->aio, &offset))
+    {
+        loff_t at = offset;
+        done = output_copy_range(out, in, src, n, &at);
+        ecm_aio_skip(out->aio, done);
+    }
+#endif
+    while (done < n)
+    {
+        size_t chunk = (n - done < PASSTHROUGH_CHUNK) ? n - done : PASSTHROUGH_CHUNK;
+        ecm_aio_write_from(out->aio, src + done, chunk);
+        done += chunk;
+    }
+    out->block = ecm_aio_buffer(out->aio, &out->block_size);
+}
+
+/*
+** Write n bytes of mapped input that stay valid until the output is closed,
+** avoiding a copy through the output blocks
+*/
+void ecm_output_passthrough(
+    struct ecm_output *out,
+    struct ecm_input *in,
+    const ecc_uint8 *src,
+    size_t n)
+{
+    out->total += n;
+    if (!out->sparse)
+    {
+        output_passthrough(out, in, src, n);
+        return;
+    }
+    /* Pass through up to the next unit of zeros, and hold that back */
+    while (n)
+    {
+        size_t data = 0;
+        size_t unit = (n < SPARSE_UNIT) ? n : SPARSE_UNIT;
+        while ((data < n) && !output_zero(src + data, unit))
+        {
+            data += unit;
+            unit = (n - data < SPARSE_UNIT) ? n - data : SPARSE_UNIT;
+        }
+        if (data)
+        {
+            if (out->zeros)
+                output_settle(out);
+            output_passthrough(out, in, src, data);
+        }
+        else
+        {
+            out->zeros += unit;
+            data = unit;
+        }
+        src += data;
+        n -= data;
+    }
+}
+
+/*
+** The n bytes that start back bytes before the end of the output, or NULL
+** if they are no longer in memory
+*/
+const ecc_uint8 *ecm_output_recall(const struct ecm_output *out, size_t back, size_t n)
+{
+    if ((n > back) || (back > out->fill - out->drained))
+        return NULL;
+    return out->block + out->fill - back;
+}
+
+/*
+** Bytes written so far
+*/
+unsigned long ecm_output_tell(struct ecm_output *out)
+{
+    return out->total;
+}
@@ -0,0 +1,154 @@
+/**************************************************************************/
+/*
+** Minimal worker pool for running a batch of independent jobs in parallel.
+** Copyright (C) 2024 Jonathan Birge
+**
+***************************************************************************/
+/*
+** ecm_pool_run() hands jobs 0..njobs-1 out to the workers and to the calling
+** thread, and returns once every job has finished.  Jobs must not depend on
+** each other; ordering is up to the caller.
+**
+***************************************************************************/
+
+#include <stdlib.h>
+#include <pthread.h>
+#include "ecm.h"
+
+struct ecm_pool
+{
+    pthread_t *threads;
+    int nthreads;
+    pthread_mutex_t lock;
+    pthread_cond_t start;
+    pthread_cond_t done;
+    void (*fn)(void *arg, unsigned job);
+    void *arg;
+    unsigned njobs;
+    unsigned next;
+    unsigned finished;
+    unsigned generation;
+    int quit;
+};
+
+/*
+** Take and run jobs from the current batch until none are left.
+** Called with the lock held; returns with it held.
+*/
+static void pool_drain(ecm_pool *pool)
+{
+    while (pool->next < pool->njobs)
+    {
+        unsigned job = pool->next++;
+        pthread_mutex_unlock(&pool->lock);
+        pool->fn(pool->arg, job);
+        pthread_mutex_lock(&pool->lock);
+        if (++pool->finished == pool->njobs)
+            pthread_cond_broadcast(&pool->done);
+    }
+}
+
+static void *pool_worker(void *arg)
+{
+    ecm_pool *pool = arg;
+    unsigned seen = 0;
+    pthread_mutex_lock(&pool->lock);
+    for (;;)
+    {
+        while (!pool->quit && pool->generation == seen)
+            pthread_cond_wait(&pool->start, &pool->lock);
+        if (pool->quit)
+            break;
+        seen = pool->generation;
+        pool_drain(pool);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+/*
+** Create a pool of nthreads threads in total, counting the caller
+** (so nthreads - 1 workers are started).  Returns NULL on failure.
+*/
+ecm_pool *ecm_pool_create(int nthreads)
+{
+    ecm_pool *pool;
+    int i;
+    if (nthreads < 1)
+        nthreads = 1;
+    pool = calloc(1, sizeof(*pool));
+    if (!pool)
+        return NULL;
+    pool->threads = calloc(nthreads, sizeof(pthread_t));
+    if (!pool->threads)
+    {
+        free(pool);
+        return NULL;
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->start, NULL);
+    pthread_cond_init(&pool->done, NULL);
+    for (i = 0; i < nthreads - 1; i++)
+    {
+        if (pthread_create(&pool->threads[i], NULL, pool_worker, pool))
+            break;
+        pool->nthreads++;
+    }
+    return pool;
+}
+
+/*
+** Number of threads that run jobs, including the caller
+*/
+int ecm_pool_size(const ecm_pool *pool)
+{
+    return pool ? pool->nthreads + 1 : 1;
+}
+
+/*
+** Run fn(arg, job) for job = 0..njobs-1 and wait for all of them
+*/
+void ecm_pool_run(
+    ecm_pool *pool,
+    void (*fn)(void *arg, unsigned job),
+    void *arg,
+    unsigned njobs)
+{
+    unsigned job;
+    if (!pool || !pool->nthreads)
+    {
+        for (job = 0; job < njobs; job++)
+            fn(arg, job);
+        return;
+    }
+    pthread_mutex_lock(&pool->lock);
+    pool->fn = fn;
+    pool->arg = arg;
+    pool->njobs = njobs;
+    pool->next = 0;
+    pool->finished = 0;
+    pool->generation++;
+    pthread_cond_broadcast(&pool->start);
+    pool_drain(pool);
+    while (pool->finished < pool->njobs)
+        pthread_cond_wait(&pool->done, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void ecm_pool_destroy(ecm_pool *pool)
+{
+    int i;
+    if (!pool)
+        return;
+    pthread_mutex_lock(&pool->lock);
+    pool->quit = 1;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->lock);
+    for (i = 0; i < pool->nthreads; i++)
+        pthread_join(pool->threads[i], NULL);
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->start);
+    pthread_cond_destroy(&pool->done);
+    free(pool->threads);
+    free(pool);
+}
@@ -0,0 +1,335 @@
+/**************************************************************************/
+/*
+** Sector candidate scanner for the encoder's literal path.
+** Copyright (C) 2024 Jonathan Birge
+**
+***************************************************************************/
+/*
+** ecm_check_type can only find a sector at an offset p where either
+**
+**   - bytes p..p+3 repeat at p+4..p+7 (the Mode 2 subheader copy), or
+**   - a Mode 1 sync pattern starts, which at minimum has 00 FF at p and
+**     FF 00 at p+10.
+**
+** ecm_sector_scan returns the first such offset, letting the encoder extend a
+** literal run over everything before it without classifying each byte.
+** Every offset it skips is one where ecm_check_type would have returned 0.
+**
+** ecm_repeat_scan finds where input stops repeating with a period of four bytes,
+** which the encoder uses to reuse classifications across padding.
+**
+***************************************************************************/
+
+#include "ecm.h"
+#include "../config.h"
+
+#if defined(HAVE_IMMINTRIN_H) && defined(__GNUC__) && \
+    (defined(__x86_64__) || defined(__i386__))
+#define SCAN_HAVE_SIMD 1
+#include <immintrin.h>
+#endif
+
+static size_t (*scan_impl)(const ecc_uint8 *, size_t);
+static size_t (*repeat_impl)(const ecc_uint8 *, size_t);
+static int scan_impl_tier;
+static int scan_best_tier;
+
+static const char *scan_tier_names[SCAN_TIER_COUNT] = {
+    "scalar", "sse2", "avx2"};
+
+/***************************************************************************/
+/*
+** Reference scanner
+*/
+size_t ecm_sector_scan_scalar(const ecc_uint8 *buf, size_t n)
+{
+    size_t i;
+    for (i = 0; i < n; i++)
+    {
+        const ecc_uint8 *p = buf + i;
+        if ((p[0] == p[4]) && (p[1] == p[5]) && (p[2] == p[6]) && (p[3] == p[7]))
+            return i;
+        if ((p[0] == 0x00) && (p[1] == 0xFF) && (p[10] == 0xFF) && (p[11] == 0x00))
+            return i;
+    }
+    return n;
+}
+
+size_t ecm_repeat_scan_scalar(const ecc_uint8 *buf, size_t n)
+{
+    size_t i;
+    for (i = 0; i < n; i++)
+        if (buf[i] != buf[i + 4])
+            return i;
+    return n;
+}
+
+#ifdef SCAN_HAVE_SIMD
+/***************************************************************************/
+/*
+** SSE2: 16 offsets per step
+*/
+__attribute__((target("sse2"))) static size_t sector_scan_sse2(
+    const ecc_uint8 *buf,
+    size_t n)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i ones = _mm_set1_epi8((char)0xFF);
+    size_t i;
+    for (i = 0; i + 16 <= n; i += 16)
+    {
+        const ecc_uint8 *p = buf + i;
+        __m128i v0 = _mm_loadu_si128((const __m128i *)(p + 0));
+        __m128i v1 = _mm_loadu_si128((const __m128i *)(p + 1));
+        __m128i repeat = _mm_and_si128(
+            _mm_and_si128(
+                _mm_cmpeq_epi8(v0, _mm_loadu_si128((const __m128i *)(p + 4))),
+                _mm_cmpeq_epi8(v1, _mm_loadu_si128((const __m128i *)(p + 5)))),
+            _mm_and_si128(
+                _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(p + 2)),
+                               _mm_loadu_si128((const __m128i *)(p + 6))),
+                _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(p + 3)),
+                               _mm_loadu_si128((const __m128i *)(p + 7)))));
+        __m128i sync = _mm_and_si128(
+            _mm_and_si128(_mm_cmpeq_epi8(v0, zero), _mm_cmpeq_epi8(v1, ones)),
+            _mm_and_si128(
+                _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(p + 10)), ones),
+                _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(p + 11)), zero)));
+        int mask = _mm_movemask_epi8(_mm_or_si128(repeat, sync));
+        if (mask)
+            return i + __builtin_ctz(mask);
+    }
+    return i + ecm_sector_scan_scalar(buf + i, n - i);
+}
+
+__attribute__((target("sse2"))) static size_t repeat_scan_sse2(
+    const ecc_uint8 *buf,
+    size_t n)
+{
+    size_t i;
+    for (i = 0; i + 16 <= n; i += 16)
+    {
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(
+            _mm_loadu_si128((const __m128i *)(buf + i)),
+            _mm_loadu_si128((const __m128i *)(buf + i + 4))));
+        if (mask != 0xFFFF)
+            return i + __builtin_ctz(~mask);
+    }
+    return i + ecm_repeat_scan_scalar(buf + i, n - i);
+}
+
+/***************************************************************************/
+/*
+** AVX2: 32 offsets per step
+*/
+__attribute__((target("avx2"))) static size_t sector_scan_avx2(
+    const ecc_uint8 *buf,
+    size_t n)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i ones = _mm256_set1_epi8((char)0xFF);
+    size_t i;
+    for (i = 0; i + 32 <= n; i += 32)
+    {
+        const ecc_uint8 *p = buf + i;
+        __m256i v0 = _mm256_loadu_si256((const __m256i *)(p + 0));
+        __m256i v1 = _mm256_loadu_si256((const __m256i *)(p + 1));
+        __m256i repeat = _mm256_and_si256(
+            _mm256_and_si256(
+                _mm256_cmpeq_epi8(v0, _mm256_loadu_si256((const __m256i *)(p + 4))),
+                _mm256_cmpeq_epi8(v1, _mm256_loadu_si256((const __m256i *)(p + 5)))),
+            _mm256_and_si256(
+                _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(p + 2)),
+                                  _mm256_loadu_si256((const __m256i *)(p + 6))),
+                _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(p + 3)),
+                                  _mm256_loadu_si256((const __m256i *)(p + 7)))));
+        __m256i sync = _mm256_and_si256(
+            _mm256_and_si256(_mm256_cmpeq_epi8(v0, zero), _mm256_cmpeq_epi8(v1, ones)),
+            _mm256_and_si256(
+                _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(p + 10)), ones),
+                _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(p + 11)), zero)));
+        unsigned mask = (unsigned)_mm256_movemask_epi8(_mm256_or_si256(repeat, sync));
+        if (mask)
+            return i + __builtin_ctz(mask);
+    }
+    return i + sector_scan_sse2(buf + i, n - i);
+}
+
+__attribute__((target("avx2"))) static size_t repeat_scan_avx2(
+    const ecc_uint8 *buf,
+    size_t n)
+{
+    size_t i;
+    for (i = 0; i + 32 <= n; i += 32)
+    {
+        unsigned mask = (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(
+            _mm256_loadu_si256((const __m256i *)(buf + i)),
+            _mm256_loadu_si256((const __m256i *)(buf + i + 4))));
+        if (mask != 0xFFFFFFFF)
+            return i + __builtin_ctz(~mask);
+    }
+    return i + repeat_scan_sse2(buf + i, n - i);
+}
+#endif
+
+/***************************************************************************/
+/*
+** Pick the scanner; called from ecm_eccedc_init
+*/
+void ecm_scan_init(void)
+{
+    scan_impl = ecm_sector_scan_scalar;
+    repeat_impl = ecm_repeat_scan_scalar;
+    scan_impl_tier = SCAN_TIER_SCALAR;
+#ifdef SCAN_HAVE_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+    {
+        scan_impl = sector_scan_avx2;
+        repeat_impl = repeat_scan_avx2;
+        scan_impl_tier = SCAN_TIER_AVX2;
+    }
+    else if (__builtin_cpu_supports("sse2"))
+    {
+        scan_impl = sector_scan_sse2;
+        repeat_impl = repeat_scan_sse2;
+        scan_impl_tier = SCAN_TIER_SSE2;
+    }
+#endif
+    scan_best_tier = scan_impl_tier;
+}
+
+/*
+** Switch to another scanner, for benchmarks and differential checks;
+** returns nonzero if this CPU cannot run it.  Must not be called while
+** other threads are scanning.
+*/
+int ecm_scan_set_tier(int tier)
+{
+    if ((tier < SCAN_TIER_SCALAR) || (tier > scan_best_tier))
+        return -1;
+    switch (tier)
+    {
+    case SCAN_TIER_SCALAR:
+        scan_impl = ecm_sector_scan_scalar;
+        repeat_impl = ecm_repeat_scan_scalar;
+        break;
+#ifdef SCAN_HAVE_SIMD
+    case SCAN_TIER_SSE2:
+        scan_impl = sector_scan_sse2;
+        repeat_impl = repeat_scan_sse2;
+        break;
+    case SCAN_TIER_AVX2:
+        scan_impl = sector_scan_avx2;
+        repeat_impl = repeat_scan_avx2;
+        break;
+#endif
+    }
+    scan_impl_tier = tier;
+    return 0;
+}
+
+/*
+** Return the first offset below n at which a sector could start, or n if
+** there is none.  buf must be readable up to n + 11.
+*/
+size_t ecm_sector_scan(const ecc_uint8 *buf, size_t n)
+{
+    return scan_impl(buf, n);
+}
+
+/*
+** Return the first offset i below n where buf[i] != buf[i + 4], or n if the
+** bytes repeat with period four throughout.  buf must be readable up to
+** n + 3.
+*/
+size_t ecm_repeat_scan(const ecc_uint8 *buf, size_t n)
+{
+    return repeat_impl(buf, n);
+}
+
+const char *ecm_scan_tier_name(void)
+{
+    return scan_tier_names[scan_impl_tier];
+}
+
+/***************************************************************************/
+/*
+** Check the vector scanners against the scalar ones, on random data seeded
+** with near-miss sync and subheader patterns at every lane position, and on
+** repeating runs that break at every lane position.
+** Returns 0 if they all agree.
+*/
+int ecm_scan_selftest(int verbose)
+{
+    static ecc_uint8 buf[4096 + 32];
+    size_t (*impl[SCAN_TIER_COUNT])(const ecc_uint8 *, size_t);
+    size_t (*repeat[SCAN_TIER_COUNT])(const ecc_uint8 *, size_t);
+    const char *names[SCAN_TIER_COUNT];
+    ecc_uint32 seed = 0x2545F491;
+    ecc_uint32 tier, ntiers = 0, round, i, at;
+    int errors = 0, tier_errors;
+#ifdef SCAN_HAVE_SIMD
+    if (scan_best_tier >= SCAN_TIER_SSE2)
+    {
+        impl[ntiers] = sector_scan_sse2;
+        repeat[ntiers] = repeat_scan_sse2;
+        names[ntiers++] = scan_tier_names[SCAN_TIER_SSE2];
+    }
+    if (scan_best_tier >= SCAN_TIER_AVX2)
+    {
+        impl[ntiers] = sector_scan_avx2;
+        repeat[ntiers] = repeat_scan_avx2;
+        names[ntiers++] = scan_tier_names[SCAN_TIER_AVX2];
+    }
+#endif
+    for (tier = 0; tier < ntiers; tier++)
+    {
+        tier_errors = 0;
+        for (round = 0; round < 512; round++)
+        {
+            for (i = 0; i < sizeof(buf); i++)
+            {
+                seed = seed * 1103515245 + 12345;
+                buf[i] = seed >> 16;
+            }
+            seed = seed * 1103515245 + 12345;
+            at = (seed >> 8) % 4096;
+            switch (round % 4)
+            {
+            case 0: /* sync prefix */
+                buf[at] = 0x00;
+                buf[at + 1] = 0xFF;
+                buf[at + 10] = 0xFF;
+                buf[at + 11] = (round & 4) ? 0x00 : 0x01;
+                break;
+            case 1: /* subheader copy, sometimes off by one byte */
+                for (i = 0; i < 4; i++)
+                    buf[at + 4 + i] = buf[at + i];
+                if (round & 4)
+                    buf[at + 7] ^= 1;
+                break;
+            }
+            for (i = 0; i < 64; i++)
+            {
+                size_t n = (i * 67 + round) % 4096;
+                if (impl[tier](buf + (i & 15), n) != ecm_sector_scan_scalar(buf + (i & 15), n))
+                    tier_errors++;
+            }
+            /* Period-four fill that breaks at a random offset */
+            for (i = 4; i < at + 4; i++)
+                buf[i] = buf[i - 4];
+            for (i = 0; i < 64; i++)
+            {
+                size_t n = (i * 67 + round) % 4096;
+                if (repeat[tier](buf + (i & 3), n) != ecm_repeat_scan_scalar(buf + (i & 3), n))
+                    tier_errors++;
+            }
+        }
+        if (verbose)
+            fprintf(stderr, "Scan %-7s %s\n", names[tier],
+                    tier_errors ? "FAILED" : "ok");
+        errors += tier_errors;
+    }
+    return errors != 0;
+}
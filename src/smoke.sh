@@ -0,0 +1,117 @@
+#!/bin/sh
+#
+# make check: synthetic images encoded and decoded by ecm, whole and by
+# --range, and read back through an ecmfs mount when ecmfs is built and
+# FUSE can be used here.  Runs in the build directory.
+#
+
+tmp=smoke.tmp
+status=0
+mounted=
+
+fail()
+{
+    echo "FAIL: $*"
+    status=1
+}
+
+cleanup()
+{
+    if [ -n "$mounted" ]; then
+        fusermount3 -u "$tmp/mnt" 2>/dev/null || fusermount -u "$tmp/mnt" 2>/dev/null
+    fi
+    rm -rf "$tmp"
+}
+
+# Bytes offset to offset+length of file
+slice()
+{
+    tail -c +$(($2 + 1)) "$1" | head -c "$3"
+}
+
+rm -rf "$tmp" && mkdir "$tmp" "$tmp/images" || exit 1
+trap cleanup EXIT
+
+# A repeat image under --dedup is one long chain of copies, each of the
+# sector before
+for class in mode1 mixed repeat; do
+    ./mkimage -n 4000 $class > "$tmp/$class.bin" || fail "mkimage $class"
+    for options in "" "-T 4" "--v2" "--v2 -T 4" "--v2 --dedup" "--v2=2048 --dedup"; do
+        if ./ecm $options -o "$tmp/$class.ecm" "$tmp/$class.bin" 2>/dev/null &&
+           ./ecm -d -o "$tmp/$class.out" "$tmp/$class.ecm" 2>/dev/null &&
+           cmp -s "$tmp/$class.out" "$tmp/$class.bin"; then :; else
+            fail "$class round trip with '$options'"
+        fi
+        rm -f "$tmp/$class.out"
+        # A read across sector boundaries, and one at the very end
+        size=$(wc -c < "$tmp/$class.bin")
+        for range in 1000000:100000 $((size - 2352)):2352; do
+            offset=${range%:*}
+            length=${range#*:}
+            ./ecm -d --range=$range -o "$tmp/range.out" "$tmp/$class.ecm" 2>/dev/null &&
+                slice "$tmp/$class.bin" $offset $length | cmp -s - "$tmp/range.out" ||
+                fail "$class --range=$range with '$options'"
+            rm -f "$tmp/range.out"
+        done
+        ! ./ecm -d --range=$size -o "$tmp/range.out" "$tmp/$class.ecm" 2>/dev/null ||
+            fail "$class --range past the end with '$options'"
+        rm -f "$tmp/range.out"
+    done
+    ./ecm --v2 -o "$tmp/images/$class.ecm" "$tmp/$class.bin" 2>/dev/null || fail "encode $class"
+done
+
+# A v2 block header claiming more records than a block can hold is
+# refused before a buffer is allocated for them, read through a pipe so
+# that the records are not in a mapping
+cp "$tmp/images/mode1.ecm" "$tmp/hostile.ecm"
+printf '\360\377\377\377' | dd of="$tmp/hostile.ecm" bs=1 seek=8 conv=notrunc 2>/dev/null
+! cat "$tmp/hostile.ecm" | ./ecm -d -o "$tmp/hostile.out" 2>/dev/null ||
+    fail "v2 block with an oversized length decoded"
+rm -f "$tmp/hostile.ecm" "$tmp/hostile.out"
+
+# A compressed file must decode whole, and fail when cut short anywhere,
+# down to the last byte of the xz footer
+if ./ecm --compress=xz -o "$tmp/mixed.ecm.xz" "$tmp/mixed.bin" 2>/dev/null; then
+    ./ecm -d -o "$tmp/mixed.out" "$tmp/mixed.ecm.xz" 2>/dev/null &&
+        cmp -s "$tmp/mixed.out" "$tmp/mixed.bin" || fail "mixed round trip with '--compress=xz'"
+    size=$(wc -c < "$tmp/mixed.ecm.xz")
+    for cut in 1 4 12 40; do
+        head -c $((size - cut)) "$tmp/mixed.ecm.xz" > "$tmp/cut.ecm.xz"
+        ! ./ecm -d -o "$tmp/mixed.out" "$tmp/cut.ecm.xz" 2>/dev/null ||
+            fail "xz file $cut bytes short decoded"
+    done
+    rm -f "$tmp/mixed.out" "$tmp/cut.ecm.xz"
+else
+    echo "SKIP: xz round trip (xz not built)"
+fi
+
+if [ ! -x ./ecmfs ]; then
+    echo "SKIP: ecmfs mount (ecmfs not built)"
+elif [ ! -c /dev/fuse ] || ! command -v fusermount3 > /dev/null 2>&1; then
+    echo "SKIP: ecmfs mount (no FUSE here)"
+else
+    mkdir "$tmp/mnt"
+    if ./ecmfs -o cache=8 "$tmp/images" "$tmp/mnt"; then
+        mounted=1
+        for class in mode1 mixed repeat; do
+            cmp -s "$tmp/mnt/$class" "$tmp/$class.bin" || fail "ecmfs read of $class"
+            slice "$tmp/mnt/$class" 1000000 100000 > "$tmp/range.out"
+            slice "$tmp/$class.bin" 1000000 100000 | cmp -s - "$tmp/range.out" ||
+                fail "ecmfs partial read of $class"
+        done
+        # Both images at once, each read by two readers
+        for class in mode1 mixed mode1 mixed; do
+            cmp -s "$tmp/mnt/$class" "$tmp/$class.bin" || echo "$class" >> "$tmp/failed" &
+        done
+        wait
+        [ ! -s "$tmp/failed" ] || fail "concurrent ecmfs reads of $(sort -u "$tmp/failed" | tr '\n' ' ')"
+        # A changed file is indexed again, once FUSE's attributes time out
+        cp "$tmp/images/mixed.ecm" "$tmp/images/mode1.ecm"
+        sleep 2
+        cmp -s "$tmp/mnt/mode1" "$tmp/mixed.bin" || fail "ecmfs read of a changed file"
+    else
+        fail "ecmfs mount"
+    fi
+fi
+
+exit $status
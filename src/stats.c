@@ -0,0 +1,316 @@
+/**************************************************************************/
+/*
+** Stage timing and progress for --stats.
+** Copyright (C) 2024 Jonathan Birge
+**
+***************************************************************************/
+/*
+** The codecs charge the time they spend to a few stages: reading, sector
+** classification, EDC, ECC and writing.  Time is taken from the TSC where
+** there is one (a few cycles, no system call) and from the monotonic clock
+** otherwise, and converted to seconds at report time.  Stages run on any
+** thread, so a stage's time is summed over the threads that ran it; idle is
+** whatever is left of the elapsed time multiplied by the threads, so it
+** also covers threads waiting on each other.
+**
+** Hot loops add up their time in local arrays (ecm_stats_tally) and hand
+** it over now and then (ecm_stats_add); the occasional lap straight into
+** the totals (ecm_stats_lap) is an atomic add.  A progress line goes out at
+** most once a second, checked only when a caller passes a megabyte mark.
+** The final report adds a breakdown by record type.  The classes only v2
+** blocks have (formless, zero user data, zero EDC) and copies (--dedup) are
+** counted apart, and shown only where they can occur.
+**
+** Text reports and JSON (one object per line) both go to stderr, since
+** stdout may be carrying the data.
+**
+***************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "ecm.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define STATS_HAVE_TSC 1
+#include <x86intrin.h>
+#endif
+
+#define STATS_INTERVAL 1.0
+
+static const char *stage_names[STAT_COUNT] = {
+    "read", "classify", "edc", "ecc", "write", "idle"};
+
+static const char *record_names[STAT_RECORDS] = {
+    "literal", "mode1", "mode2form1", "mode2form2", "formless", "zero", "noedc", "copy"};
+
+static int stats_format = ECM_STATS_OFF;
+
+/***************************************************************************/
+
+/*
+** Turn reports on; format is "text", "json", or NULL for text.  Returns
+** nonzero if the format is unknown.
+*/
+int ecm_stats_select(const char *format)
+{
+    if (!format || !strcmp(format, "text"))
+        stats_format = ECM_STATS_TEXT;
+    else if (!strcmp(format, "json"))
+        stats_format = ECM_STATS_JSON;
+    else
+        return -1;
+    return 0;
+}
+
+static double wall_time(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static unsigned long long stats_clock(void)
+{
+#ifdef STATS_HAVE_TSC
+    return __rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+/*
+** Start timing an operation ("encode" or "decode") over total input bytes
+** (0 if unknown) on threads threads.  Returns NULL if --stats is off.
+*/
+struct ecm_stats *ecm_stats_open(const char *operation, unsigned long long total, int threads)
+{
+    struct ecm_stats *st;
+    if (stats_format == ECM_STATS_OFF)
+        return NULL;
+    st = calloc(1, sizeof(*st));
+    if (!st)
+        return NULL;
+    st->format = stats_format;
+    st->operation = operation;
+    st->total = total;
+    st->threads = (threads > 0) ? threads : 1;
+    st->classes = STAT_RECORD_FORMLESS;
+    st->start_time = st->last_report = wall_time();
+    st->start = stats_clock();
+    return st;
+}
+
+/*
+** The clock, or 0 when not timing
+*/
+unsigned long long ecm_stats_now(const struct ecm_stats *st)
+{
+    return st ? stats_clock() : 0;
+}
+
+/*
+** Charge the time since since to stage in the local array cycles; returns
+** the time now, to start the next lap from
+*/
+unsigned long long ecm_stats_tally(
+    const struct ecm_stats *st,
+    unsigned long long *cycles,
+    int stage,
+    unsigned long long since)
+{
+    unsigned long long now;
+    if (!st)
+        return 0;
+    now = stats_clock();
+    cycles[stage] += now - since;
+    return now;
+}
+
+/*
+** Charge the time since since to stage directly
+*/
+unsigned long long ecm_stats_lap(struct ecm_stats *st, int stage, unsigned long long since)
+{
+    unsigned long long now;
+    if (!st)
+        return 0;
+    now = stats_clock();
+    __atomic_fetch_add(&st->cycles[stage], now - since, __ATOMIC_RELAXED);
+    return now;
+}
+
+/*
+** Hand over the time tallied in cycles, and clear it
+*/
+void ecm_stats_add(struct ecm_stats *st, unsigned long long *cycles)
+{
+    int i;
+    if (!st)
+        return;
+    for (i = 0; i < STAT_COUNT; i++)
+        if (cycles[i])
+        {
+            __atomic_fetch_add(&st->cycles[i], cycles[i], __ATOMIC_RELAXED);
+            cycles[i] = 0;
+        }
+}
+
+/*
+** Report the first classes record classes: STAT_RECORD_COPY when the v2
+** classes can occur, STAT_RECORDS when copies can too
+*/
+void ecm_stats_classes(struct ecm_stats *st, unsigned classes)
+{
+    if (st)
+        st->classes = classes;
+}
+
+/*
+** Count count units (sectors, or bytes for literals) in one record of kind
+*/
+void ecm_stats_record(struct ecm_stats *st, unsigned kind, unsigned long count)
+{
+    unsigned class = kind & 3;
+    if (!st)
+        return;
+    if (kind == RECORD_COPY)
+        class = STAT_RECORD_COPY;
+    else if (kind && !class)
+        class = STAT_RECORD_FORMLESS;
+    else if (kind & RECORD_ZERO)
+        class = STAT_RECORD_ZERO;
+    else if (kind & RECORD_NOEDC)
+        class = STAT_RECORD_NOEDC;
+    __atomic_fetch_add(&st->records[class], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&st->units[class], count, __ATOMIC_RELAXED);
+}
+
+/***************************************************************************/
+
+/*
+** Seconds per clock tick, from the elapsed wall time
+*/
+static double tick_seconds(const struct ecm_stats *st, double elapsed)
+{
+    unsigned long long ticks = stats_clock() - st->start;
+#ifdef STATS_HAVE_TSC
+    return ticks ? elapsed / ticks : 0;
+#else
+    (void)ticks;
+    (void)elapsed;
+    return 1e-9;
+#endif
+}
+
+/*
+** Seconds per stage, with idle as what is left of the threads' time
+*/
+static void stage_seconds(const struct ecm_stats *st, double elapsed, double *seconds)
+{
+    double tick = tick_seconds(st, elapsed);
+    double busy = 0;
+    int i;
+    for (i = 0; i < STAT_IDLE; i++)
+    {
+        seconds[i] = __atomic_load_n(&st->cycles[i], __ATOMIC_RELAXED) * tick;
+        busy += seconds[i];
+    }
+    seconds[STAT_IDLE] = elapsed * st->threads - busy;
+    if (seconds[STAT_IDLE] < 0)
+        seconds[STAT_IDLE] = 0;
+}
+
+static void report(struct ecm_stats *st, int final)
+{
+    double now = wall_time();
+    double elapsed = now - st->start_time;
+    double seconds[STAT_COUNT], all = 0;
+    double rate = (elapsed > 0) ? st->done / elapsed : 0;
+    double eta = -1;
+    double sectors = 0;
+    int i;
+    stage_seconds(st, elapsed, seconds);
+    for (i = 0; i < STAT_COUNT; i++)
+        all += seconds[i];
+    if (!all)
+        all = 1;
+    if (!final && st->total && (rate > 0) && (st->done <= st->total))
+        eta = (st->total - st->done) / rate;
+    if (st->format == ECM_STATS_JSON)
+    {
+        fprintf(stderr, "{\"event\": \"%s\", \"operation\": \"%s\", \"elapsed_s\": %.3f, "
+                        "\"bytes_in\": %llu, \"total\": %llu, \"mb_per_s\": %.2f",
+                final ? "done" : "progress", st->operation, elapsed, st->done, st->total,
+                rate / 1048576);
+        if (final)
+            fprintf(stderr, ", \"bytes_out\": %llu", st->written);
+        if (eta >= 0)
+            fprintf(stderr, ", \"eta_s\": %.1f", eta);
+        fprintf(stderr, ", \"threads\": %d, \"stages_s\": {", st->threads);
+        for (i = 0; i < STAT_COUNT; i++)
+            fprintf(stderr, "%s\"%s\": %.4f", i ? ", " : "", stage_names[i], seconds[i]);
+        fprintf(stderr, "}, \"records\": {");
+        for (i = 0; i < (int)st->classes; i++)
+            fprintf(stderr, "%s\"%s\": {\"records\": %llu, \"%s\": %llu}", i ? ", " : "",
+                    record_names[i], st->records[i], i ? "sectors" : "bytes", st->units[i]);
+        fprintf(stderr, "}}\n");
+        return;
+    }
+    if (!final)
+    {
+        fprintf(stderr, "%s: %llu MB", st->operation, st->done >> 20);
+        if (st->total)
+            fprintf(stderr, " of %llu MB", st->total >> 20);
+        fprintf(stderr, ", %.1f MB/s", rate / 1048576);
+        if (eta >= 0)
+            fprintf(stderr, ", ETA %lu:%02lu", (unsigned long)eta / 60, (unsigned long)eta % 60);
+        fprintf(stderr, " |");
+        for (i = 0; i < STAT_COUNT; i++)
+            fprintf(stderr, " %s %.0f%%", stage_names[i], 100 * seconds[i] / all);
+        fprintf(stderr, "\n");
+        return;
+    }
+    for (i = 1; i < STAT_RECORDS; i++)
+        sectors += st->units[i];
+    fprintf(stderr, "Stats: %s %llu bytes -> %llu bytes in %.3f s, %.1f MB/s, %.0f sectors/s, %d thread%s\n",
+            st->operation, st->done, st->written, elapsed, rate / 1048576,
+            (elapsed > 0) ? sectors / elapsed : 0, st->threads, (st->threads == 1) ? "" : "s");
+    for (i = 0; i < STAT_COUNT; i++)
+        fprintf(stderr, "  %-10s %10.3f s %6.1f%%\n", stage_names[i], seconds[i], 100 * seconds[i] / all);
+    for (i = 0; i < (int)st->classes; i++)
+        fprintf(stderr, "  %-10s %10llu records %12llu %s\n", record_names[i],
+                st->records[i], st->units[i], i ? "sectors" : "bytes");
+}
+
+/*
+** Note progress through done input bytes; reports if it is time to
+*/
+void ecm_stats_progress(struct ecm_stats *st, unsigned long long done)
+{
+    double now;
+    if (!st)
+        return;
+    st->done = done;
+    now = wall_time();
+    if (now - st->last_report < STATS_INTERVAL)
+        return;
+    st->last_report = now;
+    report(st, 0);
+}
+
+/*
+** Final report, after done input bytes became written output bytes
+*/
+void ecm_stats_close(struct ecm_stats *st, unsigned long long done, unsigned long long written)
+{
+    if (!st)
+        return;
+    st->done = done;
+    st->written = written;
+    report(st, 1);
+    free(st);
+}